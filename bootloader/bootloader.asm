@@ -2,9 +2,19 @@
 BITS 16
 ORG 0x7C00
 
-KERNEL_OFFSET equ 0x1000
-KERNEL_SECTORS equ 64      ; Total sectors to read
-MAX_SECTORS_PER_READ equ 16 ; Maximum sectors to read in one operation
+KERNEL_OFFSET equ 0x10000  ; Above the boot sector, below the 0x90000 stack
+KERNEL_SEGMENT equ KERNEL_OFFSET >> 4
+KERNEL_SECTORS equ 256     ; Total sectors to read (128 KB)
+SECTORS_PER_TRACK equ 18
+
+; BIOS memory map handed to the kernel (see kernel/pmm.h)
+E820_MAP equ 0x500          ; Entry count (dword), entries start at +8
+E820_MAX_ENTRIES equ 32
+E820_ENTRY_SIZE equ 24
+SMAP_SIGNATURE equ 0x534D4150
+
+    jmp short start         ; Skip over the GDT below
+    nop
 
 ; GDT
 gdt_start:
@@ -43,70 +53,58 @@ start:
     jmp disk_error
 
 load_kernel:
-    xor ax, ax
+    mov ax, KERNEL_SEGMENT
     mov es, ax
-    mov bx, KERNEL_OFFSET
     mov word [sectors_read], 0
     mov byte [current_track], 0
     mov byte [current_head], 0
     mov byte [current_sector], 2
 
-read_next_chunk:
-    mov ax, KERNEL_SECTORS
-    sub ax, [sectors_read]
-    jz protected_mode_switch
-    
-    cmp ax, MAX_SECTORS_PER_READ
-    jbe .do_read
-    mov ax, MAX_SECTORS_PER_READ
-
-.do_read:
-    push ax
-    mov ah, 0x02
-    mov al, [esp]
+; Read one sector at a time into ES:0, so no read crosses a track or a
+; 64 KB DMA boundary
+read_next_sector:
+    cmp word [sectors_read], KERNEL_SECTORS
+    jae protected_mode_switch
+
+    mov si, 3
+.retry_read:
+    mov ax, 0x0201          ; Read one sector
+    xor bx, bx
     mov ch, [current_track]
     mov cl, [current_sector]
     mov dh, [current_head]
     mov dl, [boot_drive]
-    
-    mov si, 3
-.retry_read:
-    pusha
     int 0x13
     jnc .read_ok
-    
-    popa
+
     dec si
     jz disk_error
-    
+
     xor ax, ax
     int 0x13
     jmp .retry_read
 
 .read_ok:
-    popa
-    pop ax
-    
-    add [sectors_read], ax
-    
-    ; Update buffer pointer (bx += sectors * 512)
-    mov cx, ax
-    shl ax, 9
-    add bx, ax
-    
+    inc word [sectors_read]
+
+    ; Advance the buffer by one sector
+    mov ax, es
+    add ax, 512 >> 4
+    mov es, ax
+
     ; Update CHS
     call update_chs
-    jmp read_next_chunk
+    jmp read_next_sector
 
 update_chs:
     inc byte [current_sector]
-    cmp byte [current_sector], 19
-    jle .done
+    cmp byte [current_sector], SECTORS_PER_TRACK
+    jbe .done
     
     mov byte [current_sector], 1
     inc byte [current_head]
     cmp byte [current_head], 2
-    jl .done
+    jb .done
     
     mov byte [current_head], 0
     inc byte [current_track]
@@ -114,6 +112,7 @@ update_chs:
     ret
 
 protected_mode_switch:
+    call detect_memory
     cli
     lgdt [gdt_descriptor]
     
@@ -123,6 +122,37 @@ protected_mode_switch:
     
     jmp CODE_SEG:protected_mode
 
+; Collect the BIOS E820 memory map at E820_MAP
+detect_memory:
+    xor ax, ax
+    mov es, ax
+    mov di, E820_MAP + 8
+    xor ebx, ebx
+    xor bp, bp              ; Entries stored
+.next:
+    mov eax, 0xE820
+    mov ecx, E820_ENTRY_SIZE
+    mov edx, SMAP_SIGNATURE
+    mov dword [es:di + 20], 1   ; Treat 20-byte entries as valid
+    int 0x15
+    jc .done                ; Unsupported, or end of list
+    cmp eax, SMAP_SIGNATURE
+    jne .done
+    mov eax, [es:di + 8]    ; Skip zero-length entries
+    or eax, [es:di + 12]
+    jz .skip
+    inc bp
+    add di, E820_ENTRY_SIZE
+    cmp bp, E820_MAX_ENTRIES
+    jae .done
+.skip:
+    test ebx, ebx
+    jnz .next
+.done:
+    mov [E820_MAP], bp
+    mov word [E820_MAP + 2], 0
+    ret
+
 disk_error:
     mov si, msg_error
     call print_string
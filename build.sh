@@ -4,9 +4,26 @@
 CC=x86_64-elf-gcc
 LD=x86_64-elf-ld
 NASM=nasm
+NASMFLAGS="-f elf32"
 CFLAGS="-m32 -ffreestanding -nostdlib -nostdinc -fno-builtin -fno-stack-protector -nostartfiles -nodefaultlibs -Wall -Wextra -fno-common -I. -I./libs -I./kernel -I./drivers"
 LDFLAGS="-melf_i386 -T linker.ld"
 
+# BENCH=1 ./build.sh runs the in-kernel benchmarks at boot
+if [ "$BENCH" = "1" ]; then
+    CFLAGS="$CFLAGS -DTKOS_BENCH"
+fi
+
+# PROFILE=1 timestamps every interrupt and keeps per-vector histograms
+if [ "$PROFILE" = "1" ]; then
+    CFLAGS="$CFLAGS -DISR_PROFILE"
+    NASMFLAGS="$NASMFLAGS -DISR_PROFILE"
+fi
+
+# LOCKSTAT=1 counts acquisitions, spinning and hold times for every lock
+if [ "$LOCKSTAT" = "1" ]; then
+    CFLAGS="$CFLAGS -DLOCK_STAT"
+fi
+
 # Create build directory
 mkdir -p build
 
@@ -17,25 +34,77 @@ rm -f build/*.o build/*.bin build/*.img
 $NASM -f bin bootloader/bootloader.asm -o build/bootloader.bin
 
 # Compile assembly files
-$NASM -f elf32 kernel/isr.asm -o build/isr_asm.o
+$NASM $NASMFLAGS kernel/isr.asm -o build/isr_asm.o
+$NASM $NASMFLAGS kernel/syscall.asm -o build/syscall_asm.o
+$NASM $NASMFLAGS kernel/switch.asm -o build/switch_asm.o
+$NASM $NASMFLAGS kernel/trampoline.asm -o build/trampoline_asm.o
 
 # Compile C source files
+$CC $CFLAGS -c kernel/cpu.c -o build/cpu.o
+$CC $CFLAGS -c kernel/gdt.c -o build/gdt.o
 $CC $CFLAGS -c kernel/isr.c -o build/isr.o
+$CC $CFLAGS -c kernel/fpu.c -o build/fpu.o
+$CC $CFLAGS -c kernel/syscall.c -o build/syscall.o
 $CC $CFLAGS -c kernel/idt.c -o build/idt.o
 $CC $CFLAGS -c kernel/pic.c -o build/pic.o
+$CC $CFLAGS -c kernel/pit.c -o build/pit.o
+$CC $CFLAGS -c kernel/clock.c -o build/clock.o
+$CC $CFLAGS -c kernel/idle.c -o build/idle.o
+$CC $CFLAGS -c kernel/timer.c -o build/timer.o
+$CC $CFLAGS -c kernel/sched.c -o build/sched.o
+$CC $CFLAGS -c kernel/smp.c -o build/smp.o
+$CC $CFLAGS -c kernel/lockstat.c -o build/lockstat.o
+$CC $CFLAGS -c kernel/acpi.c -o build/acpi.o
+$CC $CFLAGS -c kernel/apic.c -o build/apic.o
+$CC $CFLAGS -c kernel/irq.c -o build/irq.o
+$CC $CFLAGS -c kernel/deferred.c -o build/deferred.o
 $CC $CFLAGS -c kernel/memory.c -o build/memory.o
+$CC $CFLAGS -c kernel/pmm.c -o build/pmm.o
+$CC $CFLAGS -c kernel/arena.c -o build/arena.o
+$CC $CFLAGS -c kernel/paging.c -o build/paging.o
+$CC $CFLAGS -c kernel/vmm.c -o build/vmm.o
+$CC $CFLAGS -c kernel/console.c -o build/console.o
+$CC $CFLAGS -c kernel/bench.c -o build/bench.o
 $CC $CFLAGS -c kernel/kernel.c -o build/kernel.o
 $CC $CFLAGS -c drivers/keyboard.c -o build/keyboard.o
+$CC $CFLAGS -c drivers/serial.c -o build/serial.o
+$CC $CFLAGS -c libs/string.c -o build/string.o
 
 # Link kernel - crucial to link isr_asm.o first to resolve ISR symbols
 $LD $LDFLAGS -o build/kernel.bin \
     build/isr_asm.o \
+    build/syscall_asm.o \
+    build/switch_asm.o \
+    build/trampoline_asm.o \
+    build/cpu.o \
+    build/gdt.o \
     build/isr.o \
+    build/fpu.o \
+    build/syscall.o \
     build/idt.o \
     build/pic.o \
+    build/pit.o \
+    build/clock.o \
+    build/idle.o \
+    build/timer.o \
+    build/sched.o \
+    build/smp.o \
+    build/lockstat.o \
+    build/acpi.o \
+    build/apic.o \
+    build/irq.o \
+    build/deferred.o \
     build/memory.o \
+    build/pmm.o \
+    build/arena.o \
+    build/paging.o \
+    build/vmm.o \
+    build/console.o \
+    build/bench.o \
     build/kernel.o \
-    build/keyboard.o
+    build/keyboard.o \
+    build/serial.o \
+    build/string.o
 
 # Create disk image
 dd if=/dev/zero of=build/bootloader.img bs=512 count=2880
@@ -1,28 +1,431 @@
 #include "keyboard.h"
 #include "../kernel/port_io.h"
 #include "../kernel/isr.h"
+#include "../kernel/irq.h"
+#include "../kernel/deferred.h"
+#include "../kernel/clock.h"
+#include "../kernel/timer.h"
+#include "../kernel/sched.h"
+#include "../kernel/spinlock.h"
 #include <stdbool.h>
 
-// Keyboard controller commands
+// Keyboard device commands, written to the data port
 #define KEYBOARD_RESET       0xFF
 #define KEYBOARD_ENABLE      0xF4
+#define KEYBOARD_TYPEMATIC   0xF3
 #define KEYBOARD_LED_CMD     0xED
-#define KEYBOARD_ACK        0xFA
-#define KEYBOARD_RESEND     0xFE
-#define KEYBOARD_SELF_TEST  0xAA
-#define KEYBOARD_TEST_OK    0x55
-
-// Basic US keyboard scancode map (set 1)
-static const char scancode_map[128] = {
-    0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+
+// Device replies
+#define KEYBOARD_ACK         0xFA
+#define KEYBOARD_RESEND      0xFE
+#define KEYBOARD_BAT_OK      0xAA   // Self test after reset passed
+#define KEYBOARD_BAT_FAIL    0xFC
+#define KEYBOARD_BAT_FAIL2   0xFD
+
+#define KEYBOARD_STATUS_OUTPUT 0x01 // A byte is waiting at the data port
+#define KEYBOARD_STATUS_INPUT  0x02 // The controller has not taken the last byte
+
+// The controller takes a byte within microseconds; the device answers a
+// command within a few milliseconds, but its reset self test can take
+// the better part of a second on real hardware
+#define KEYBOARD_WRITE_TIMEOUT_US 1000
+#define KEYBOARD_ACK_TIMEOUT_MS   100
+#define KEYBOARD_BAT_TIMEOUT_MS   1000
+#define KEYBOARD_RETRIES          3
+
+static volatile bool keyboard_initialized = false;
+
+// Raw scancodes, written by the IRQ handler and read by whoever calls
+// keyboard_read_event(). One producer and one consumer, so the ring
+// needs no lock: the handler publishes a byte by advancing head after
+// storing it, and a reader frees the slot by advancing tail after
+// loading it. Both indices run freely and wrap through the mask. Big
+// enough to hold a paste at typematic speed with nobody reading.
+#define SCANCODE_RING_SIZE 1024
+#define SCANCODE_RING_MASK (SCANCODE_RING_SIZE - 1)
+
+_Static_assert((SCANCODE_RING_SIZE & SCANCODE_RING_MASK) == 0, "ring size must be a power of two");
+
+static volatile uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head;     // Written by the IRQ handler only
+static volatile uint32_t scancode_tail;     // Written by the reader only
+static volatile uint32_t scancode_dropped;
+
+// Readers take reader_lock, which makes them the ring's single consumer
+// and guards the decoder state. Blocked readers park on a list under
+// wait_lock, where keyboard_work finds and wakes them all; each then
+// races the others for the next event and parks again if it loses.
+static struct spinlock reader_lock = SPINLOCK_INIT("keyboard reader");
+static struct spinlock wait_lock = SPINLOCK_INIT("keyboard wait");
+
+// A thread blocked in keyboard_wait_event, on its own stack
+struct keyboard_waiter {
+    struct thread* thread;
+    struct keyboard_waiter* next;
+    struct keyboard_waiter** pprev;
+};
+
+static struct keyboard_waiter* keyboard_waiters;
+
+#define SCANCODE_EXTENDED 0xE0
+#define SCANCODE_PAUSE    0xE1      // E1 1D 45 press, E1 9D C5 release
+#define SCANCODE_RELEASE  0x80
+
+// Held modifier keys, tracked left and right apart
+#define HELD_LSHIFT 0x01
+#define HELD_RSHIFT 0x02
+#define HELD_LCTRL  0x04
+#define HELD_RCTRL  0x08
+#define HELD_LALT   0x10
+#define HELD_RALT   0x20
+#define HELD_LOCKS  0x40            // A lock key is down, so repeats do not toggle it
+
+struct decoder {
+    bool extended;                  // Last byte was 0xE0
+    uint8_t pause_left;             // Bytes still to come of a Pause sequence
+    uint8_t held;
+    uint8_t locks;                  // KEYMOD_CAPS | KEYMOD_NUM | KEYMOD_SCROLL
+};
+
+static struct decoder decoder;
+
+// US layout, set 1 make codes 0x00-0x58. The keypad block is handled
+// apart, as its keys depend on Num Lock.
+#define SET1_KEYS       0x59
+#define KEYPAD_FIRST    0x47
+#define KEYPAD_LAST     0x53
+
+static const uint16_t set1_keys[SET1_KEYS] = {
+    0, KEY_ESCAPE, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
     '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
-    0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
-    0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
-    '*', 0, ' '
+    KEY_LCTRL, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
+    KEY_LSHIFT, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', KEY_RSHIFT,
+    '*', KEY_LALT, ' ', KEY_CAPS_LOCK,
+    KEY_F1, KEY_F1 + 1, KEY_F1 + 2, KEY_F1 + 3, KEY_F1 + 4,
+    KEY_F1 + 5, KEY_F1 + 6, KEY_F1 + 7, KEY_F1 + 8, KEY_F1 + 9,
+    KEY_NUM_LOCK, KEY_SCROLL_LOCK,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,     // Keypad
+    0, 0, '\\', KEY_F1 + 10, KEY_F12,           // 0x56 is the 102nd key
 };
 
-static volatile bool keyboard_initialized = false;
+// Shifted characters for make codes below 0x3A
+static const char set1_shifted[0x3A] = {
+    0, 0, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+    0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',
+    0, '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,
+    '*', 0, ' ',
+};
+
+static const char keypad_digits[KEYPAD_LAST - KEYPAD_FIRST + 1] = "789-456+1230.";
+static const uint16_t keypad_keys[KEYPAD_LAST - KEYPAD_FIRST + 1] = {
+    KEY_HOME, KEY_UP, KEY_PAGE_UP, '-', KEY_LEFT, KEY_KEYPAD_5, KEY_RIGHT, '+',
+    KEY_END, KEY_DOWN, KEY_PAGE_DOWN, KEY_INSERT, KEY_DELETE,
+};
+
+// Keys behind the 0xE0 prefix. 0 for the fake shifts some keys wrap
+// themselves in, which are dropped.
+static uint16_t extended_key(uint8_t code) {
+    switch (code) {
+    case 0x1C: return '\n';            // Keypad Enter
+    case 0x1D: return KEY_RCTRL;
+    case 0x35: return '/';              // Keypad /
+    case 0x37: return KEY_PRINT_SCREEN;
+    case 0x38: return KEY_RALT;
+    case 0x47: return KEY_HOME;
+    case 0x48: return KEY_UP;
+    case 0x49: return KEY_PAGE_UP;
+    case 0x4B: return KEY_LEFT;
+    case 0x4D: return KEY_RIGHT;
+    case 0x4F: return KEY_END;
+    case 0x50: return KEY_DOWN;
+    case 0x51: return KEY_PAGE_DOWN;
+    case 0x52: return KEY_INSERT;
+    case 0x53: return KEY_DELETE;
+    case 0x5B: return KEY_LGUI;
+    case 0x5C: return KEY_RGUI;
+    case 0x5D: return KEY_MENU;
+    default:   return 0;
+    }
+}
+
+static uint8_t held_bit(uint16_t key) {
+    switch (key) {
+    case KEY_LSHIFT: return HELD_LSHIFT;
+    case KEY_RSHIFT: return HELD_RSHIFT;
+    case KEY_LCTRL:  return HELD_LCTRL;
+    case KEY_RCTRL:  return HELD_RCTRL;
+    case KEY_LALT:   return HELD_LALT;
+    case KEY_RALT:   return HELD_RALT;
+    default:         return 0;
+    }
+}
+
+static uint8_t lock_bit(uint16_t key) {
+    switch (key) {
+    case KEY_CAPS_LOCK:   return KEYMOD_CAPS;
+    case KEY_NUM_LOCK:    return KEYMOD_NUM;
+    case KEY_SCROLL_LOCK: return KEYMOD_SCROLL;
+    default:              return 0;
+    }
+}
+
+static uint8_t decoder_modifiers(const struct decoder* d) {
+    uint8_t mods = d->locks;
+    if (d->held & (HELD_LSHIFT | HELD_RSHIFT)) mods |= KEYMOD_SHIFT;
+    if (d->held & (HELD_LCTRL | HELD_RCTRL)) mods |= KEYMOD_CTRL;
+    if (d->held & (HELD_LALT | HELD_RALT)) mods |= KEYMOD_ALT;
+    return mods;
+}
+
+// Character a press of key types; code is the make code, when the key
+// came without a prefix, for the shifted table
+static char key_ascii(uint16_t key, uint8_t code, bool plain, uint8_t mods) {
+    if (key >= 0x80) return 0;
+
+    char c = (char)key;
+    bool letter = c >= 'a' && c <= 'z';
+    bool shift = mods & KEYMOD_SHIFT;
+    if (letter && (mods & KEYMOD_CAPS)) shift = !shift;
+    if (shift && plain && code < sizeof(set1_shifted) && set1_shifted[code]) {
+        c = set1_shifted[code];
+    }
+
+    // Ctrl-A..Ctrl-Z and Ctrl-[ \ ] ^ _ give the C0 control codes
+    if (mods & KEYMOD_CTRL) {
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        if (c >= '@' && c <= '_') c &= 0x1F;
+    }
+    return c;
+}
+
+// Feed one scancode; true when it completes an event
+static bool decode(struct decoder* d, uint8_t byte, struct key_event* ev) {
+    uint16_t key;
+    uint8_t code = byte & ~SCANCODE_RELEASE;
+    bool pressed = !(byte & SCANCODE_RELEASE);
+    bool plain = false;
+
+    if (d->pause_left) {
+        // Pause has no release code of its own; the second half of
+        // its sequence stands in for one
+        if (--d->pause_left) return false;
+        key = KEY_PAUSE;
+    } else if (byte == SCANCODE_PAUSE) {
+        d->pause_left = 2;
+        return false;
+    } else if (byte == SCANCODE_EXTENDED) {
+        d->extended = true;
+        return false;
+    } else if (d->extended) {
+        d->extended = false;
+        key = extended_key(code);
+    } else if (code >= KEYPAD_FIRST && code <= KEYPAD_LAST) {
+        uint32_t i = code - KEYPAD_FIRST;
+        key = (d->locks & KEYMOD_NUM) ? (uint16_t)keypad_digits[i] : keypad_keys[i];
+    } else {
+        key = code < SET1_KEYS ? set1_keys[code] : 0;
+        plain = true;
+    }
+    if (!key) return false;
+
+    uint8_t held = held_bit(key);
+    uint8_t lock = lock_bit(key);
+    if (held) {
+        if (pressed) d->held |= held;
+        else d->held &= ~held;
+    } else if (lock) {
+        // Toggle on the first press only, not on typematic repeats
+        if (pressed && !(d->held & HELD_LOCKS)) {
+            d->locks ^= lock;
+            keyboard_set_leds(d->locks);
+        }
+        if (pressed) d->held |= HELD_LOCKS;
+        else d->held &= ~HELD_LOCKS;
+    }
+
+    ev->key = key;
+    ev->modifiers = decoder_modifiers(d);
+    ev->pressed = pressed;
+    ev->ascii = pressed ? key_ascii(key, code, plain, ev->modifiers) : 0;
+    return true;
+}
+
+static void keyboard_process(void* arg);
+static struct deferred_work keyboard_work = DEFERRED_WORK_INIT(keyboard_process, 0);
+
+// Device commands go out one at a time: a command is sent when the one
+// before it is acknowledged, by the IRQ1 path that sees the ACK, or at
+// once by the caller when the line is idle. A timer catches a device
+// that never answers. Nobody waits, so a reset runs on while the rest
+// of boot does.
+//
+// ps2_lock covers the queue and the state. The IRQ handler reads
+// ps2_state without it to stay off the lock for plain scancodes; a
+// command's reply cannot arrive before the state says it is expected.
+enum ps2_state {
+    PS2_IDLE,
+    PS2_WAIT_ACK,           // Command byte sent
+    PS2_WAIT_DATA_ACK,      // Its parameter byte sent
+    PS2_WAIT_BAT,           // Reset acknowledged, self test running
+};
+
+#define PS2_NO_DATA     0xFFFF
+#define PS2_QUEUE_SIZE  8
+
+struct ps2_command {
+    uint8_t command;
+    uint16_t data;          // Parameter byte, or PS2_NO_DATA
+};
+
+static struct spinlock ps2_lock = SPINLOCK_INIT("ps2");
+static struct ps2_command ps2_queue[PS2_QUEUE_SIZE];
+static uint32_t ps2_queue_head;
+static uint32_t ps2_queue_tail;
+static volatile enum ps2_state ps2_state = PS2_IDLE;
+static uint32_t ps2_retries;
+static struct timer ps2_timer;
+static volatile bool keyboard_reset_done = false;
+static volatile uint32_t ps2_failures;
+
+// Called by the IRQ handler, and by the PS/2 timeout on the same CPU with
+// interrupts off, so the ring still has one producer at a time. Stores
+// the byte before publishing it; x86 keeps the two stores in order and
+// the barrier keeps the compiler from swapping them.
+static void scancode_push(uint8_t scancode) {
+    uint32_t head = scancode_head;
+    if (head - scancode_tail < SCANCODE_RING_SIZE) {
+        scancode_ring[head & SCANCODE_RING_MASK] = scancode;
+        __asm__ volatile("" : : : "memory");
+        scancode_head = head + 1;
+    } else {
+        scancode_dropped++;
+    }
+    defer_work(&keyboard_work);
+}
+
+static bool ps2_write(uint8_t byte) {
+    uint64_t deadline = ktime_get_ns() + KEYBOARD_WRITE_TIMEOUT_US * NSEC_PER_USEC;
+    while (inb(KEYBOARD_STATUS_PORT) & KEYBOARD_STATUS_INPUT) {
+        if (ktime_after(deadline)) return false;
+    }
+    outb(KEYBOARD_DATA_PORT, byte);
+    return true;
+}
 
+// Send the byte the current state is waiting on an answer to; ps2_lock held
+static void ps2_send(enum ps2_state state) {
+    struct ps2_command* cmd = &ps2_queue[ps2_queue_tail % PS2_QUEUE_SIZE];
+    uint32_t timeout = state == PS2_WAIT_BAT ? KEYBOARD_BAT_TIMEOUT_MS : KEYBOARD_ACK_TIMEOUT_MS;
+
+    ps2_state = state;
+    if (state == PS2_WAIT_ACK) ps2_write(cmd->command);
+    else if (state == PS2_WAIT_DATA_ACK) ps2_write((uint8_t)cmd->data);
+    timer_start(&ps2_timer, timer_ms_to_ticks(timeout));
+}
+
+// Retire the command at the tail and start the next; ps2_lock held
+static void ps2_complete(bool ok) {
+    struct ps2_command* cmd = &ps2_queue[ps2_queue_tail % PS2_QUEUE_SIZE];
+
+    timer_cancel(&ps2_timer);
+    if (cmd->command == KEYBOARD_RESET && ok) keyboard_reset_done = true;
+    if (!ok) ps2_failures++;
+
+    ps2_queue_tail++;
+    ps2_retries = 0;
+    if (ps2_queue_tail != ps2_queue_head) ps2_send(PS2_WAIT_ACK);
+    else ps2_state = PS2_IDLE;
+}
+
+// Resend the byte last sent, or give the command up; ps2_lock held
+static void ps2_retry(void) {
+    if (++ps2_retries > KEYBOARD_RETRIES) {
+        ps2_complete(false);
+    } else {
+        ps2_send(ps2_state == PS2_WAIT_BAT ? PS2_WAIT_ACK : ps2_state);
+    }
+}
+
+// A byte from the device while a command is out. False if it is not a
+// reply, but a scancode typed meanwhile.
+static bool ps2_reply(uint8_t byte) {
+    uint32_t flags = spin_lock_irqsave(&ps2_lock);
+    bool reply = true;
+    struct ps2_command* cmd = &ps2_queue[ps2_queue_tail % PS2_QUEUE_SIZE];
+
+    switch (ps2_state) {
+    case PS2_WAIT_ACK:
+    case PS2_WAIT_DATA_ACK:
+        if (byte == KEYBOARD_RESEND) {
+            ps2_retry();
+        } else if (byte != KEYBOARD_ACK) {
+            reply = false;
+        } else if (ps2_state == PS2_WAIT_ACK && cmd->data != PS2_NO_DATA) {
+            ps2_send(PS2_WAIT_DATA_ACK);
+        } else if (cmd->command == KEYBOARD_RESET) {
+            ps2_send(PS2_WAIT_BAT);
+        } else {
+            ps2_complete(true);
+        }
+        break;
+    case PS2_WAIT_BAT:
+        if (byte == KEYBOARD_BAT_OK) ps2_complete(true);
+        else if (byte == KEYBOARD_BAT_FAIL || byte == KEYBOARD_BAT_FAIL2) ps2_complete(false);
+        else reply = false;
+        break;
+    default:
+        reply = false;
+        break;
+    }
+    spin_unlock_irqrestore(&ps2_lock, flags);
+    return reply;
+}
+
+// No answer in time. The IRQ may have been lost rather than the reply,
+// so look at the controller before sending again.
+static void ps2_timeout(void* arg) {
+    (void)arg;
+
+    uint32_t flags = spin_lock_irqsave(&ps2_lock);
+    if (ps2_state != PS2_IDLE) {
+        if (inb(KEYBOARD_STATUS_PORT) & KEYBOARD_STATUS_OUTPUT) {
+            uint8_t byte = inb(KEYBOARD_DATA_PORT);
+            spin_unlock(&ps2_lock);
+            if (!ps2_reply(byte)) scancode_push(byte);
+            spin_lock(&ps2_lock);
+        } else {
+            ps2_retry();
+        }
+    }
+    spin_unlock_irqrestore(&ps2_lock, flags);
+}
+
+// Queue a command; false if the queue is full
+static bool ps2_submit(uint8_t command, uint16_t data) {
+    uint32_t flags = spin_lock_irqsave(&ps2_lock);
+    bool queued = ps2_queue_head - ps2_queue_tail < PS2_QUEUE_SIZE;
+    if (queued) {
+        ps2_queue[ps2_queue_head % PS2_QUEUE_SIZE] = (struct ps2_command){ command, data };
+        ps2_queue_head++;
+        if (ps2_state == PS2_IDLE) ps2_send(PS2_WAIT_ACK);
+    }
+    spin_unlock_irqrestore(&ps2_lock, flags);
+    return queued;
+}
+
+// Bottom half: wake the readers blocked in keyboard_wait_event
+static void keyboard_process(void* arg) {
+    (void)arg;
+
+    uint32_t flags = spin_lock_irqsave(&wait_lock);
+    for (struct keyboard_waiter* w = keyboard_waiters; w; w = w->next) {
+        thread_wake(w->thread);
+    }
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+// Top half: grab the byte so the controller can take the next one
 static void keyboard_callback(registers_t *regs) {
     if (!regs) return;
     
@@ -31,62 +434,126 @@ static void keyboard_callback(registers_t *regs) {
     if (!(status & 0x01)) return;  // No data available
     
     uint8_t scancode = inb(KEYBOARD_DATA_PORT);
-    
-    // Process the scancode
-    if (!(scancode & 0x80)) {  // Key press event
-        char ascii = scancode_to_ascii(scancode);
-        if (ascii) {
-            // Handle the character (could add buffer here)
-        }
+
+    // While a command is out, its reply comes through here too
+    if (ps2_state != PS2_IDLE && ps2_reply(scancode)) return;
+    scancode_push(scancode);
+}
+
+bool keyboard_read_event(struct key_event* ev) {
+    bool found = false;
+
+    uint32_t flags = spin_lock_irqsave(&reader_lock);
+    uint32_t tail = scancode_tail;
+    while (!found && tail != scancode_head) {
+        __asm__ volatile("" : : : "memory");
+        uint8_t byte = scancode_ring[tail & SCANCODE_RING_MASK];
+        __asm__ volatile("" : : : "memory");
+        scancode_tail = ++tail;
+
+        // Controller replies and error codes, not keys
+        if (byte == KEYBOARD_ACK || byte == KEYBOARD_RESEND || byte == 0x00 || byte == 0xFF) continue;
+        found = decode(&decoder, byte, ev);
     }
+    spin_unlock_irqrestore(&reader_lock, flags);
+    return found;
 }
 
-static bool keyboard_wait_input(void) {
-    for (int timeout = 100000; timeout > 0; timeout--) {
-        if (!(inb(KEYBOARD_STATUS_PORT) & 0x02))
-            return true;
+void keyboard_wait_event(struct key_event* ev) {
+    while (!keyboard_read_event(ev)) {
+        // Parked and checked under wait_lock, so keyboard_work either
+        // sees the waiter or ran before the check and left a byte for it
+        struct keyboard_waiter self = { thread_current(), 0, 0 };
+        __asm__ volatile("cli");
+        spin_lock(&wait_lock);
+        bool empty = scancode_head == scancode_tail;
+        if (empty) {
+            self.next = keyboard_waiters;
+            self.pprev = &keyboard_waiters;
+            if (keyboard_waiters) keyboard_waiters->pprev = &self.next;
+            keyboard_waiters = &self;
+        }
+        spin_unlock(&wait_lock);
+
+        if (empty) {
+            thread_block();
+            spin_lock(&wait_lock);
+            *self.pprev = self.next;
+            if (self.next) self.next->pprev = self.pprev;
+            spin_unlock(&wait_lock);
+        }
+        __asm__ volatile("sti");
     }
-    return false;
 }
 
-static bool keyboard_wait_output(void) {
-    for (int timeout = 100000; timeout > 0; timeout--) {
-        if (inb(KEYBOARD_STATUS_PORT) & 0x01)
+bool keyboard_try_getchar(char* c) {
+    struct key_event ev;
+    while (keyboard_read_event(&ev)) {
+        if (ev.ascii) {
+            *c = ev.ascii;
             return true;
+        }
     }
     return false;
 }
 
-static bool keyboard_send_command(uint8_t command) {
-    if (!keyboard_wait_input()) return false;
-    outb(KEYBOARD_COMMAND_PORT, command);
-    
-    if (!keyboard_wait_output()) return false;
-    return (inb(KEYBOARD_DATA_PORT) == KEYBOARD_ACK);
+char keyboard_getchar(void) {
+    struct key_event ev;
+    do {
+        keyboard_wait_event(&ev);
+    } while (!ev.ascii);
+    return ev.ascii;
+}
+
+uint32_t keyboard_dropped(void) {
+    return scancode_dropped;
+}
+
+bool keyboard_set_leds(uint8_t locks) {
+    uint8_t leds = 0;
+    if (locks & KEYMOD_SCROLL) leds |= 0x01;
+    if (locks & KEYMOD_NUM) leds |= 0x02;
+    if (locks & KEYMOD_CAPS) leds |= 0x04;
+    return ps2_submit(KEYBOARD_LED_CMD, leds);
+}
+
+bool keyboard_set_typematic(uint8_t rate, uint8_t delay) {
+    if (rate > KEYBOARD_RATE_SLOWEST || delay > KEYBOARD_DELAY_LONGEST) return false;
+    return ps2_submit(KEYBOARD_TYPEMATIC, (uint16_t)((delay << 5) | rate));
+}
+
+bool keyboard_ready(void) {
+    return keyboard_reset_done;
+}
+
+uint32_t keyboard_command_failures(void) {
+    return ps2_failures;
 }
 
 bool init_keyboard(void) {
     if (keyboard_initialized) return true;
-    
-    // Reset the keyboard
-    if (!keyboard_wait_input()) return false;
-    outb(KEYBOARD_COMMAND_PORT, KEYBOARD_RESET);
-    
-    // Wait for self-test completion
-    if (!keyboard_wait_output()) return false;
-    if (inb(KEYBOARD_DATA_PORT) != KEYBOARD_TEST_OK) return false;
-    
-    // Enable scanning
-    if (!keyboard_send_command(KEYBOARD_ENABLE)) return false;
-    
+    timer_setup(&ps2_timer, ps2_timeout, 0);
+
+    // Drop whatever the firmware left in the output buffer
+    for (int i = 0; i < 16 && (inb(KEYBOARD_STATUS_PORT) & KEYBOARD_STATUS_OUTPUT); i++) {
+        inb(KEYBOARD_DATA_PORT);
+    }
+
     // Register our keyboard handler (IRQ1 -> INT 33)
-    register_interrupt_handler(33, keyboard_callback);
-    
+    register_interrupt_handler(IRQ_VECTOR(KEYBOARD_IRQ), keyboard_callback);
+    irq_unmask(KEYBOARD_IRQ);
+
+    // Reset, then enable scanning; both finish from the IRQ path
+    if (!ps2_submit(KEYBOARD_RESET, PS2_NO_DATA) || !ps2_submit(KEYBOARD_ENABLE, PS2_NO_DATA)) {
+        return false;
+    }
+
     keyboard_initialized = true;
     return true;
 }
 
 char scancode_to_ascii(uint8_t scancode) {
-    if (scancode >= 128) return 0;  // Handle only press events
-    return scancode_map[scancode];
+    if (scancode >= SET1_KEYS) return 0;  // Release codes and keys past F12
+    uint16_t key = set1_keys[scancode];
+    return key < 0x80 ? (char)key : 0;
 }
\ No newline at end of file
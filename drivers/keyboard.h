@@ -12,11 +12,88 @@
 // Keyboard-related IRQ
 #define KEYBOARD_IRQ 1
 
-// Function declarations
+// The IRQ handler only stores raw set-1 scancodes in a lock-free ring;
+// the read calls below decode them, one reader at a time. Commands to the
+// device are queued and driven by a state machine on the IRQ1 path.
+
+// Key codes in struct key_event. Keys that type a character use that
+// character, unshifted; the rest are numbered from 0x100.
+#define KEY_ESCAPE       27
+#define KEY_F1           0x101      // Through KEY_F12, consecutive
+#define KEY_F12          0x10C
+#define KEY_UP           0x110
+#define KEY_DOWN         0x111
+#define KEY_LEFT         0x112
+#define KEY_RIGHT        0x113
+#define KEY_HOME         0x114
+#define KEY_END          0x115
+#define KEY_PAGE_UP      0x116
+#define KEY_PAGE_DOWN    0x117
+#define KEY_INSERT       0x118
+#define KEY_DELETE       0x119
+#define KEY_KEYPAD_5     0x11A      // With Num Lock off
+#define KEY_LSHIFT       0x120
+#define KEY_RSHIFT       0x121
+#define KEY_LCTRL        0x122
+#define KEY_RCTRL        0x123
+#define KEY_LALT         0x124
+#define KEY_RALT         0x125
+#define KEY_LGUI         0x126
+#define KEY_RGUI         0x127
+#define KEY_MENU         0x128
+#define KEY_CAPS_LOCK    0x129
+#define KEY_NUM_LOCK     0x12A
+#define KEY_SCROLL_LOCK  0x12B
+#define KEY_PRINT_SCREEN 0x12C
+#define KEY_PAUSE        0x12D
+
+// Modifier state in struct key_event
+#define KEYMOD_SHIFT     0x01
+#define KEYMOD_CTRL      0x02
+#define KEYMOD_ALT       0x04
+#define KEYMOD_CAPS      0x08       // Lock states: on, not held
+#define KEYMOD_NUM       0x10
+#define KEYMOD_SCROLL    0x20
+
+struct key_event {
+    uint16_t key;           // KEY_* or the unshifted character
+    uint8_t modifiers;      // KEYMOD_* after this event
+    bool pressed;           // False on release; typematic repeats are presses
+    char ascii;             // Character typed, 0 for none and on release
+};
+
+// Queues the device reset and returns; the reset and every command after
+// it complete from the IRQ path, so none of the calls below wait
 bool init_keyboard(void);
-void keyboard_handler(void);
+bool keyboard_ready(void);                  // The reset's self test has passed
+uint32_t keyboard_command_failures(void);   // Commands given up on after retries
+
+// Set the lock LEDs from KEYMOD_CAPS/NUM/SCROLL. The decoder does this on
+// its own when a lock key toggles. False if the command queue is full.
+bool keyboard_set_leds(uint8_t locks);
+
+// Repeat rate 0 (30/s) to 31 (2/s), delay 0 (250 ms) to 3 (1 s)
+#define KEYBOARD_RATE_SLOWEST  31
+#define KEYBOARD_DELAY_LONGEST 3
+bool keyboard_set_typematic(uint8_t rate, uint8_t delay);
+
+// Next key event, false if none is waiting. Never blocks.
+bool keyboard_read_event(struct key_event* ev);
+
+// Next key event, blocking the calling thread until there is one. Call
+// from a thread with interrupts on. Any number of threads may wait; each
+// event goes to one of them.
+void keyboard_wait_event(struct key_event* ev);
+
+// Next typed character, skipping other events: the first returns false
+// when none is waiting, the second blocks
+bool keyboard_try_getchar(char* c);
+char keyboard_getchar(void);
+
+// Scancodes dropped because the ring was full
+uint32_t keyboard_dropped(void);
 
-// Basic US keyboard scancode conversion
+// Unshifted character for a set-1 make code, 0 if it types none
 char scancode_to_ascii(uint8_t scancode);
 
-#endif
\ No newline at end of file
+#endif
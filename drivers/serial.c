@@ -0,0 +1,61 @@
+#include "serial.h"
+#include "../kernel/port_io.h"
+#include "../kernel/clock.h"
+
+// UART register offsets from the base port
+#define UART_DATA        0   // DLAB=0: THR/RBR, DLAB=1: divisor low
+#define UART_IER         1   // DLAB=0: interrupt enable, DLAB=1: divisor high
+#define UART_FCR         2
+#define UART_LCR         3
+#define UART_MCR         4
+#define UART_LSR         5
+
+#define UART_LCR_8N1     0x03
+#define UART_LCR_DLAB    0x80
+#define UART_FCR_ENABLE  0xC7    // Enable and clear FIFOs, 14-byte threshold
+#define UART_MCR_NORMAL  0x0B    // DTR, RTS, OUT2
+#define UART_MCR_LOOP    0x1E    // Loopback for the self test
+#define UART_LSR_THRE    0x20    // Transmit holding register empty
+
+#define SERIAL_TEST_BYTE 0xAE
+#define SERIAL_TIMEOUT_US 10000 // Per character; one takes ~1 ms even at 9600 baud
+
+static bool serial_present = false;
+
+bool serial_init(void) {
+    uint16_t divisor = 115200 / SERIAL_BAUD;
+
+    outb(SERIAL_COM1 + UART_IER, 0x00);         // Polled, no interrupts
+    outb(SERIAL_COM1 + UART_LCR, UART_LCR_DLAB);
+    outb(SERIAL_COM1 + UART_DATA, divisor & 0xFF);
+    outb(SERIAL_COM1 + UART_IER, divisor >> 8);
+    outb(SERIAL_COM1 + UART_LCR, UART_LCR_8N1);
+    outb(SERIAL_COM1 + UART_FCR, UART_FCR_ENABLE);
+
+    // A missing UART reads back 0xFF, so check a byte in loopback
+    outb(SERIAL_COM1 + UART_MCR, UART_MCR_LOOP);
+    outb(SERIAL_COM1 + UART_DATA, SERIAL_TEST_BYTE);
+    if (inb(SERIAL_COM1 + UART_DATA) != SERIAL_TEST_BYTE) {
+        return false;
+    }
+
+    outb(SERIAL_COM1 + UART_MCR, UART_MCR_NORMAL);
+    serial_present = true;
+    return true;
+}
+
+bool serial_ready(void) {
+    return serial_present;
+}
+
+void serial_write_char(char c) {
+    if (!serial_present) return;
+    if (c == '\n') serial_write_char('\r');
+
+    // Bounded wait so a wedged UART cannot hang console output
+    uint64_t deadline = ktime_get_ns() + SERIAL_TIMEOUT_US * NSEC_PER_USEC;
+    while (!(inb(SERIAL_COM1 + UART_LSR) & UART_LSR_THRE)) {
+        if (ktime_after(deadline)) break;
+    }
+    outb(SERIAL_COM1 + UART_DATA, (uint8_t)c);
+}
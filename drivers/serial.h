@@ -0,0 +1,16 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 16550 UART on COM1, used as a mirror of the VGA console
+#define SERIAL_COM1 0x3F8
+#define SERIAL_BAUD 115200
+
+// Function declarations
+bool serial_init(void);         // False when no UART answers
+bool serial_ready(void);
+void serial_write_char(char c);
+
+#endif // SERIAL_H
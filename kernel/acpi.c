@@ -0,0 +1,278 @@
+#include "acpi.h"
+#include "paging.h"
+#include "memory.h"
+#include <string.h>
+
+// Tables are found through the RSDP, which the BIOS leaves in the first
+// KB of the EBDA or in 0xE0000-0xFFFFF. The tables themselves can sit
+// anywhere in the 32-bit space, so they are read through a small window
+// of scratch mappings at the top of the vmap area and copied out.
+
+#define BDA_EBDA_SEGMENT 0x40E
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_END     0x100000
+
+#define ACPI_WINDOW_PAGES 8
+#define ACPI_WINDOW_SIZE  (ACPI_WINDOW_PAGES * PAGE_SIZE)
+#define ACPI_WINDOW_BASE  (KERNEL_VMAP_END - 2 * ACPI_WINDOW_SIZE)
+
+#define MADT_PCAT_COMPAT  0x01
+
+// MADT entry types
+#define MADT_LAPIC           0
+#define MADT_IOAPIC          1
+#define MADT_IRQ_OVERRIDE    2
+#define MADT_LAPIC_ADDRESS   5
+
+#define MADT_LAPIC_ENABLED   0x01
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    // ACPI 2.0+
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic {
+    struct madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_irq_override {
+    struct madt_entry entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+// Generic address structure; the HPET must be in system memory
+struct acpi_gas {
+    uint8_t space_id;
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+} __attribute__((packed));
+
+#define ACPI_GAS_MEMORY 0
+
+struct acpi_hpet {
+    struct acpi_sdt_header header;
+    uint32_t block_id;
+    struct acpi_gas address;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t page_protection;
+} __attribute__((packed));
+
+struct madt_lapic_address {
+    struct madt_entry entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed));
+
+static struct acpi_madt_info madt_info;
+static bool madt_found;
+static uint32_t hpet_address;
+static bool scanned;
+static bool madt_usable;
+
+// Map [phys, phys + len) into window slot 0 or 1, replacing what was there
+static void* acpi_map(uint32_t slot, uint32_t phys, uint32_t len) {
+    uint32_t window = ACPI_WINDOW_BASE + slot * ACPI_WINDOW_SIZE;
+    uint32_t first = phys & PAGE_FRAME_MASK;
+    uint32_t last = (phys + len - 1) & PAGE_FRAME_MASK;
+
+    if (len == 0 || last < first || last - first >= ACPI_WINDOW_SIZE) return NULL;
+
+    paging_unmap(window, ACPI_WINDOW_SIZE);
+    if (!paging_map(window, first, last - first + PAGE_SIZE, PAGING_MAP_4K)) return NULL;
+    return (void*)(window + (phys & (PAGE_SIZE - 1)));
+}
+
+static bool checksum_ok(const void* data, uint32_t len) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static struct acpi_rsdp* scan_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr + sizeof(struct acpi_rsdp) <= end; addr += 16) {
+        struct acpi_rsdp* rsdp = (struct acpi_rsdp*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum_ok(rsdp, 20)) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+static struct acpi_rsdp* find_rsdp(void) {
+    // The BDA lives in the null page, which is not mapped
+    uint16_t* ebda_segment = acpi_map(0, BDA_EBDA_SEGMENT, sizeof(uint16_t));
+    uint32_t ebda = ebda_segment ? (uint32_t)*ebda_segment << 4 : 0;
+
+    if (ebda >= PAGE_SIZE && ebda < BIOS_ROM_START) {
+        struct acpi_rsdp* rsdp = scan_rsdp(ebda, ebda + 1024);
+        if (rsdp) return rsdp;
+    }
+    return scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+}
+
+// Map a whole table into slot, NULL if it does not fit or is corrupt
+static struct acpi_sdt_header* map_table(uint32_t slot, uint32_t phys) {
+    struct acpi_sdt_header* header = acpi_map(slot, phys, sizeof(struct acpi_sdt_header));
+    if (!header) return NULL;
+
+    uint32_t length = header->length;
+    if (length < sizeof(struct acpi_sdt_header)) return NULL;
+
+    header = acpi_map(slot, phys, length);
+    if (!header || !checksum_ok(header, length)) return NULL;
+    return header;
+}
+
+static void parse_madt(struct acpi_madt* madt) {
+    madt_info.lapic_address = madt->lapic_address;
+    madt_info.legacy_pics = madt->flags & MADT_PCAT_COMPAT;
+
+    // ISA IRQs are identity mapped and edge/high unless overridden
+    for (uint32_t i = 0; i < ACPI_ISA_IRQS; i++) {
+        madt_info.isa_gsi[i] = i;
+        madt_info.isa_flags[i] = 0;
+    }
+
+    uint8_t* entry = (uint8_t*)(madt + 1);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (entry + sizeof(struct madt_entry) <= end) {
+        struct madt_entry* e = (struct madt_entry*)entry;
+        if (e->length < sizeof(struct madt_entry) || entry + e->length > end) break;
+
+        switch (e->type) {
+        case MADT_LAPIC: {
+            struct madt_lapic* lapic = (struct madt_lapic*)e;
+            if ((lapic->flags & MADT_LAPIC_ENABLED) && madt_info.cpu_count < ACPI_MAX_CPUS) {
+                madt_info.cpu_apic_ids[madt_info.cpu_count++] = lapic->apic_id;
+            }
+            break;
+        }
+        case MADT_IOAPIC: {
+            struct madt_ioapic* ioapic = (struct madt_ioapic*)e;
+            if (madt_info.ioapic_count < ACPI_MAX_IOAPICS) {
+                struct acpi_ioapic* out = &madt_info.ioapics[madt_info.ioapic_count++];
+                out->id = ioapic->id;
+                out->address = ioapic->address;
+                out->gsi_base = ioapic->gsi_base;
+            }
+            break;
+        }
+        case MADT_IRQ_OVERRIDE: {
+            struct madt_irq_override* ovr = (struct madt_irq_override*)e;
+            if (ovr->bus == 0 && ovr->source < ACPI_ISA_IRQS) {
+                madt_info.isa_gsi[ovr->source] = ovr->gsi;
+                madt_info.isa_flags[ovr->source] = ovr->flags;
+            }
+            break;
+        }
+        case MADT_LAPIC_ADDRESS: {
+            struct madt_lapic_address* addr = (struct madt_lapic_address*)e;
+            if (!(addr->address >> 32)) madt_info.lapic_address = (uint32_t)addr->address;
+            break;
+        }
+        }
+        entry += e->length;
+    }
+}
+
+static void parse_hpet(struct acpi_hpet* hpet) {
+    if (hpet->header.length < sizeof(struct acpi_hpet)) return;
+    if (hpet->address.space_id != ACPI_GAS_MEMORY || (hpet->address.address >> 32)) return;
+    hpet_address = (uint32_t)hpet->address.address;
+}
+
+bool acpi_init(void) {
+    if (scanned) return madt_usable;
+    scanned = true;
+
+    struct acpi_rsdp* rsdp = find_rsdp();
+    if (!rsdp) return false;
+
+    // Prefer the XSDT when it is reachable from 32-bit code
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address && !(rsdp->xsdt_address >> 32);
+    uint32_t root_phys = xsdt ? (uint32_t)rsdp->xsdt_address : rsdp->rsdt_address;
+    uint32_t entry_size = xsdt ? 8 : 4;
+
+    struct acpi_sdt_header* root = map_table(0, root_phys);
+    if (root) {
+        uint32_t count = (root->length - sizeof(struct acpi_sdt_header)) / entry_size;
+        uint8_t* entries = (uint8_t*)(root + 1);
+
+        for (uint32_t i = 0; i < count && !(madt_found && hpet_address); i++) {
+            uint64_t phys = xsdt ? *(uint64_t*)(entries + i * 8) : *(uint32_t*)(entries + i * 4);
+            if (phys >> 32) continue;
+
+            struct acpi_sdt_header* table = map_table(1, (uint32_t)phys);
+            if (!table) continue;
+            if (!madt_found && memcmp(table->signature, "APIC", 4) == 0) {
+                parse_madt((struct acpi_madt*)table);
+                madt_found = true;
+            } else if (!hpet_address && memcmp(table->signature, "HPET", 4) == 0) {
+                parse_hpet((struct acpi_hpet*)table);
+            }
+        }
+    }
+
+    paging_unmap(ACPI_WINDOW_BASE, 2 * ACPI_WINDOW_SIZE);
+    madt_usable = madt_found && madt_info.cpu_count > 0 && madt_info.ioapic_count > 0;
+    return madt_usable;
+}
+
+const struct acpi_madt_info* acpi_madt(void) {
+    return madt_found ? &madt_info : NULL;
+}
+
+uint32_t acpi_hpet_address(void) {
+    return hpet_address;
+}
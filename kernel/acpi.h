@@ -0,0 +1,44 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ACPI table discovery, limited to what interrupt and timer setup need:
+// the MADT describing local APICs, I/O APICs and ISA IRQ overrides, and
+// the HPET's address
+
+#define ACPI_MAX_CPUS    16
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_ISA_IRQS    16
+
+// MPS INTI flags from interrupt source overrides
+#define ACPI_IRQ_POLARITY_MASK  0x03
+#define ACPI_IRQ_ACTIVE_LOW     0x03
+#define ACPI_IRQ_TRIGGER_MASK   0x0C
+#define ACPI_IRQ_LEVEL          0x0C
+
+struct acpi_ioapic {
+    uint8_t id;
+    uint32_t address;
+    uint32_t gsi_base;          // First global system interrupt it serves
+};
+
+struct acpi_madt_info {
+    uint32_t lapic_address;
+    bool legacy_pics;           // 8259s present and must be masked
+    uint32_t cpu_count;
+    uint8_t cpu_apic_ids[ACPI_MAX_CPUS];
+    uint32_t ioapic_count;
+    struct acpi_ioapic ioapics[ACPI_MAX_IOAPICS];
+    uint32_t isa_gsi[ACPI_ISA_IRQS];    // Global interrupt for each ISA IRQ
+    uint16_t isa_flags[ACPI_ISA_IRQS];  // ACPI_IRQ_* polarity and trigger
+};
+
+// Scans the tables once; later calls return the first result. False
+// when there is no usable MADT.
+bool acpi_init(void);
+const struct acpi_madt_info* acpi_madt(void);
+uint32_t acpi_hpet_address(void);           // Physical, 0 when there is none
+
+#endif // ACPI_H
@@ -0,0 +1,264 @@
+#include "apic.h"
+#include "acpi.h"
+#include "isr.h"
+#include "paging.h"
+#include "memory.h"
+#include "cpu.h"
+#include "pit.h"
+#include <div64.h>
+
+// The local APIC is reached through MMIO, so EOI is a single uncached
+// store instead of one or two port writes to the 8259s. Only the first
+// I/O APIC that covers the ISA IRQs is used.
+
+// Local APIC registers
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ESR           0x280
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_LVT_ERROR     0x370
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_NMI       0x400
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_DIVIDE_16     0x3
+
+#define LAPIC_ICR_FIXED     0x000
+#define LAPIC_ICR_INIT      0x500
+#define LAPIC_ICR_STARTUP   0x600
+#define LAPIC_ICR_PENDING   0x1000  // Delivery status: not yet accepted
+#define LAPIC_ICR_ASSERT    0x4000
+
+// I/O APIC registers, reached through IOREGSEL/IOWIN
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_REDIR(n)     (0x10 + 2 * (n))
+
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+#define TIMER_CALIBRATE_US  10000
+
+static volatile uint32_t* lapic;
+static volatile uint32_t* ioapic;
+static uint32_t ioapic_gsi_base;
+static uint32_t ioapic_entries;
+static uint32_t isa_gsi[ACPI_ISA_IRQS];
+static uint32_t timer_hz;           // LAPIC timer ticks per second
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+}
+
+static inline uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    return ioapic[IOAPIC_WINDOW / 4];
+}
+
+static inline void ioapic_write(uint32_t reg, uint32_t val) {
+    ioapic[IOAPIC_REGSEL / 4] = reg;
+    ioapic[IOAPIC_WINDOW / 4] = val;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+static bool isa_entry(uint8_t irq, uint32_t* entry) {
+    if (irq >= ACPI_ISA_IRQS) return false;
+    *entry = isa_gsi[irq] - ioapic_gsi_base;
+    return *entry < ioapic_entries;
+}
+
+void ioapic_mask(uint8_t irq) {
+    uint32_t entry;
+    if (!isa_entry(irq, &entry)) return;
+    ioapic_write(IOAPIC_REDIR(entry), ioapic_read(IOAPIC_REDIR(entry)) | IOAPIC_MASKED);
+}
+
+void ioapic_unmask(uint8_t irq) {
+    uint32_t entry;
+    if (!isa_entry(irq, &entry)) return;
+    ioapic_write(IOAPIC_REDIR(entry), ioapic_read(IOAPIC_REDIR(entry)) & ~IOAPIC_MASKED);
+}
+
+// The high half picks the target and writing the low half sends, so an
+// IPI sent from an interrupt in between would retarget this one
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint32_t page) {
+    lapic_send(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (page & 0xFF));
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, LAPIC_ICR_FIXED | LAPIC_ICR_ASSERT | vector);
+}
+
+// Count LAPIC timer ticks across a PIT one-shot
+static void calibrate_timer(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    pit_oneshot_start(TIMER_CALIBRATE_US);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    while (!pit_oneshot_done()) {
+        __asm__ volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    timer_hz = elapsed * (1000000 / TIMER_CALIBRATE_US);
+}
+
+uint32_t apic_timer_frequency(void) {
+    return timer_hz;
+}
+
+void apic_timer_periodic(uint32_t hz) {
+    if (!hz || !timer_hz) return;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, timer_hz / hz ? timer_hz / hz : 1);
+}
+
+void apic_timer_oneshot(uint32_t us) {
+    uint64_t ticks = (uint64_t)timer_hz * us;
+    div64_u32(&ticks, 1000000);
+
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, ticks > 0xFFFFFFFF ? 0xFFFFFFFF : (ticks ? (uint32_t)ticks : 1));
+}
+
+void apic_timer_stop(void) {
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+}
+
+// Registers every CPU sets up the same way for its own local APIC
+static void lapic_setup(void) {
+    uint64_t base = rdmsr(MSR_APIC_BASE);
+    wrmsr(MSR_APIC_BASE, base | MSR_APIC_BASE_ENABLE);
+
+    // Accept every priority, take spurious interrupts on their own vector
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+    // The 8259s reach the CPU through LINT0 as ExtINT; cut them off
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_ESR, 0);
+    lapic_eoi();
+}
+
+void lapic_init_ap(void) {
+    lapic_setup();
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+}
+
+static bool lapic_init(uint32_t address) {
+    lapic = paging_map_mmio(address, PAGE_SIZE);
+    if (!lapic) return false;
+
+    lapic_setup();
+    calibrate_timer();
+    return true;
+}
+
+// Find and map the chip that serves GSI 0, which carries the ISA IRQs.
+// Nothing is programmed yet.
+static bool ioapic_map(const struct acpi_madt_info* madt) {
+    const struct acpi_ioapic* chip = NULL;
+
+    for (uint32_t i = 0; i < madt->ioapic_count; i++) {
+        if (madt->ioapics[i].gsi_base == 0) chip = &madt->ioapics[i];
+    }
+    if (!chip) return false;
+
+    ioapic = paging_map_mmio(chip->address, PAGE_SIZE);
+    if (!ioapic) return false;
+    ioapic_gsi_base = chip->gsi_base;
+    return true;
+}
+
+static void ioapic_init(const struct acpi_madt_info* madt) {
+    ioapic_entries = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+    for (uint32_t i = 0; i < ioapic_entries; i++) {
+        ioapic_write(IOAPIC_REDIR(i), IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REDIR(i) + 1, 0);
+    }
+
+    // An override can move an IRQ onto another IRQ's identity-mapped
+    // input (IRQ0 onto GSI 2 is usual); that other IRQ then has no pin
+    uint32_t claimed = 0;
+    for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+        isa_gsi[irq] = madt->isa_gsi[irq];
+        if (isa_gsi[irq] != irq && isa_gsi[irq] < 32) claimed |= 1u << isa_gsi[irq];
+    }
+    for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+        if (isa_gsi[irq] == irq && (claimed & (1u << irq))) isa_gsi[irq] = 0xFFFFFFFF;
+    }
+
+    // Fixed delivery to this CPU, on the vector the PIC would have used
+    uint32_t dest = lapic_id() << 24;
+    for (uint32_t irq = 0; irq < ACPI_ISA_IRQS; irq++) {
+        uint32_t entry;
+        uint16_t flags = madt->isa_flags[irq];
+        uint32_t low = IOAPIC_MASKED | IRQ_VECTOR(irq);
+
+        if (!isa_entry(irq, &entry)) continue;
+
+        if ((flags & ACPI_IRQ_POLARITY_MASK) == ACPI_IRQ_ACTIVE_LOW) low |= IOAPIC_ACTIVE_LOW;
+        if ((flags & ACPI_IRQ_TRIGGER_MASK) == ACPI_IRQ_LEVEL) low |= IOAPIC_LEVEL;
+
+        ioapic_write(IOAPIC_REDIR(entry) + 1, dest);
+        ioapic_write(IOAPIC_REDIR(entry), low);
+    }
+}
+
+bool apic_init(void) {
+    if (!CPU_HAS(features_edx, CPUID_EDX_APIC) || !CPU_HAS(features_edx, CPUID_EDX_MSR)) {
+        return false;
+    }
+    if (!acpi_init()) return false;
+
+    // Everything that can fail comes before lapic_setup() masks LINT0,
+    // so the 8259s still reach the CPU if we return false
+    const struct acpi_madt_info* madt = acpi_madt();
+    if (!ioapic_map(madt) || !lapic_init(madt->lapic_address)) return false;
+    ioapic_init(madt);
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Local APIC and I/O APIC. ISA IRQs keep the vectors the PIC used
+// (IRQ_BASE + irq) so handlers do not care which controller is active.
+#define APIC_TIMER_VECTOR    0x30
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// Set up the boot CPU's local APIC and route every ISA IRQ through the
+// I/O APIC, masked. False when ACPI or the CPU has no APIC.
+bool apic_init(void);
+
+void lapic_eoi(void);
+uint32_t lapic_id(void);
+
+// Enable an application processor's local APIC the way apic_init() set
+// up the boot CPU's, timer included but stopped
+void lapic_init_ap(void);
+
+// Inter-processor interrupts; each returns once the target accepted it
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint32_t page);  // Starts at page << 12, real mode
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+void ioapic_mask(uint8_t irq);      // ISA IRQ numbers, overrides applied
+void ioapic_unmask(uint8_t irq);
+
+// Local APIC timer on APIC_TIMER_VECTOR, calibrated against the PIT
+uint32_t apic_timer_frequency(void);    // Ticks per second
+void apic_timer_periodic(uint32_t hz);
+void apic_timer_oneshot(uint32_t us);
+void apic_timer_stop(void);
+
+#endif // APIC_H
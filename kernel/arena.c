@@ -0,0 +1,124 @@
+#include "arena.h"
+#include "memory.h"
+
+// Chunks form a list from oldest to newest. Allocation bumps a pointer in
+// the current chunk; chunks after it are spares left by an earlier rewind
+// and are reused before asking kmalloc for more. Rewind and reset only
+// move the current pointer, so they are O(1) regardless of how much was
+// allocated.
+
+#define ARENA_MIN_ALIGN 8
+
+struct kmem_arena_chunk {
+    struct kmem_arena_chunk* next;
+    struct kmem_arena_chunk* prev;
+    size_t size;        // Usable bytes after the header
+    size_t used;
+};
+
+static inline uint8_t* chunk_data(struct kmem_arena_chunk* chunk) {
+    return (uint8_t*)(chunk + 1);
+}
+
+static struct kmem_arena_chunk* chunk_create(size_t bytes) {
+    struct kmem_arena_chunk* chunk = kmalloc(bytes);
+    if (!chunk) return NULL;
+
+    chunk->next = NULL;
+    chunk->prev = NULL;
+    chunk->size = bytes - sizeof(struct kmem_arena_chunk);
+    chunk->used = 0;
+    return chunk;
+}
+
+// Offset in chunk where an object of size/align fits, or -1
+static inline int32_t chunk_fit(struct kmem_arena_chunk* chunk, size_t used, size_t size, size_t align) {
+    uint32_t base = (uint32_t)chunk_data(chunk);
+    uint32_t start = (base + used + align - 1) & ~(align - 1);
+    uint32_t offset = start - base;
+
+    if (offset > chunk->size || chunk->size - offset < size) return -1;
+    return (int32_t)offset;
+}
+
+struct kmem_arena* kmem_arena_create(size_t chunk_size) {
+    if (chunk_size == 0) chunk_size = KMEM_ARENA_DEFAULT_CHUNK;
+    if (chunk_size <= sizeof(struct kmem_arena_chunk)) return NULL;
+
+    struct kmem_arena* arena = kmalloc(sizeof(struct kmem_arena));
+    if (!arena) return NULL;
+
+    arena->first = chunk_create(chunk_size);
+    if (!arena->first) {
+        kfree(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    arena->chunk_size = chunk_size;
+    return arena;
+}
+
+void kmem_arena_destroy(struct kmem_arena* arena) {
+    if (!arena) return;
+
+    struct kmem_arena_chunk* chunk = arena->first;
+    while (chunk) {
+        struct kmem_arena_chunk* next = chunk->next;
+        kfree(chunk);
+        chunk = next;
+    }
+    kfree(arena);
+}
+
+void* kmem_arena_alloc_aligned(struct kmem_arena* arena, size_t size, size_t align) {
+    if (!arena || (align & (align - 1))) return NULL;
+    if (align < ARENA_MIN_ALIGN) align = ARENA_MIN_ALIGN;
+
+    struct kmem_arena_chunk* chunk = arena->current;
+    int32_t offset = chunk_fit(chunk, chunk->used, size, align);
+
+    if (offset < 0) {
+        // Move on to the next spare chunk, or splice a new one in after
+        // the current chunk when the spare is too small
+        struct kmem_arena_chunk* next = chunk->next;
+        if (!next || (offset = chunk_fit(next, 0, size, align)) < 0) {
+            size_t bytes = sizeof(struct kmem_arena_chunk) + size + align;
+            if (bytes < arena->chunk_size) bytes = arena->chunk_size;
+            if (bytes < size) return NULL;  // Overflowed
+
+            next = chunk_create(bytes);
+            if (!next) return NULL;
+
+            next->prev = chunk;
+            next->next = chunk->next;
+            if (chunk->next) chunk->next->prev = next;
+            chunk->next = next;
+            offset = chunk_fit(next, 0, size, align);
+        }
+        chunk = next;
+        arena->current = chunk;
+    }
+
+    chunk->used = offset + size;
+    return chunk_data(chunk) + offset;
+}
+
+void* kmem_arena_alloc(struct kmem_arena* arena, size_t size) {
+    return kmem_arena_alloc_aligned(arena, size, ARENA_MIN_ALIGN);
+}
+
+struct kmem_arena_mark kmem_arena_mark(struct kmem_arena* arena) {
+    struct kmem_arena_mark mark = { arena->current, arena->current->used };
+    return mark;
+}
+
+void kmem_arena_rewind(struct kmem_arena* arena, struct kmem_arena_mark mark) {
+    if (!mark.chunk) return;
+    arena->current = mark.chunk;
+    mark.chunk->used = mark.used;
+}
+
+void kmem_arena_reset(struct kmem_arena* arena) {
+    arena->current = arena->first;
+    arena->first->used = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Region allocator for bursts of short-lived objects that are released
+// together. Memory comes in chunks from kmalloc; individual objects are
+// never freed, the whole arena is rewound or destroyed instead.
+
+#define KMEM_ARENA_DEFAULT_CHUNK 4096
+
+struct kmem_arena_chunk;
+
+struct kmem_arena {
+    struct kmem_arena_chunk* first;     // Oldest chunk
+    struct kmem_arena_chunk* current;   // Chunk being carved; later ones are spare
+    size_t chunk_size;
+};
+
+// Position saved by kmem_arena_mark(), restored by kmem_arena_rewind()
+struct kmem_arena_mark {
+    struct kmem_arena_chunk* chunk;
+    size_t used;
+};
+
+struct kmem_arena* kmem_arena_create(size_t chunk_size);   // 0 selects the default
+void kmem_arena_destroy(struct kmem_arena* arena);
+
+void* kmem_arena_alloc(struct kmem_arena* arena, size_t size);
+void* kmem_arena_alloc_aligned(struct kmem_arena* arena, size_t size, size_t align);
+
+struct kmem_arena_mark kmem_arena_mark(struct kmem_arena* arena);
+void kmem_arena_rewind(struct kmem_arena* arena, struct kmem_arena_mark mark);
+void kmem_arena_reset(struct kmem_arena* arena);
+
+#endif // ARENA_H
@@ -0,0 +1,825 @@
+// bench.c - In-kernel microbenchmarks, timed with RDTSC
+#include "bench.h"
+#include "console.h"
+#include "cpu.h"
+#include "memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "isr.h"
+#include "irq.h"
+#include "pic.h"
+#include "apic.h"
+#include "deferred.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "clock.h"
+#include "timer.h"
+#include "sched.h"
+#include "smp.h"
+#include <div64.h>
+#include <string.h>
+
+static uint32_t per_op(uint64_t cycles, uint32_t ops) {
+    div64_u32(&cycles, ops);
+    return (uint32_t)cycles;
+}
+
+// TLB-miss-heavy walk: a pointer chase visiting every page of a 16 MB
+// footprint in scrambled order, through the same frames mapped once with
+// 4 MB pages and once with 4 KB pages
+#define TLB_BENCH_BLOCKS 4
+#define TLB_BENCH_SIZE   (TLB_BENCH_BLOCKS * LARGE_PAGE_SIZE)
+#define TLB_BENCH_PAGES  (TLB_BENCH_SIZE / PAGE_SIZE)
+#define TLB_BENCH_STRIDE 1031   // Odd, so i * stride visits every page
+#define TLB_BENCH_ROUNDS 8
+#define TLB_PSE_BASE     KERNEL_VMAP_BASE
+#define TLB_4K_BASE      (KERNEL_VMAP_BASE + TLB_BENCH_SIZE)
+
+static uint32_t tlb_node_offset(uint32_t i) {
+    uint32_t page = (i * TLB_BENCH_STRIDE) % TLB_BENCH_PAGES;
+    return page * PAGE_SIZE + (i % 64) * 64;
+}
+
+static uint64_t tlb_walk(uint32_t base) {
+    uint32_t offset = tlb_node_offset(0);
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < TLB_BENCH_PAGES * TLB_BENCH_ROUNDS; i++) {
+        offset = *(volatile uint32_t*)(base + offset);
+    }
+    return rdtsc() - start;
+}
+
+static void bench_paging_tlb(void) {
+    uint32_t blocks[TLB_BENCH_BLOCKS];
+    uint32_t i;
+
+    if (!paging_pse_enabled()) {
+        kprintf("tlb: PSE not supported, skipped\n");
+        return;
+    }
+
+    for (i = 0; i < TLB_BENCH_BLOCKS; i++) {
+        blocks[i] = pmm_alloc_pages(PMM_MAX_ORDER);
+        if (!blocks[i]) break;
+        paging_map(TLB_PSE_BASE + i * LARGE_PAGE_SIZE, blocks[i], LARGE_PAGE_SIZE, PAGE_WRITE);
+        paging_map(TLB_4K_BASE + i * LARGE_PAGE_SIZE, blocks[i], LARGE_PAGE_SIZE,
+                   PAGE_WRITE | PAGING_MAP_4K);
+    }
+
+    if (i == TLB_BENCH_BLOCKS) {
+        // Nodes store offsets, so both windows walk the same list
+        for (uint32_t n = 0; n < TLB_BENCH_PAGES; n++) {
+            *(uint32_t*)(TLB_PSE_BASE + tlb_node_offset(n)) =
+                tlb_node_offset((n + 1) % TLB_BENCH_PAGES);
+        }
+
+        tlb_walk(TLB_PSE_BASE);
+        uint64_t pse = tlb_walk(TLB_PSE_BASE);
+        tlb_walk(TLB_4K_BASE);
+        uint64_t small = tlb_walk(TLB_4K_BASE);
+
+        uint32_t steps = TLB_BENCH_PAGES * TLB_BENCH_ROUNDS;
+        kprintf("tlb: 16 MB page walk, 4 MB pages %u cyc/step, 4 KB pages %u cyc/step\n",
+                per_op(pse, steps), per_op(small, steps));
+    } else {
+        kprintf("tlb: not enough memory, skipped\n");
+    }
+
+    while (i--) {
+        paging_unmap(TLB_PSE_BASE + i * LARGE_PAGE_SIZE, LARGE_PAGE_SIZE);
+        paging_unmap(TLB_4K_BASE + i * LARGE_PAGE_SIZE, LARGE_PAGE_SIZE);
+        pmm_free_pages(blocks[i], PMM_MAX_ORDER);
+    }
+}
+
+// memcpy/memset variants over 16 B - 1 MB on warmed, 16-byte aligned
+// buffers; reported as cycles per call, best of MEMOPS_ROUNDS
+#define MEMOPS_MIN_SIZE 16
+#define MEMOPS_MAX_SIZE (1024 * 1024)
+#define MEMOPS_ROUNDS   8
+#define MEMOPS_BYTES    (4 * MEMOPS_MAX_SIZE)   // Calls per size scale to this
+
+typedef void* (*memcpy_fn)(void*, const void*, size_t);
+typedef void* (*memset_fn)(void*, int, size_t);
+
+static uint32_t time_memcpy(memcpy_fn fn, void* dst, const void* src, size_t size) {
+    uint32_t calls = MEMOPS_BYTES / size;
+    uint64_t best = ~0ULL;
+
+    for (int round = 0; round < MEMOPS_ROUNDS; round++) {
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < calls; i++) fn(dst, src, size);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return per_op(best, calls);
+}
+
+static uint32_t time_memset(memset_fn fn, void* dst, size_t size) {
+    uint32_t calls = MEMOPS_BYTES / size;
+    uint64_t best = ~0ULL;
+
+    for (int round = 0; round < MEMOPS_ROUNDS; round++) {
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < calls; i++) fn(dst, 0x5A, size);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return per_op(best, calls);
+}
+
+static void bench_memops(void) {
+    uint32_t features = string_features();
+    uint8_t* src = kmalloc(MEMOPS_MAX_SIZE);
+    uint8_t* dst = kmalloc(MEMOPS_MAX_SIZE);
+
+    if (!src || !dst) {
+        kprintf("memops: not enough memory, skipped\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+
+    // Fault the heap pages in before timing anything
+    memset_stosd(src, 1, MEMOPS_MAX_SIZE);
+    memset_stosd(dst, 0, MEMOPS_MAX_SIZE);
+
+    kprintf("memops: cycles per call (sse2 %s, erms %s)\n",
+            features & STRING_FEAT_SSE2 ? "on" : "off",
+            features & STRING_FEAT_ERMS ? "on" : "off");
+    kprintf("  size    movsd   movsb    sse2 | stosd   stosb    sse2\n");
+    for (size_t size = MEMOPS_MIN_SIZE; size <= MEMOPS_MAX_SIZE; size <<= 2) {
+        uint32_t sse2_cpy = 0, sse2_set = 0;
+        if (features & STRING_FEAT_SSE2) {
+            sse2_cpy = time_memcpy(memcpy_sse2, dst, src, size);
+            sse2_set = time_memset(memset_sse2, dst, size);
+        }
+        kprintf("%7u %8u %7u %7u | %5u %7u %7u\n", size,
+                time_memcpy(memcpy_movsd, dst, src, size),
+                time_memcpy(memcpy_movsb, dst, src, size), sse2_cpy,
+                time_memset(memset_stosd, dst, size),
+                time_memset(memset_stosb, dst, size), sse2_set);
+    }
+
+    kfree(src);
+    kfree(dst);
+}
+
+// Clone of an address space with COW_BENCH_SIZE of written memory,
+// sharing frames versus copying them, then the cost of breaking COW
+#define COW_BENCH_SIZE   (4 * 1024 * 1024)
+#define COW_BENCH_PAGES  (COW_BENCH_SIZE / PAGE_SIZE)
+#define COW_BENCH_WRITES (COW_BENCH_PAGES / 8)
+
+struct clone_result {
+    uint32_t cycles;
+    uint32_t frames;            // Frames taken from the PMM by the clone
+    uint32_t write_cycles;      // Per first write in the parent afterwards
+};
+
+static bool time_clone(struct address_space* parent, uint32_t flags, struct clone_result* out) {
+    uint32_t free_before = pmm_free_count();
+    uint64_t start = rdtsc();
+    struct address_space* child = vmm_clone(parent, flags);
+    uint64_t cycles = rdtsc() - start;
+
+    if (!child) return false;
+    out->cycles = (uint32_t)cycles;
+    out->frames = free_before - pmm_free_count();
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < COW_BENCH_WRITES; i++) {
+        *(volatile uint32_t*)(USER_BASE + i * 8 * PAGE_SIZE) = i;
+    }
+    out->write_cycles = per_op(rdtsc() - start, COW_BENCH_WRITES);
+
+    vmm_destroy(child);
+    return true;
+}
+
+static void bench_cow_clone(void) {
+    struct address_space* parent = vmm_create();
+    struct clone_result cow, eager;
+
+    if (!parent || !vmm_map_anon(parent, USER_BASE, 2 * COW_BENCH_SIZE, PAGE_WRITE)) {
+        kprintf("cow: not enough memory, skipped\n");
+        vmm_destroy(parent);
+        return;
+    }
+    vmm_switch(parent);
+
+    // Reads of fresh memory all land on the zero page
+    uint32_t free_before = pmm_free_count();
+    for (uint32_t i = 0; i < COW_BENCH_PAGES; i++) {
+        (void)*(volatile uint32_t*)(USER_BASE + COW_BENCH_SIZE + i * PAGE_SIZE);
+    }
+    kprintf("cow: read %u fresh pages, %u frames used\n",
+            COW_BENCH_PAGES, free_before - pmm_free_count());
+
+    for (uint32_t i = 0; i < COW_BENCH_PAGES; i++) {
+        *(volatile uint32_t*)(USER_BASE + i * PAGE_SIZE) = i;
+    }
+
+    if (time_clone(parent, 0, &cow) && time_clone(parent, VMM_CLONE_EAGER, &eager)) {
+        kprintf("cow: clone 4 MB, shared %u cyc %u KB, eager %u cyc %u KB\n",
+                cow.cycles, cow.frames * 4, eager.cycles, eager.frames * 4);
+        kprintf("cow: first write after clone %u cyc, without sharing %u cyc\n",
+                cow.write_cycles, eager.write_cycles);
+    } else {
+        kprintf("cow: clone failed\n");
+    }
+
+    vmm_destroy(parent);
+}
+
+// Round trip through the IRQ entry path, raised with INT on a masked
+// line: stub, dispatch to a handler, EOI and IRET, once on the fast path
+// and once with the full registers_t frame. On the PIC, IRQ7 with
+// nothing in service shows the cost of the spurious filter instead.
+#define IRQ_BENCH_LINE  5
+#define IRQ_BENCH_ITERS 10000
+
+static volatile uint32_t irq_bench_hits;
+
+static void irq_bench_handler(registers_t* regs) {
+    (void)regs;
+    irq_bench_hits++;
+}
+
+static uint64_t irq_bench_round(void) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++) {
+        __asm__ volatile("int %0" : : "i"(IRQ_VECTOR(IRQ_BENCH_LINE)) : "memory");
+    }
+    return rdtsc() - start;
+}
+
+// What a ring-0 entry used to pay to load KERNEL_DS into DS/ES/FS/GS on
+// the way in and restore the saved DS on the way out
+static uint64_t segment_reload_round(void) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++) {
+        __asm__ volatile("mov %%ds, %%ax\n\t"
+                         "mov %%ax, %%ds\n\t"
+                         "mov %%ax, %%es\n\t"
+                         "mov %%ax, %%fs\n\t"
+                         "mov %%ax, %%gs\n\t"
+                         "mov %%ax, %%ds\n\t"
+                         "mov %%ax, %%es\n\t"
+                         "mov %%ax, %%fs\n\t"
+                         "mov %%ax, %%gs"
+                         : : : "eax", "memory");
+    }
+    return rdtsc() - start;
+}
+
+static void bench_irq_roundtrip(void) {
+    uint64_t best_irq = ~0ULL, best_full = ~0ULL, best_spurious = ~0ULL;
+    uint64_t best_segments = ~0ULL;
+    bool apic = irq_apic_active();
+
+    register_interrupt_handler(IRQ_VECTOR(IRQ_BENCH_LINE), irq_bench_handler);
+    for (int round = 0; round < 4; round++) {
+        uint64_t cycles = irq_bench_round();
+        if (cycles < best_irq) best_irq = cycles;
+
+        irq_set_full_frame(IRQ_VECTOR(IRQ_BENCH_LINE), true);
+        cycles = irq_bench_round();
+        irq_set_full_frame(IRQ_VECTOR(IRQ_BENCH_LINE), false);
+        if (cycles < best_full) best_full = cycles;
+
+        cycles = segment_reload_round();
+        if (cycles < best_segments) best_segments = cycles;
+        if (apic) continue;
+
+        uint64_t start = rdtsc();
+        for (int i = 0; i < IRQ_BENCH_ITERS; i++) {
+            __asm__ volatile("int %0" : : "i"(IRQ_VECTOR(7)) : "memory");
+        }
+        cycles = rdtsc() - start;
+        if (cycles < best_spurious) best_spurious = cycles;
+    }
+    unregister_interrupt_handler(IRQ_VECTOR(IRQ_BENCH_LINE));
+
+    kprintf("irq: round trip %u cyc fast, %u cyc full frame (%s); ring-0 segment reloads skipped %u cyc\n",
+            per_op(best_irq, IRQ_BENCH_ITERS), per_op(best_full, IRQ_BENCH_ITERS),
+            apic ? "apic" : "pic", per_op(best_segments, IRQ_BENCH_ITERS));
+    if (!apic) {
+        kprintf("irq: spurious IRQ7 %u cyc (%u filtered)\n",
+                per_op(best_spurious, IRQ_BENCH_ITERS), spurious_irq_count);
+    }
+}
+
+// Cost of acknowledging an interrupt on each controller. With nothing in
+// service both EOIs are no-ops for the hardware, so this is pure access
+// cost: port writes to the 8259s against an uncached MMIO store.
+static void bench_eoi(void) {
+    if (!irq_apic_active()) {
+        kprintf("eoi: no APIC, skipped\n");
+        return;
+    }
+
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++) pic_send_eoi(8);
+    uint64_t pic = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++) lapic_eoi();
+    uint64_t apic = rdtsc() - start;
+
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+
+    kprintf("eoi: 8259 slave+master %u cyc, local APIC %u cyc, timer %u Hz\n",
+            per_op(pic, IRQ_BENCH_ITERS), per_op(apic, IRQ_BENCH_ITERS),
+            apic_timer_frequency());
+}
+
+// Interrupts-off time of an IRQ whose handler has DEFER_BENCH_WORK
+// cycles of processing, done inline versus handed to deferred work
+#define DEFER_BENCH_WORK  50000
+#define DEFER_BENCH_ITERS 100
+
+static void spin_cycles(uint32_t cycles) {
+    uint64_t end = rdtsc() + cycles;
+    while (rdtsc() < end) {
+        __asm__ volatile("pause");
+    }
+}
+
+static void defer_bench_process(void* arg) {
+    (void)arg;
+    spin_cycles(DEFER_BENCH_WORK);
+}
+
+static struct deferred_work defer_bench_work = DEFERRED_WORK_INIT(defer_bench_process, 0);
+
+static void defer_bench_inline(registers_t* regs) {
+    (void)regs;
+    spin_cycles(DEFER_BENCH_WORK);
+}
+
+static void defer_bench_deferred(registers_t* regs) {
+    (void)regs;
+    defer_work(&defer_bench_work);
+}
+
+// The maximum is this CPU's; the caller stays pinned to it
+static uint32_t irq_off_with(isr_t handler) {
+    register_interrupt_handler(IRQ_VECTOR(IRQ_BENCH_LINE), handler);
+    irq_off_max_reset();
+    for (int i = 0; i < DEFER_BENCH_ITERS; i++) {
+        __asm__ volatile("int %0" : : "i"(IRQ_VECTOR(IRQ_BENCH_LINE)) : "memory");
+    }
+    unregister_interrupt_handler(IRQ_VECTOR(IRQ_BENCH_LINE));
+    return irq_off_max_cycles();
+}
+
+static void bench_deferred(void) {
+    thread_pin();
+    uint32_t saved_max = irq_off_max_cycles();
+    uint32_t inline_off = irq_off_with(defer_bench_inline);
+    uint32_t deferred_off = irq_off_with(defer_bench_deferred);
+
+    // A burst from one source while the work is still queued coalesces
+    uint32_t runs = defer_bench_work.runs;
+    __asm__ volatile("cli");
+    for (int i = 0; i < DEFER_BENCH_ITERS; i++) defer_work(&defer_bench_work);
+    __asm__ volatile("sti");
+    run_deferred_work();
+
+    kprintf("defer: max irq-off %u cyc inline, %u cyc deferred; %u queued -> %u run\n",
+            inline_off, deferred_off, DEFER_BENCH_ITERS, defer_bench_work.runs - runs);
+    if (saved_max > irq_off_max_cycles()) this_cpu_write(irq_off_max, saved_max);
+    thread_unpin();
+}
+
+// Null system call round trips from ring 3, int 0x80 against SYSENTER.
+// The user loop runs both back to back and marks the switch with a
+// syscall that reads the TSC.
+#define SYSCALL_BENCH_ITERS 10000
+#define SYSCALL_BENCH_MARK  (SYSCALL_MAX - 1)
+#define SYSCALL_BENCH_CODE  USER_BASE
+#define SYSCALL_BENCH_STACK (USER_BASE + 2 * PAGE_SIZE)
+
+extern uint8_t user_bench_start[];
+extern uint8_t user_bench_end[];
+
+static uint64_t syscall_bench_mark;
+
+static int32_t sys_bench_mark(uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1;
+    (void)a2;
+    (void)a3;
+    syscall_bench_mark = rdtsc();
+    return 0;
+}
+
+static void bench_syscall(void) {
+    struct address_space* as = vmm_create();
+    if (!as || !vmm_map_anon(as, SYSCALL_BENCH_CODE, 2 * PAGE_SIZE, PAGE_WRITE | PAGE_USER)) {
+        kprintf("syscall: no address space\n");
+        if (as) vmm_destroy(as);
+        return;
+    }
+
+    bool sysenter = syscall_sysenter_enabled();
+    struct address_space* prev = vmm_current();
+    vmm_switch(as);
+    memcpy((void*)SYSCALL_BENCH_CODE, user_bench_start, user_bench_end - user_bench_start);
+    uint32_t* stack = (uint32_t*)SYSCALL_BENCH_STACK - 3;
+    stack[0] = SYSCALL_BENCH_ITERS;
+    stack[1] = sysenter;
+    stack[2] = SYSCALL_BENCH_MARK;
+
+    syscall_register(SYSCALL_BENCH_MARK, sys_bench_mark);
+    uint64_t start = rdtsc();
+    user_enter(SYSCALL_BENCH_CODE, (uint32_t)stack);
+    uint64_t end = rdtsc();
+    syscall_unregister(SYSCALL_BENCH_MARK);
+
+    vmm_switch(prev);
+    vmm_destroy(as);
+
+    if (sysenter) {
+        kprintf("syscall: null round trip %u cyc int 0x80, %u cyc sysenter\n",
+                per_op(syscall_bench_mark - start, SYSCALL_BENCH_ITERS),
+                per_op(end - syscall_bench_mark, SYSCALL_BENCH_ITERS));
+    } else {
+        kprintf("syscall: null round trip %u cyc int 0x80, no sysenter\n",
+                per_op(syscall_bench_mark - start, SYSCALL_BENCH_ITERS));
+    }
+}
+
+// Context switches between two FPU states, each followed by one x87
+// instruction as a task using the FPU would run: lazily, the first
+// instruction traps and moves the state; eagerly, every switch does.
+// The idle column switches lazily without touching the FPU at all.
+#define FPU_BENCH_ITERS 1000
+
+static struct fpu_state fpu_bench_states[2];
+
+static uint64_t fpu_switch_round(uint32_t flags, bool touch) {
+    fpu_state_init(&fpu_bench_states[0], flags);
+    fpu_state_init(&fpu_bench_states[1], flags);
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < FPU_BENCH_ITERS; i++) {
+        fpu_switch(&fpu_bench_states[i & 1]);
+        if (touch) __asm__ volatile("fnop");
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    fpu_switch(0);
+    fpu_state_release(&fpu_bench_states[0]);
+    fpu_state_release(&fpu_bench_states[1]);
+    return cycles;
+}
+
+static void bench_fpu_switch(void) {
+    uint32_t traps = fpu_stats.traps;
+    uint64_t lazy = fpu_switch_round(0, true);
+    uint32_t lazy_traps = fpu_stats.traps - traps;
+    uint64_t eager = fpu_switch_round(FPU_EAGER, true);
+    uint64_t idle = fpu_switch_round(0, false);
+
+    kprintf("fpu: switch+use %u cyc lazy (%u traps), %u cyc eager; switch alone %u cyc lazy\n",
+            per_op(lazy, FPU_BENCH_ITERS), lazy_traps, per_op(eager, FPU_BENCH_ITERS),
+            per_op(idle, FPU_BENCH_ITERS));
+}
+
+// Cost of reading the clock, against the bare RDTSC underneath it, and
+// how far a 1 ms udelay() lands from 1 ms of ticks at the calibrated rate
+#define KTIME_BENCH_ITERS 10000
+
+static void bench_ktime(void) {
+    volatile uint64_t sink;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < KTIME_BENCH_ITERS; i++) sink = rdtsc();
+    uint64_t raw = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < KTIME_BENCH_ITERS; i++) sink = ktime_get_ns();
+    uint64_t ktime = rdtsc() - start;
+    (void)sink;
+
+    start = rdtsc();
+    udelay(1000);
+    uint64_t delay = rdtsc() - start;
+
+    kprintf("ktime: %u cyc per read (rdtsc %u cyc); udelay(1000) took %u ticks of %u expected\n",
+            per_op(ktime, KTIME_BENCH_ITERS), per_op(raw, KTIME_BENCH_ITERS),
+            (uint32_t)delay, clocksource.tsc_khz);
+}
+
+// Timer wheel cost on a private wheel: insert and cancel with delays
+// spread over several levels, then per-tick advance with the wheel empty
+// and with it loaded, collecting whatever comes due each tick
+#define TIMER_BENCH_COUNT 20000
+#define TIMER_BENCH_TICKS 1000
+#define TIMER_BENCH_SPAN  100000
+
+static void timer_bench_nop(void* arg) {
+    (void)arg;
+}
+
+static uint64_t timer_bench_advance(struct timer_wheel* wheel, uint32_t* expired) {
+    uint32_t tick = wheel->next_tick;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < TIMER_BENCH_TICKS; i++) {
+        *expired += timer_wheel_advance(wheel, tick++);
+        while (timer_wheel_pop_expired(wheel)) { }
+    }
+    return rdtsc() - start;
+}
+
+static void bench_timer_wheel(void) {
+    struct timer_wheel* wheel = kmalloc(sizeof(struct timer_wheel));
+    struct timer* timers = kmalloc(TIMER_BENCH_COUNT * sizeof(struct timer));
+    if (!wheel || !timers) {
+        kprintf("timer: out of memory\n");
+        kfree(wheel);
+        kfree(timers);
+        return;
+    }
+
+    timer_wheel_init(wheel, 0);
+    for (int i = 0; i < TIMER_BENCH_COUNT; i++) timer_setup(&timers[i], timer_bench_nop, 0);
+
+    uint32_t seed = 12345;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < TIMER_BENCH_COUNT; i++) {
+        seed = seed * 1103515245 + 12345;
+        timer_wheel_add(wheel, &timers[i], 1 + (seed >> 8) % TIMER_BENCH_SPAN);
+    }
+    uint64_t insert = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < TIMER_BENCH_COUNT; i++) timer_wheel_del(&timers[i]);
+    uint64_t cancel = rdtsc() - start;
+
+    uint32_t expired = 0;
+    uint64_t empty = timer_bench_advance(wheel, &expired);
+
+    for (int i = 0; i < TIMER_BENCH_COUNT; i++) {
+        seed = seed * 1103515245 + 12345;
+        timer_wheel_add(wheel, &timers[i], wheel->next_tick + 1 + (seed >> 8) % TIMER_BENCH_SPAN);
+    }
+    expired = 0;
+    uint64_t loaded = timer_bench_advance(wheel, &expired);
+
+    kprintf("timer: add %u cyc, cancel %u cyc; tick %u cyc empty, %u cyc with %u pending (%u expired)\n",
+            per_op(insert, TIMER_BENCH_COUNT), per_op(cancel, TIMER_BENCH_COUNT),
+            per_op(empty, TIMER_BENCH_TICKS), per_op(loaded, TIMER_BENCH_TICKS),
+            TIMER_BENCH_COUNT, expired);
+
+    kfree(timers);
+    kfree(wheel);
+}
+
+// Scheduler costs, all from threads of higher priority than main, which
+// runs again once they exit. Main and the threads stay on one CPU, so
+// the figures do not depend on how many there are. Two threads ping-pong with thread_yield for
+// the cost of a switch; a blocked thread woken from main gives the
+// wake-to-run latency; yields with nothing else runnable give the
+// scheduler's own overhead, the same with SCHED_BENCH_QUEUED threads
+// waiting below. Last, two spinners share the CPU through preemption.
+#define SCHED_BENCH_ITERS  10000
+#define SCHED_BENCH_QUEUED 64
+#define SCHED_BENCH_PRIO   (SCHED_PRIO_DEFAULT - 4)
+#define SCHED_BENCH_SPIN   (4 * SCHED_TIMESLICE)
+
+static volatile uint64_t sched_bench_start;
+static volatile uint64_t sched_bench_end;
+static volatile uint64_t sched_bench_wake_tsc;
+static uint64_t sched_bench_latency;
+
+struct sched_bench_spinner {
+    uint64_t deadline;
+    uint32_t runtime_us;
+    uint32_t preemptions;
+};
+
+static void sched_bench_pingpong(void* arg) {
+    (void)arg;
+    if (!sched_bench_start) sched_bench_start = rdtsc();
+    for (int i = 0; i < SCHED_BENCH_ITERS; i++) thread_yield();
+    sched_bench_end = rdtsc();
+}
+
+static void sched_bench_waiter(void* arg) {
+    (void)arg;
+    for (int i = 0; i < SCHED_BENCH_ITERS; i++) {
+        __asm__ volatile("cli");
+        thread_block();
+        __asm__ volatile("sti");
+        sched_bench_latency += rdtsc() - sched_bench_wake_tsc;
+    }
+}
+
+static void sched_bench_nop(void* arg) {
+    (void)arg;
+}
+
+static void sched_bench_spin(void* arg) {
+    struct sched_bench_spinner* s = arg;
+    while (clock_ticks < s->deadline) {
+        __asm__ volatile("pause");
+    }
+
+    struct thread* self = thread_current();
+    uint64_t us = thread_runtime_ns(self);
+    div64_u32(&us, NSEC_PER_USEC);
+    s->runtime_us = (uint32_t)us;
+    s->preemptions = self->preemptions;
+}
+
+static uint64_t sched_bench_yield_alone(void) {
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SCHED_BENCH_ITERS; i++) thread_yield();
+    return rdtsc() - start;
+}
+
+static void bench_sched(void) {
+    bool was_pinned = thread_current()->pinned;
+    thread_pin();
+    uint32_t cpu = cpu_index();
+
+    // Create both before either runs
+    sched_bench_start = 0;
+    preempt_disable();
+    bool ok = thread_create_on("ping", sched_bench_pingpong, 0, SCHED_BENCH_PRIO, cpu) &&
+              thread_create_on("pong", sched_bench_pingpong, 0, SCHED_BENCH_PRIO, cpu);
+    preempt_enable();
+    if (!ok) {
+        kprintf("sched: out of memory\n");
+        if (!was_pinned) thread_unpin();
+        return;
+    }
+    uint64_t pingpong = sched_bench_end - sched_bench_start;
+
+    sched_bench_latency = 0;
+    struct thread* waiter = thread_create_on("waiter", sched_bench_waiter, 0, SCHED_BENCH_PRIO, cpu);
+    if (!waiter) {
+        kprintf("sched: out of memory\n");
+        if (!was_pinned) thread_unpin();
+        return;
+    }
+    for (int i = 0; i < SCHED_BENCH_ITERS; i++) {
+        sched_bench_wake_tsc = rdtsc();
+        thread_wake(waiter);
+    }
+
+    uint64_t alone = sched_bench_yield_alone();
+    uint32_t queued = 0;
+    while (queued < SCHED_BENCH_QUEUED &&
+           thread_create_on("queued", sched_bench_nop, 0, SCHED_PRIORITIES - 2, cpu)) {
+        queued++;
+    }
+    uint64_t loaded = sched_bench_yield_alone();
+    thread_sleep(1);    // Lets the queued threads run and exit
+
+    kprintf("sched: switch %u cyc, wake-to-run %u cyc; yield alone %u cyc, %u cyc with %u queued\n",
+            per_op(pingpong, 2 * SCHED_BENCH_ITERS), per_op(sched_bench_latency, SCHED_BENCH_ITERS),
+            per_op(alone, SCHED_BENCH_ITERS), per_op(loaded, SCHED_BENCH_ITERS), queued);
+
+    static struct sched_bench_spinner spinners[2];
+    uint64_t deadline = clock_ticks + SCHED_BENCH_SPIN;
+    preempt_disable();
+    for (int i = 0; i < 2; i++) {
+        spinners[i].deadline = deadline;
+        thread_create_on("spin", sched_bench_spin, &spinners[i], SCHED_BENCH_PRIO, cpu);
+    }
+    preempt_enable();
+
+    kprintf("sched: %u ticks shared by two spinners: %u us / %u us, %u / %u preemptions\n",
+            SCHED_BENCH_SPIN, spinners[0].runtime_us, spinners[1].runtime_us,
+            spinners[0].preemptions, spinners[1].preemptions);
+    if (!was_pinned) thread_unpin();
+}
+
+// CPU-bound throughput across CPUs: each worker runs SMP_BENCH_WORK steps
+// of an LCG, first one alone, then one per CPU. The workers are created
+// on main's CPU and not pinned, so how they spread is down to idle kicks
+// and stealing; with linear scaling both rounds take the same time.
+#define SMP_BENCH_WORK (1u << 24)
+
+struct smp_bench_run {
+    volatile uint32_t done;
+    uint32_t workers;
+    volatile uint64_t end;
+};
+
+static volatile uint32_t smp_bench_sink;
+
+static void smp_bench_worker(void* arg) {
+    struct smp_bench_run* run = arg;
+    uint32_t x = thread_current()->id;
+    for (uint32_t i = 0; i < SMP_BENCH_WORK; i++) {
+        x = x * 1664525 + 1013904223;
+    }
+    smp_bench_sink = x;
+
+    // The last one to finish stops the clock
+    uint32_t done = 1;
+    __asm__ volatile("lock xaddl %0, %1" : "+r"(done), "+m"(run->done) : : "memory", "cc");
+    if (done + 1 == run->workers) run->end = ktime_get_ns();
+}
+
+// Wall time for workers threads, 0 if they could not all be created
+static uint64_t smp_bench_round(uint32_t workers) {
+    static struct smp_bench_run run;
+    run.done = 0;
+    run.workers = workers;
+
+    uint64_t start = ktime_get_ns();
+    uint32_t created = 0;
+    preempt_disable();
+    while (created < workers && thread_create("smp", smp_bench_worker, &run, SCHED_BENCH_PRIO)) {
+        created++;
+    }
+    preempt_enable();
+
+    while (run.done < created) thread_sleep(1);
+    return created == workers ? run.end - start : 0;
+}
+
+static void bench_smp(void) {
+    uint32_t cpus = smp_cpu_count;
+    struct sched_stats before, after;
+    sched_get_stats(&before);
+
+    uint64_t one = smp_bench_round(1);
+    uint64_t all = smp_bench_round(cpus);
+    sched_get_stats(&after);
+    if (!one || !all) {
+        kprintf("smp: out of memory\n");
+        return;
+    }
+
+    div64_u32(&one, NSEC_PER_USEC);
+    div64_u32(&all, NSEC_PER_USEC);
+    // Work done per unit of time relative to one CPU, in hundredths
+    uint64_t speedup = one * cpus * 100;
+    div64_u32(&speedup, all ? (uint32_t)all : 1);
+
+    kprintf("smp: 1 worker %u us, %u workers on %u CPUs %u us; speedup %u.%02u, %u steals\n",
+            (uint32_t)one, cpus, cpus, (uint32_t)all,
+            (uint32_t)speedup / 100, (uint32_t)speedup % 100, after.steals - before.steals);
+}
+
+// Console output, CONSOLE_BENCH_LINES full-width lines written through
+// the shadow buffer and straight to VGA memory. Every line scrolls the
+// screen. The serial mirror is off for both, or the UART would be all
+// that is measured.
+#define CONSOLE_BENCH_LINES 2000
+
+static uint32_t console_bench_round(bool buffered) {
+    char line[VGA_WIDTH + 1];
+    for (uint32_t i = 0; i < VGA_WIDTH - 1; i++) line[i] = 'a' + i % 26;
+    line[VGA_WIDTH - 1] = '\n';
+    line[VGA_WIDTH] = '\0';
+
+    bool was = console_set_buffered(buffered);
+    uint64_t start = ktime_get_ns();
+    for (uint32_t i = 0; i < CONSOLE_BENCH_LINES; i++) write_string(line);
+    console_flush();
+    uint64_t us = ktime_get_ns() - start;
+    console_set_buffered(was);
+
+    // Lines per second
+    div64_u32(&us, NSEC_PER_USEC);
+    uint64_t rate = (uint64_t)CONSOLE_BENCH_LINES * 1000000;
+    div64_u32(&rate, us ? (uint32_t)us : 1);
+    return (uint32_t)rate;
+}
+
+static void bench_console(void) {
+    bool mirror = console_set_mirror(false);
+    uint32_t direct = console_bench_round(false);
+    uint32_t shadowed = console_bench_round(true);
+    console_set_mirror(mirror);
+
+    kprintf("console: %u lines/s direct to VGA, %u lines/s through the shadow\n", direct, shadowed);
+}
+
+void run_benchmarks(void) {
+    kprintf("Running benchmarks...\n");
+    bench_ktime();
+    bench_console();
+    bench_paging_tlb();
+    bench_memops();
+    bench_cow_clone();
+    bench_irq_roundtrip();
+    bench_eoi();
+    bench_deferred();
+    bench_syscall();
+    bench_fpu_switch();
+    bench_timer_wheel();
+    bench_sched();
+    bench_smp();
+}
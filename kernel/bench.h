@@ -0,0 +1,7 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// In-kernel microbenchmarks, run at boot when built with BENCH=1
+void run_benchmarks(void);
+
+#endif // BENCH_H
@@ -0,0 +1,243 @@
+#include "clock.h"
+#include "pit.h"
+#include "acpi.h"
+#include "paging.h"
+#include "memory.h"
+#include "isr.h"
+#include "irq.h"
+#include "sched.h"
+
+// Calibration times a window of the reference clock with the TSC, a few
+// times over. The window length comes from the reference, so a stall only
+// ever stretches the TSC count and the smallest result is the best.
+#define CALIBRATE_US     10000
+#define CALIBRATE_ROUNDS 3
+
+// HPET registers
+#define HPET_CAPABILITIES   0x000   // Counter period in fs in the high dword
+#define HPET_CONFIG         0x010
+#define HPET_COUNTER        0x0F0   // Low dword of the main counter
+#define HPET_CONFIG_ENABLE  0x01
+#define HPET_MAX_PERIOD_FS  100000000
+
+#define DEFAULT_MULT ((uint32_t)((NSEC_PER_SEC << 32) / (CLOCK_DEFAULT_MHZ * 1000000ULL)))
+
+struct clocksource clocksource = { 0, 0, DEFAULT_MULT, 32, CLOCK_DEFAULT_MHZ * 1000, CLOCK_SOURCE_NONE };
+
+volatile uint64_t clock_ticks;
+static void (*event_handler)(void);
+static uint64_t (*next_event_source)(void);
+
+// Periodic tick state; tick_period_ns is 0 while it is not running
+static uint32_t tick_hz;
+static uint32_t tick_period_ns;
+static uint64_t tick_residual_ns;   // Idle time not yet counted as ticks
+static bool tick_stopped;           // Idle replaced it with a one-shot
+static volatile bool oneshot_fired;
+static uint64_t idle_start_ns;
+
+static volatile uint32_t* hpet;
+static uint32_t hpet_period_fs;
+
+static bool hpet_init(void) {
+    uint32_t phys = acpi_hpet_address();
+    if (!phys) return false;
+
+    hpet = paging_map_mmio(phys, PAGE_SIZE);
+    if (!hpet) return false;
+
+    hpet_period_fs = hpet[HPET_CAPABILITIES / 4 + 1];
+    if (!hpet_period_fs || hpet_period_fs > HPET_MAX_PERIOD_FS) {
+        hpet = NULL;
+        return false;
+    }
+    hpet[HPET_CONFIG / 4] |= HPET_CONFIG_ENABLE;
+    return true;
+}
+
+// TSC ticks per elapsed_ns nanoseconds, in kHz
+static uint32_t tsc_khz_from(uint64_t tsc, uint32_t elapsed_ns) {
+    tsc *= NSEC_PER_MSEC;
+    div64_u32(&tsc, elapsed_ns);
+    return (uint32_t)tsc;
+}
+
+static uint32_t calibrate_hpet(void) {
+    uint64_t target = CALIBRATE_US * 1000000000ULL;    // In fs
+    div64_u32(&target, hpet_period_fs);
+
+    uint32_t start = hpet[HPET_COUNTER / 4];
+    uint64_t tsc_start = rdtsc();
+    uint32_t elapsed;
+    do {
+        __asm__ volatile("pause");
+        elapsed = hpet[HPET_COUNTER / 4] - start;
+    } while (elapsed < target);
+    uint64_t tsc = rdtsc() - tsc_start;
+
+    uint64_t elapsed_ns = (uint64_t)elapsed * hpet_period_fs;
+    div64_u32(&elapsed_ns, 1000000);
+    return tsc_khz_from(tsc, (uint32_t)elapsed_ns);
+}
+
+static uint32_t calibrate_pit(void) {
+    uint32_t count = pit_oneshot_start(CALIBRATE_US);
+    uint64_t tsc_start = rdtsc();
+    while (!pit_oneshot_done()) {
+        __asm__ volatile("pause");
+    }
+    uint64_t tsc = rdtsc() - tsc_start;
+
+    uint64_t elapsed_ns = (uint64_t)count * NSEC_PER_SEC;
+    div64_u32(&elapsed_ns, PIT_FREQUENCY);
+    return tsc_khz_from(tsc, (uint32_t)elapsed_ns);
+}
+
+// Switch to a new rate without ktime stepping backwards
+static void clocksource_set(uint32_t khz) {
+    uint32_t shift = 32;
+    uint64_t mult;
+
+    // Largest shift that keeps mult, the ns per tick in fixed point, in
+    // 32 bits; only a TSC slower than 1 GHz needs less than 32
+    for (;;) {
+        mult = NSEC_PER_MSEC << shift;
+        div64_u32(&mult, khz);
+        if (!(mult >> 32) || shift == 0) break;
+        shift--;
+    }
+
+    uint64_t now = ktime_get_ns();
+    clocksource.base_tsc = rdtsc();
+    clocksource.base_ns = now;
+    clocksource.mult = (uint32_t)mult;
+    clocksource.shift = shift;
+    clocksource.tsc_khz = khz;
+}
+
+static void clock_irq(registers_t* regs) {
+    (void)regs;
+    if (tick_stopped) {
+        oneshot_fired = true;
+        return;
+    }
+    clock_ticks++;
+    if (event_handler) event_handler();
+    sched_tick();
+}
+
+bool clock_init(void) {
+    if (!CPU_HAS(features_edx, CPUID_EDX_TSC)) return false;
+
+    // acpi_init() has usually run for the APIC already and returns its
+    // cached result
+    acpi_init();
+    enum clock_source source = hpet_init() ? CLOCK_SOURCE_HPET : CLOCK_SOURCE_PIT;
+
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+
+    uint32_t khz = 0xFFFFFFFF;
+    for (int i = 0; i < CALIBRATE_ROUNDS; i++) {
+        uint32_t round = source == CLOCK_SOURCE_HPET ? calibrate_hpet() : calibrate_pit();
+        if (round < khz) khz = round;
+    }
+    if (khz) {
+        clocksource_set(khz);
+        clocksource.calibrated_by = source;
+    }
+
+    register_interrupt_handler(IRQ_VECTOR(PIT_IRQ), clock_irq);
+    clock_tick_periodic(CLOCK_TICK_HZ);
+    irq_unmask(PIT_IRQ);
+
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+    return khz != 0;
+}
+
+void udelay(uint32_t us) {
+    uint64_t deadline = ktime_get_ns() + us * NSEC_PER_USEC;
+    while (!ktime_after(deadline)) {
+        __asm__ volatile("pause");
+    }
+}
+
+void mdelay(uint32_t ms) {
+    uint64_t deadline = ktime_get_ns() + ms * NSEC_PER_MSEC;
+    while (!ktime_after(deadline)) {
+        __asm__ volatile("pause");
+    }
+}
+
+void clock_set_event_handler(void (*handler)(void)) {
+    event_handler = handler;
+}
+
+void clock_tick_periodic(uint32_t hz) {
+    uint64_t period = (uint64_t)pit_tick_periodic(hz) * NSEC_PER_SEC;
+    div64_u32(&period, PIT_FREQUENCY);
+    tick_hz = hz;
+    tick_period_ns = (uint32_t)period;
+}
+
+static void pit_oneshot_ns(uint64_t ns) {
+    div64_u32(&ns, NSEC_PER_USEC);
+    pit_tick_oneshot(ns > PIT_MAX_US ? PIT_MAX_US : (uint32_t)ns);
+}
+
+void clock_tick_oneshot(uint64_t ns) {
+    tick_period_ns = 0;
+    pit_oneshot_ns(ns);
+}
+
+void clock_tick_stop(void) {
+    tick_period_ns = 0;
+    pit_tick_stop();
+}
+
+uint32_t clock_tick_ns(void) {
+    return tick_period_ns ? tick_period_ns : (uint32_t)(NSEC_PER_SEC / CLOCK_TICK_HZ);
+}
+
+void clock_set_next_event_source(uint64_t (*next_event)(void)) {
+    next_event_source = next_event;
+}
+
+uint64_t clock_next_event(void) {
+    return next_event_source ? next_event_source() : CLOCK_NO_EVENT;
+}
+
+bool clock_idle_enter(uint64_t now) {
+    if (!tick_period_ns) return false;
+
+    uint64_t next = clock_next_event();
+    tick_stopped = true;
+    oneshot_fired = false;
+    idle_start_ns = now;
+
+    // Past the PIT's range the one-shot fires early and idle goes back
+    // to sleep; an event already due fires almost at once
+    if (next == CLOCK_NO_EVENT) {
+        pit_tick_stop();
+    } else {
+        pit_oneshot_ns(next > now ? next - now : 0);
+    }
+    return true;
+}
+
+bool clock_idle_exit(uint64_t now) {
+    if (!tick_stopped) return false;
+
+    tick_stopped = false;
+    clock_tick_periodic(tick_hz);
+
+    // Count the ticks that would have happened, keeping the remainder
+    // for next time so short idle periods still add up
+    uint64_t ticks = tick_residual_ns + (now - idle_start_ns);
+    tick_residual_ns = div64_u32(&ticks, tick_period_ns);
+    if (ticks) {
+        clock_ticks += ticks;
+        if (event_handler) event_handler();
+    }
+    return oneshot_fired;
+}
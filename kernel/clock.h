@@ -0,0 +1,82 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <div64.h>
+#include "cpu.h"
+
+// Timekeeping. The TSC is the clocksource, calibrated at boot against the
+// HPET when ACPI lists one and the PIT otherwise; ktime_get_ns() turns it
+// into nanoseconds since reset with a multiply and a shift. The
+// TSC is assumed to run at a constant rate. Until calibration it is taken
+// to be CLOCK_DEFAULT_MHZ, so early timeouts err on the long side.
+//
+// Timer events come from PIT channel 0 on IRQ0, periodic or one-shot.
+// While the CPU idles the periodic tick is stopped and a one-shot is set
+// for the next event instead; clock_ticks catches up on the way out.
+
+#define CLOCK_DEFAULT_MHZ 4000
+#define CLOCK_TICK_HZ     100
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC  1000000000ULL
+
+#define CLOCK_NO_EVENT 0xFFFFFFFFFFFFFFFFULL
+
+enum clock_source {
+    CLOCK_SOURCE_NONE,
+    CLOCK_SOURCE_PIT,
+    CLOCK_SOURCE_HPET,
+};
+
+struct clocksource {
+    uint64_t base_tsc;          // ns = base_ns + ((tsc - base_tsc) * mult >> shift)
+    uint64_t base_ns;
+    uint32_t mult;
+    uint32_t shift;
+    uint32_t tsc_khz;
+    enum clock_source calibrated_by;
+};
+
+extern struct clocksource clocksource;
+
+// Calibrate the TSC and take over IRQ0; call once paging and interrupt
+// routing are set up
+bool clock_init(void);
+
+static inline uint64_t ktime_get_ns(void) {
+    return clocksource.base_ns +
+           mul_u64_u32_shr(rdtsc() - clocksource.base_tsc, clocksource.mult, clocksource.shift);
+}
+
+static inline bool ktime_after(uint64_t deadline) {
+    return ktime_get_ns() >= deadline;
+}
+
+// Busy waits, for device timeouts and short settling delays
+void udelay(uint32_t us);
+void mdelay(uint32_t ms);
+
+// IRQ0 events. The handler runs in interrupt context on each tick.
+extern volatile uint64_t clock_ticks;
+void clock_set_event_handler(void (*handler)(void));
+void clock_tick_periodic(uint32_t hz);
+void clock_tick_oneshot(uint64_t ns);       // Clamped to the PIT's range
+void clock_tick_stop(void);
+
+uint32_t clock_tick_ns(void);                // Length of one tick
+
+// Timer code reports its earliest expiry, in ktime ns, or CLOCK_NO_EVENT
+void clock_set_next_event_source(uint64_t (*next_event)(void));
+uint64_t clock_next_event(void);
+
+// Called by the idle loop with interrupts off. enter() swaps the periodic
+// tick for a one-shot at the next event, or for nothing when there is
+// none, and returns false if no tick was running. exit() restarts it and
+// returns true when it was the one-shot that ended the idle period.
+bool clock_idle_enter(uint64_t now);
+bool clock_idle_exit(uint64_t now);
+
+#endif // CLOCK_H
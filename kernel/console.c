@@ -0,0 +1,472 @@
+// console.c - VGA text console and formatted kernel output
+#include "console.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <div64.h>
+#include <string.h>
+#include "port_io.h"
+#include "serial.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "sched.h"
+#include "../drivers/keyboard.h"
+
+// Output lands in a shadow copy of the screen in RAM. VGA memory is
+// uncached and slow to touch, reads above all, so the shadow takes every
+// character and the screen is brought up to date a row span at a time:
+// each row remembers the columns written since the last flush, and only
+// those are copied. Flushes happen at a newline, on console_flush(), and
+// from a timer for a line left unfinished. Unbuffered mode writes each
+// cell straight to VGA memory; bench_console compares the two.
+//
+// There are CONSOLE_VTS virtual terminals, each with its own shadow and
+// cursor. The colour text window holds 32 KB, several screens' worth, so
+// every console owns a slice of it and the CRTC start address picks the
+// one the display scans out: switching consoles writes two registers and
+// copies nothing. A slice also has more rows than the screen, and a
+// console scrolls by moving its view one row down the slice, which again
+// is only the start address, leaving the new bottom row to fill. Only
+// when the view reaches the end of the slice is the screen rewritten at
+// the slice's first row.
+//
+// console_lock serialises writers across CPUs a character at a time, so
+// interrupts are never held off for a whole kprintf.
+//
+// The console input thread is the keyboard's reader. Alt+F1 onwards
+// switches consoles; other typed characters are echoed to VT_SHELL.
+
+#define CONSOLE_CELLS  (VGA_WIDTH * VGA_HEIGHT)
+#define BLANK_CELL     (VGA_COLOR_WHITE_ON_BLACK << 8 | ' ')
+#define VT_SLICE_CELLS (VGA_MEMORY_SIZE / 2 / CONSOLE_VTS)
+#define VT_SLICE_ROWS  (VT_SLICE_CELLS / VGA_WIDTH)
+
+// CRTC registers, through the colour index/data port pair. The start
+// address and cursor location count cells, high byte first.
+#define CRTC_INDEX     0x3D4
+#define CRTC_DATA      0x3D5
+#define CRTC_START     0x0C
+#define CRTC_CURSOR    0x0E
+
+// Ahead of ordinary threads, so typing stays responsive
+#define CONSOLE_INPUT_PRIO (SCHED_PRIO_DEFAULT - 1)
+
+struct dirty_span {
+    uint8_t first;              // Columns written since the last flush,
+    uint8_t last;               // valid while the row's dirty_rows bit is set
+};
+
+struct vt {
+    uint16_t shadow[CONSOLE_CELLS];
+    struct dirty_span dirty[VGA_HEIGHT];
+    uint32_t dirty_rows;        // Bit n set when row n has a span to copy
+    size_t row;                 // Cursor
+    size_t col;
+    size_t top;                 // Slice row on the screen's first line
+};
+
+static uint16_t* const VGA_MEMORY = (uint16_t*)VGA_BUFFER;
+static struct vt vts[CONSOLE_VTS];
+static struct vt* active = &vts[VT_LOG];
+static uint16_t crtc_start;     // Last values written, to skip repeats
+static uint16_t crtc_cursor = 0xFFFF;
+static bool buffered = true;
+static bool mirror = true;
+
+static struct spinlock console_lock = SPINLOCK_INIT("console");
+static struct timer flush_timer;
+static bool flush_timer_ready;
+
+static void crtc_write(uint8_t reg, uint16_t value) {
+    outb(CRTC_INDEX, reg);
+    outb(CRTC_DATA, value >> 8);
+    outb(CRTC_INDEX, reg + 1);
+    outb(CRTC_DATA, value & 0xFF);
+}
+
+// Cell offset in VGA memory of the console's first screen cell
+static uint16_t vt_origin(const struct vt* vt) {
+    return (uint16_t)((vt - vts) * VT_SLICE_CELLS + vt->top * VGA_WIDTH);
+}
+
+static uint16_t* vt_screen(const struct vt* vt) {
+    return VGA_MEMORY + vt_origin(vt);
+}
+
+// Point the display at the active console's view and cursor
+static void show_active(void) {
+    uint16_t start = vt_origin(active);
+    uint16_t cursor = start + active->row * VGA_WIDTH + active->col;
+    if (start != crtc_start) {
+        crtc_write(CRTC_START, start);
+        crtc_start = start;
+    }
+    if (cursor != crtc_cursor) {
+        crtc_write(CRTC_CURSOR, cursor);
+        crtc_cursor = cursor;
+    }
+}
+
+static void mark_dirty(struct vt* vt, size_t row, size_t first, size_t last) {
+    struct dirty_span* span = &vt->dirty[row];
+    if (!(vt->dirty_rows & (1u << row))) {
+        span->first = first;
+        span->last = last;
+        vt->dirty_rows |= 1u << row;
+        return;
+    }
+    if (first < span->first) span->first = first;
+    if (last > span->last) span->last = last;
+}
+
+static void mark_all_dirty(struct vt* vt) {
+    for (size_t row = 0; row < VGA_HEIGHT; row++) {
+        vt->dirty[row].first = 0;
+        vt->dirty[row].last = VGA_WIDTH - 1;
+    }
+    vt->dirty_rows = (1u << VGA_HEIGHT) - 1;
+}
+
+// console_lock held
+static void flush_locked(struct vt* vt) {
+    uint16_t* screen = vt_screen(vt);
+    while (vt->dirty_rows) {
+        uint32_t row;
+        __asm__("bsf %1, %0" : "=r"(row) : "rm"(vt->dirty_rows));
+        vt->dirty_rows &= vt->dirty_rows - 1;
+
+        size_t index = row * VGA_WIDTH + vt->dirty[row].first;
+        memcpy(&screen[index], &vt->shadow[index], (vt->dirty[row].last - vt->dirty[row].first + 1) * 2);
+    }
+    if (vt == active) show_active();
+}
+
+static void flush_all_locked(void) {
+    for (size_t i = 0; i < CONSOLE_VTS; i++) flush_locked(&vts[i]);
+}
+
+static void scroll(struct vt* vt) {
+    if (buffered) {
+        // The moved view must land on rows that already match the shadow
+        flush_locked(vt);
+        memmove(vt->shadow, vt->shadow + VGA_WIDTH, (CONSOLE_CELLS - VGA_WIDTH) * sizeof(uint16_t));
+        memset16(vt->shadow + CONSOLE_CELLS - VGA_WIDTH, BLANK_CELL, VGA_WIDTH);
+    }
+
+    if (vt->top + VGA_HEIGHT < VT_SLICE_ROWS) {
+        vt->top++;
+        if (buffered) mark_dirty(vt, VGA_HEIGHT - 1, 0, VGA_WIDTH - 1);
+        else memset16(vt_screen(vt) + CONSOLE_CELLS - VGA_WIDTH, BLANK_CELL, VGA_WIDTH);
+    } else if (buffered) {
+        vt->top = 0;
+        mark_all_dirty(vt);
+    } else {
+        // VGA memory is the only copy: move the screen up to the slice start
+        uint16_t* old = vt_screen(vt);
+        vt->top = 0;
+        memmove(vt_screen(vt), old + VGA_WIDTH, (CONSOLE_CELLS - VGA_WIDTH) * sizeof(uint16_t));
+        memset16(vt_screen(vt) + CONSOLE_CELLS - VGA_WIDTH, BLANK_CELL, VGA_WIDTH);
+    }
+
+    // Fill the new row before the display moves onto it
+    if (buffered) flush_locked(vt);
+    else if (vt == active) show_active();
+}
+
+static void newline(struct vt* vt) {
+    vt->col = 0;
+    if (++vt->row >= VGA_HEIGHT) {
+        vt->row = VGA_HEIGHT - 1;
+        scroll(vt);
+    }
+}
+
+static void flush_timer_fn(void* arg) {
+    (void)arg;
+    console_flush();
+}
+
+static void set_cell(struct vt* vt, size_t row, size_t col, uint16_t cell) {
+    const size_t index = row * VGA_WIDTH + col;
+    if (buffered) {
+        vt->shadow[index] = cell;
+        mark_dirty(vt, row, col, col);
+    } else {
+        vt_screen(vt)[index] = cell;
+    }
+}
+
+// console_lock held
+static void put_char(struct vt* vt, char c) {
+    if (c == '\n') {
+        newline(vt);
+        if (buffered) flush_locked(vt);
+        else if (vt == active) show_active();
+        return;
+    }
+
+    if (c == '\b') {
+        // Rub out the character before the cursor, on this line only
+        if (!vt->col) return;
+        set_cell(vt, vt->row, --vt->col, BLANK_CELL);
+    } else {
+        set_cell(vt, vt->row, vt->col, VGA_COLOR_WHITE_ON_BLACK << 8 | (uint8_t)c);
+        if (++vt->col >= VGA_WIDTH) newline(vt);
+    }
+
+    // A partial line still shows up, a moment later
+    if (buffered && vt->dirty_rows && flush_timer_ready && !timer_pending(&flush_timer)) {
+        timer_start(&flush_timer, timer_ms_to_ticks(CONSOLE_FLUSH_MS));
+    }
+}
+
+// console_lock held
+static void clear_locked(struct vt* vt) {
+    memset16(vt->shadow, BLANK_CELL, CONSOLE_CELLS);
+    vt->top = 0;
+    vt->row = 0;
+    vt->col = 0;
+    if (buffered) {
+        mark_all_dirty(vt);
+        flush_locked(vt);
+    } else {
+        memset16(vt_screen(vt), BLANK_CELL, CONSOLE_CELLS);
+        if (vt == active) show_active();
+    }
+}
+
+// Function implementations
+void console_init(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    for (size_t i = 0; i < CONSOLE_VTS; i++) clear_locked(&vts[i]);
+    active = &vts[VT_LOG];
+    show_active();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void clear_screen(void) {
+    console_clear(VT_LOG);
+}
+
+void console_clear(uint32_t vt) {
+    if (vt >= CONSOLE_VTS) return;
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    clear_locked(&vts[vt]);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+bool console_switch(uint32_t vt) {
+    if (vt >= CONSOLE_VTS) return false;
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    // Catch up a partial line first; the rest is already in its slice
+    active = &vts[vt];
+    flush_locked(active);
+    show_active();
+    spin_unlock_irqrestore(&console_lock, flags);
+    return true;
+}
+
+uint32_t console_active(void) {
+    return active - vts;
+}
+
+void vt_write_char(uint32_t vt, char c) {
+    if (vt >= CONSOLE_VTS) return;
+
+    // Outside the lock: the UART can take a while per character
+    if (mirror && vt == VT_LOG) serial_write_char(c);
+
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    put_char(&vts[vt], c);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void vt_write_string(uint32_t vt, const char* str) {
+    for (size_t i = 0; str[i] != '\0'; i++) {
+        vt_write_char(vt, str[i]);
+    }
+}
+
+void write_char(char c) {
+    vt_write_char(VT_LOG, c);
+}
+
+void console_flush(void) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    flush_all_locked();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void console_start_flush_timer(void) {
+    timer_setup(&flush_timer, flush_timer_fn, 0);
+    flush_timer_ready = true;
+}
+
+bool console_set_buffered(bool on) {
+    uint32_t flags = spin_lock_irqsave(&console_lock);
+    bool was = buffered;
+    for (size_t i = 0; i < CONSOLE_VTS; i++) {
+        struct vt* vt = &vts[i];
+        if (was && !on) {
+            // VGA memory becomes the only copy
+            flush_locked(vt);
+        } else if (!was && on) {
+            memcpy(vt->shadow, vt_screen(vt), sizeof(vt->shadow));
+            vt->dirty_rows = 0;
+        }
+    }
+    buffered = on;
+    spin_unlock_irqrestore(&console_lock, flags);
+    return was;
+}
+
+static void console_input(void* arg) {
+    (void)arg;
+    struct key_event ev;
+
+    vt_write_string(VT_SHELL, "TKOS shell console. Alt+F1 shows the log.\n");
+    for (;;) {
+        keyboard_wait_event(&ev);
+        if (!ev.pressed) continue;
+
+        if ((ev.modifiers & KEYMOD_ALT) && ev.key >= KEY_F1 && ev.key < KEY_F1 + CONSOLE_VTS) {
+            console_switch(ev.key - KEY_F1);
+        } else if (ev.ascii >= ' ' || ev.ascii == '\n' || ev.ascii == '\b') {
+            // No glyphs for tab, escape or the Ctrl codes
+            vt_write_char(VT_SHELL, ev.ascii);
+        }
+    }
+}
+
+bool console_start_input(void) {
+    return thread_create("console", console_input, 0, CONSOLE_INPUT_PRIO) != 0;
+}
+
+bool console_set_mirror(bool on) {
+    bool was = mirror;
+    mirror = on;
+    return was;
+}
+
+void write_string(const char* str) {
+    for (size_t i = 0; str[i] != '\0'; i++) {
+        write_char(str[i]);
+    }
+}
+
+static void write_number(uint64_t value, uint32_t base, bool negative, int width, char pad) {
+    char buf[24];
+    int len = 0;
+
+    do {
+        uint32_t digit = div64_u32(&value, base);
+        buf[len++] = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    } while (value);
+
+    if (negative) {
+        if (pad == '0') write_char('-');
+        width--;
+    }
+    for (int i = len; i < width; i++) {
+        write_char(pad);
+    }
+    if (negative && pad != '0') write_char('-');
+    while (len) {
+        write_char(buf[--len]);
+    }
+}
+
+static void vkprintf(const char* fmt, va_list args) {
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            write_char(*fmt);
+            continue;
+        }
+
+        fmt++;
+        char pad = ' ';
+        int width = 0;
+        int longs = 0;
+
+        if (*fmt == '0') {
+            pad = '0';
+            fmt++;
+        }
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt++ - '0');
+        }
+        while (*fmt == 'l') {
+            longs++;
+            fmt++;
+        }
+
+        uint64_t value;
+        switch (*fmt) {
+        case 'c':
+            write_char((char)va_arg(args, int));
+            break;
+        case 's': {
+            const char* str = va_arg(args, const char*);
+            int len = 0;
+            if (!str) str = "(null)";
+            while (str[len]) len++;
+            for (int i = len; i < width; i++) write_char(' ');
+            write_string(str);
+            break;
+        }
+        case 'd': {
+            int64_t sval = longs >= 2 ? va_arg(args, int64_t) : va_arg(args, int32_t);
+            bool negative = sval < 0;
+            write_number(negative ? -(uint64_t)sval : (uint64_t)sval, 10, negative, width, pad);
+            break;
+        }
+        case 'u':
+        case 'x':
+            value = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+            write_number(value, *fmt == 'u' ? 10 : 16, false, width, pad);
+            break;
+        case 'p':
+            write_string("0x");
+            write_number(va_arg(args, uint32_t), 16, false, 8, '0');
+            break;
+        case '%':
+            write_char('%');
+            break;
+        case '\0':
+            return;
+        default:
+            write_char('%');
+            write_char(*fmt);
+            break;
+        }
+    }
+}
+
+void kprintf(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vkprintf(fmt, args);
+    va_end(args);
+}
+
+void panic(const char* fmt, ...) {
+    __asm__ volatile("cli");
+
+    // This CPU may have died holding the console lock, and the timer
+    // wheel may be in no state to take the flush timer. The message goes
+    // to the log console, so put that one on screen.
+    spin_lock_init(&console_lock, "console");
+    flush_timer_ready = false;
+    console_switch(VT_LOG);
+
+    va_list args;
+    write_string("\nKERNEL PANIC: ");
+    va_start(args, fmt);
+    vkprintf(fmt, args);
+    va_end(args);
+    write_char('\n');
+    console_flush();
+
+    while (1) {
+        __asm__ volatile("hlt");
+    }
+}
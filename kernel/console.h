@@ -0,0 +1,83 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// VGA buffer constants
+#define VGA_BUFFER 0xB8000
+#define VGA_MEMORY_SIZE 0x8000      // The colour text window, bytes
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+
+// VGA colors
+#define VGA_BLACK        0x0
+#define VGA_BLUE         0x1
+#define VGA_GREEN        0x2
+#define VGA_CYAN         0x3
+#define VGA_RED          0x4
+#define VGA_MAGENTA      0x5
+#define VGA_BROWN        0x6
+#define VGA_LIGHT_GREY   0x7
+#define VGA_DARK_GREY    0x8
+#define VGA_LIGHT_BLUE   0x9
+#define VGA_LIGHT_GREEN  0xA
+#define VGA_LIGHT_CYAN   0xB
+#define VGA_LIGHT_RED    0xC
+#define VGA_LIGHT_MAGENTA 0xD
+#define VGA_LIGHT_BROWN  0xE
+#define VGA_WHITE        0xF
+
+#define VGA_COLOR_WHITE_ON_BLACK 0x0F
+#define VGA_COLOR_RED_ON_BLACK   0x04
+
+// VGA color attribute byte
+#define VGA_COLOR(fg, bg) ((bg << 4) | fg)
+
+// VGA text console, mirrored to COM1 once serial_init() succeeds. The
+// screen scrolls when output reaches the bottom. Writes go to a RAM
+// shadow of the screen and reach VGA memory at each newline, on
+// console_flush(), or CONSOLE_FLUSH_MS later from a timer.
+#define CONSOLE_FLUSH_MS 20
+
+// Virtual terminals sharing the display, each with its own contents and
+// cursor. write_char(), kprintf() and the serial mirror use the log
+// console; the others are written with vt_write_char(). Switching shows
+// another console at once, with no copying. Once the input thread runs,
+// Alt+F1 onwards switches, and typing is echoed to VT_SHELL.
+#define CONSOLE_VTS 4
+#define VT_LOG      0
+#define VT_SHELL    1
+
+void console_init(void);                // Clear every console, show VT_LOG
+bool console_switch(uint32_t vt);       // False if there is no such console
+uint32_t console_active(void);
+void console_clear(uint32_t vt);
+void vt_write_char(uint32_t vt, char c);
+void vt_write_string(uint32_t vt, const char* str);
+
+// Start the thread that reads the keyboard for the consoles. Needs
+// sched_init() and init_keyboard(); false if the thread cannot be made.
+bool console_start_input(void);
+
+void clear_screen(void);                // The log console
+void write_char(char c);
+void write_string(const char* str);
+void console_flush(void);
+
+// Arm the flush timer for unfinished lines from now on. Needs timer_init().
+void console_start_flush_timer(void);
+
+// Write through the shadow, or every cell straight to VGA memory; and
+// mirror to the serial port or not. Both return the previous setting.
+bool console_set_buffered(bool on);
+bool console_set_mirror(bool on);
+
+// Formatted output: %c %s %d %u %x %p, with optional 0/width and l/ll
+void kprintf(const char* fmt, ...);
+
+// Print a message and halt this CPU with interrupts disabled
+void panic(const char* fmt, ...) __attribute__((noreturn));
+
+#endif // CONSOLE_H
@@ -0,0 +1,32 @@
+#include "cpu.h"
+
+struct cpu_info cpu_info;
+
+void cpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    cpu_info.max_leaf = eax;
+    *(uint32_t*)&cpu_info.vendor[0] = ebx;
+    *(uint32_t*)&cpu_info.vendor[4] = edx;
+    *(uint32_t*)&cpu_info.vendor[8] = ecx;
+    cpu_info.vendor[12] = '\0';
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    cpu_info.signature = eax;
+    cpu_info.features_edx = edx;
+    cpu_info.features_ecx = ecx;
+
+    if (cpu_info.max_leaf >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        cpu_info.ext_features_ebx = ebx;
+    }
+
+    // SSE needs the OS to declare FXSAVE support and stop emulating the FPU
+    if (CPU_HAS(features_edx, CPUID_EDX_FXSR) && CPU_HAS(features_edx, CPUID_EDX_SSE)) {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        __asm__ volatile("fninit");
+        cpu_info.sse_enabled = true;
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// CPUID leaf 1 feature bits
+#define CPUID_EDX_PSE   (1 << 3)    // 4 MB pages
+#define CPUID_EDX_TSC   (1 << 4)
+#define CPUID_EDX_MSR   (1 << 5)
+#define CPUID_EDX_APIC  (1 << 9)    // On-chip local APIC
+#define CPUID_EDX_SEP   (1 << 11)   // SYSENTER/SYSEXIT
+#define CPUID_EDX_PGE   (1 << 13)   // Global pages
+#define CPUID_EDX_FXSR  (1 << 24)
+#define CPUID_EDX_SSE   (1 << 25)
+#define CPUID_EDX_SSE2  (1 << 26)
+
+#define CPUID_ECX_MONITOR (1 << 3)  // MONITOR/MWAIT
+
+// CPUID leaf 5 (MONITOR/MWAIT) ECX bits
+#define CPUID_5_ECX_EMX (1 << 0)    // Extensions enumerated
+#define CPUID_5_ECX_IBE (1 << 1)    // Interrupts break MWAIT even with IF=0
+
+// CPUID leaf 7 feature bits
+#define CPUID_7_EBX_ERMS (1 << 9)   // Enhanced REP MOVSB/STOSB
+
+// Control register bits
+#define CR0_PG          0x80000000
+#define CR0_WP          0x00010000
+#define CR0_TS          0x00000008   // Next FP instruction raises #NM
+#define CR0_EM          0x00000004
+#define CR0_MP          0x00000002
+#define CR4_PSE         0x00000010
+#define CR4_PGE         0x00000080
+#define CR4_OSFXSR      0x00000200
+#define CR4_OSXMMEXCPT  0x00000400
+
+// Model-specific registers
+#define MSR_APIC_BASE           0x1B
+#define MSR_APIC_BASE_ENABLE    (1 << 11)
+#define MSR_SYSENTER_CS         0x174
+#define MSR_SYSENTER_ESP        0x175
+#define MSR_SYSENTER_EIP        0x176
+
+// Boot CPU identification, filled in by cpu_init()
+struct cpu_info {
+    char vendor[13];
+    uint32_t max_leaf;
+    uint32_t signature;         // Leaf 1 EAX: stepping, model, family
+    uint32_t features_edx;      // Leaf 1
+    uint32_t features_ecx;
+    uint32_t ext_features_ebx;  // Leaf 7
+    bool sse_enabled;
+};
+
+extern struct cpu_info cpu_info;
+
+#define CPU_HAS(field, bit) ((cpu_info.field & (bit)) != 0)
+#define CPU_FAMILY(sig)     (((sig) >> 8) & 0xF)
+#define CPU_MODEL(sig)      (((sig) >> 4) & 0xF)
+#define CPU_STEPPING(sig)   ((sig) & 0xF)
+
+// Detect features and enable FXSR/SSE when present
+void cpu_init(void);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ volatile("cpuid"
+                     : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                     : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t val;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr0(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(val) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t val;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(val));
+    return val;
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t val;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr3(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(val) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t val;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(val));
+    return val;
+}
+
+static inline void write_cr4(uint32_t val) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(val) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t val) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline void invlpg(uint32_t addr) {
+    __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+#endif // CPU_H
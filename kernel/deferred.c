@@ -0,0 +1,93 @@
+#include "deferred.h"
+#include "percpu.h"
+#include "sched.h"
+
+// Each CPU has a singly linked FIFO guarded by disabling interrupts, so
+// work runs on the CPU whose interrupt queued it. The runner detaches
+// the whole list at once, so a batch costs one cli/sti pair, and anything
+// queued while it runs is picked up by the next pass. Claiming an item
+// is an atomic exchange on pending: two CPUs queueing the same item must
+// not both link it.
+
+struct deferred_queue {
+    struct deferred_work* head;
+    struct deferred_work* tail;
+    bool running;
+} __attribute__((aligned(64)));
+
+static struct deferred_queue queues[SMP_MAX_CPUS];
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint8_t claim(volatile uint8_t* pending) {
+    uint8_t old = 1;
+    __asm__ volatile("xchgb %0, %1" : "+q"(old), "+m"(*pending) : : "memory");
+    return old;
+}
+
+bool defer_work(struct deferred_work* work) {
+    uint32_t flags = irq_save();
+
+    work->queued++;
+    if (claim(&work->pending)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    struct deferred_queue* q = &queues[cpu_index()];
+    work->next = NULL;
+    if (q->tail) q->tail->next = work;
+    else q->head = work;
+    q->tail = work;
+
+    irq_restore(flags);
+    return true;
+}
+
+bool deferred_work_pending(void) {
+    return queues[cpu_index()].head != NULL;
+}
+
+void run_deferred_work(void) {
+    uint32_t flags = irq_save();
+    struct deferred_queue* q = &queues[cpu_index()];
+
+    // An IRQ taken while work runs lands here again; the outer pass
+    // will see whatever it queued
+    if (q->running || !q->head) {
+        irq_restore(flags);
+        return;
+    }
+    q->running = true;
+
+    // Stay on this CPU: q is only ever touched by its own CPU
+    preempt_disable();
+    while (q->head) {
+        struct deferred_work* batch = q->head;
+        q->head = q->tail = NULL;
+        __asm__ volatile("sti" : : : "memory");
+
+        while (batch) {
+            struct deferred_work* work = batch;
+            batch = work->next;
+
+            // Clear first so the function may queue itself again
+            work->pending = 0;
+            work->runs++;
+            work->fn(work->arg);
+        }
+        __asm__ volatile("cli" : : : "memory");
+    }
+
+    q->running = false;
+    irq_restore(flags);
+    preempt_enable();
+}
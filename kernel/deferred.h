@@ -0,0 +1,34 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Deferred interrupt work. A handler queues an item and returns; the
+// item's function runs later with interrupts enabled, on the way out of
+// the outermost IRQ or from the idle loop. An item that is already
+// queued is not queued again, so a burst of interrupts from one source
+// costs one run.
+
+struct deferred_work {
+    void (*fn)(void* arg);
+    void* arg;
+    struct deferred_work* next;
+    volatile uint8_t pending;
+    uint32_t queued;            // defer_work() calls
+    uint32_t runs;              // Times fn ran; queued - runs were coalesced
+};
+
+#define DEFERRED_WORK_INIT(f, a) { (f), (a), 0, 0, 0, 0 }
+
+// Safe from IRQ handlers and ordinary code. False if already pending.
+bool defer_work(struct deferred_work* work);
+
+// Run everything queued, in FIFO order, with interrupts enabled. Returns
+// with the interrupt flag as it was on entry. Nested calls are no-ops.
+void run_deferred_work(void);
+
+bool deferred_work_pending(void);
+
+#endif // DEFERRED_H
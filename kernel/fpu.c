@@ -0,0 +1,135 @@
+#include "fpu.h"
+#include "isr.h"
+#include "cpu.h"
+#include "sched.h"
+#include "percpu.h"
+
+#define FPU_NM_VECTOR   7
+#define MXCSR_DEFAULT   0x1F80  // All SSE exceptions masked
+
+struct fpu_stats fpu_stats;
+
+// Each CPU has its own registers, so each has its own owner. Everything
+// below runs with interrupts off or from #NM, on the CPU it indexes.
+static struct fpu_state* fpu_owner[SMP_MAX_CPUS];   // Whose registers are loaded
+static struct fpu_state* fpu_current[SMP_MAX_CPUS]; // State of the running task
+static volatile bool kernel_fpu_busy[SMP_MAX_CPUS];
+
+static inline void clts(void) {
+    __asm__ volatile("clts" : : : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(struct fpu_state* state) {
+    if (CPU_HAS(features_edx, CPUID_EDX_FXSR)) {
+        __asm__ volatile("fxsave %0" : "=m"(state->area));
+    } else {
+        __asm__ volatile("fnsave %0" : "=m"(state->area));
+    }
+    fpu_stats.saves++;
+}
+
+static void fpu_restore(struct fpu_state* state) {
+    if (!state->used) {
+        // First use: start from the reset state rather than a stale image
+        __asm__ volatile("fninit");
+        if (cpu_info.sse_enabled) {
+            uint32_t mxcsr = MXCSR_DEFAULT;
+            __asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+        }
+        state->used = true;
+        return;
+    }
+
+    if (CPU_HAS(features_edx, CPUID_EDX_FXSR)) {
+        __asm__ volatile("fxrstor %0" : : "m"(state->area));
+    } else {
+        __asm__ volatile("frstor %0" : : "m"(state->area));
+    }
+    fpu_stats.restores++;
+}
+
+// Load the running state; TS must already be clear
+static void fpu_take(void) {
+    uint32_t cpu = cpu_index();
+    if (fpu_owner[cpu] == fpu_current[cpu]) return;
+    if (fpu_owner[cpu]) fpu_save(fpu_owner[cpu]);
+    if (fpu_current[cpu]) fpu_restore(fpu_current[cpu]);
+    fpu_owner[cpu] = fpu_current[cpu];
+}
+
+static void fpu_nm_handler(registers_t* regs) {
+    (void)regs;
+    fpu_stats.traps++;
+    clts();
+    fpu_take();
+}
+
+bool fpu_init(void) {
+    register_interrupt_handler(FPU_NM_VECTOR, fpu_nm_handler);
+    return true;
+}
+
+void fpu_state_init(struct fpu_state* state, uint32_t flags) {
+    state->flags = flags;
+    state->used = false;
+}
+
+void fpu_state_release(struct fpu_state* state) {
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (fpu_owner[cpu] == state) fpu_owner[cpu] = 0;
+        if (fpu_current[cpu] == state) fpu_current[cpu] = 0;
+    }
+}
+
+bool fpu_state_live(const struct fpu_state* state, uint32_t cpu) {
+    return fpu_owner[cpu] == state;
+}
+
+void fpu_switch(struct fpu_state* next) {
+    uint32_t cpu = cpu_index();
+    fpu_current[cpu] = next;
+    if (next && fpu_owner[cpu] == next) {
+        clts();
+    } else if (next && (next->flags & FPU_EAGER)) {
+        clts();
+        fpu_take();
+    } else {
+        stts();
+    }
+}
+
+bool kernel_fpu_begin(void) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+
+    uint32_t cpu = cpu_index();
+    if (kernel_fpu_busy[cpu]) {
+        __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+        return false;
+    }
+    kernel_fpu_busy[cpu] = true;
+    preempt_disable();
+
+    // The registers become scratch; the owner's contents go to memory
+    // first, and whoever uses them next reloads through #NM
+    clts();
+    if (fpu_owner[cpu]) {
+        fpu_save(fpu_owner[cpu]);
+        fpu_owner[cpu] = 0;
+    }
+
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+    return true;
+}
+
+void kernel_fpu_end(void) {
+    // Preemption is still off, so this is the CPU the bracket began on
+    uint32_t cpu = cpu_index();
+    if (fpu_current[cpu]) stts();
+    kernel_fpu_busy[cpu] = false;
+    preempt_enable();
+}
@@ -0,0 +1,57 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Lazy x87/SSE context switching. Each CPU's registers belong to one
+// state at a time, that CPU's owner. Switching to any other state only sets CR0.TS; the
+// first FP or SSE instruction then raises #NM (vector 7), whose handler
+// saves the owner and loads the running state. A task that never touches
+// the FPU never pays for a save or restore.
+
+#define FPU_AREA_SIZE 512       // FXSAVE image; FNSAVE uses the first 108
+
+// fpu_state_init() flags
+#define FPU_EAGER     0x01      // Load on every switch instead of trapping
+
+struct fpu_state {
+    uint8_t area[FPU_AREA_SIZE] __attribute__((aligned(16)));
+    uint32_t flags;
+    bool used;                  // False until the first FP instruction
+};
+
+struct fpu_stats {
+    uint32_t traps;             // #NM taken
+    uint32_t saves;
+    uint32_t restores;
+};
+
+extern struct fpu_stats fpu_stats;
+
+// Registers the #NM handler; call after init_idt
+bool fpu_init(void);
+
+// States must be 16-byte aligned for FXSAVE
+void fpu_state_init(struct fpu_state* state, uint32_t flags);
+
+// Forget a state that is going away, e.g. when its task exits
+void fpu_state_release(struct fpu_state* state);
+
+// The state's registers are loaded on cpu and not saved yet, so its task
+// must not run anywhere else
+bool fpu_state_live(const struct fpu_state* state, uint32_t cpu);
+
+// Called by the context switch with the state of the task about to run,
+// NULL for one without FPU context
+void fpu_switch(struct fpu_state* next);
+
+// Bracket for kernel code using x87/SSE registers. Saves the owner's
+// registers if they are live. Not nestable: false inside another bracket,
+// e.g. in an interrupt that arrived during one, and the caller must then
+// do without. Preemption is held off until kernel_fpu_end(); the
+// section must not sleep.
+bool kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif // FPU_H
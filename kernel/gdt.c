@@ -0,0 +1,71 @@
+#include "gdt.h"
+#include "percpu.h"
+
+// The bootloader's GDT only has ring 0 code and data, sitting in the boot
+// sector. Each CPU gets its own table in its struct percpu, adding the
+// user segments, a TSS of its own and the GS segment over its per-CPU
+// data.
+
+#define GDT_ACCESS_KERNEL_CODE  0x9A    // Present, ring 0, code, readable
+#define GDT_ACCESS_KERNEL_DATA  0x92    // Present, ring 0, data, writable
+#define GDT_ACCESS_USER_CODE    0xFA
+#define GDT_ACCESS_USER_DATA    0xF2
+#define GDT_ACCESS_TSS          0x89    // Present, 32-bit TSS, available
+#define GDT_GRAN_FLAT           0xCF    // 4 KB granularity, 32-bit, limit 0xFFFFF
+#define GDT_GRAN_BYTE           0x40    // Byte granularity, 32-bit
+
+static void gdt_set_entry(struct gdt_entry* gdt, uint32_t index, uint32_t base, uint32_t limit,
+                          uint8_t access, uint8_t gran) {
+    gdt[index].limit_lo = limit & 0xFFFF;
+    gdt[index].base_lo = base & 0xFFFF;
+    gdt[index].base_mid = (base >> 16) & 0xFF;
+    gdt[index].access = access;
+    gdt[index].granularity = (gran & 0xF0) | ((limit >> 16) & 0x0F);
+    gdt[index].base_hi = (base >> 24) & 0xFF;
+}
+
+void gdt_init_cpu(struct percpu* cpu) {
+    struct gdt_entry* gdt = cpu->gdt;
+
+    cpu->self = cpu;
+    gdt_set_entry(gdt, 0, 0, 0, 0, 0);
+    gdt_set_entry(gdt, GDT_KERNEL_CS >> 3, 0, 0xFFFFF, GDT_ACCESS_KERNEL_CODE, GDT_GRAN_FLAT);
+    gdt_set_entry(gdt, GDT_KERNEL_DS >> 3, 0, 0xFFFFF, GDT_ACCESS_KERNEL_DATA, GDT_GRAN_FLAT);
+    gdt_set_entry(gdt, GDT_USER_CS >> 3, 0, 0xFFFFF, GDT_ACCESS_USER_CODE, GDT_GRAN_FLAT);
+    gdt_set_entry(gdt, GDT_USER_DS >> 3, 0, 0xFFFFF, GDT_ACCESS_USER_DATA, GDT_GRAN_FLAT);
+
+    cpu->tss.ss0 = GDT_KERNEL_DS;
+    cpu->tss.iomap_base = sizeof(struct tss);   // No I/O bitmap: ring 3 gets no ports
+    gdt_set_entry(gdt, GDT_TSS >> 3, (uint32_t)&cpu->tss, sizeof(struct tss) - 1, GDT_ACCESS_TSS, 0);
+    gdt_set_entry(gdt, GDT_PERCPU >> 3, (uint32_t)cpu, sizeof(struct percpu) - 1,
+                  GDT_ACCESS_KERNEL_DATA, GDT_GRAN_BYTE);
+
+    cpu->gdt_ptr.limit = sizeof(cpu->gdt) - 1;
+    cpu->gdt_ptr.base = (uint32_t)gdt;
+
+    // The selectors match the bootloader's, but the cached descriptors
+    // still point at its table until every segment is reloaded
+    __asm__ volatile("lgdt %0\n\t"
+                     "ljmp %1, $1f\n"
+                     "1:\n\t"
+                     "mov %2, %%ax\n\t"
+                     "mov %%ax, %%ds\n\t"
+                     "mov %%ax, %%es\n\t"
+                     "mov %%ax, %%fs\n\t"
+                     "mov %%ax, %%ss\n\t"
+                     "mov %3, %%ax\n\t"
+                     "mov %%ax, %%gs"
+                     : : "m"(cpu->gdt_ptr), "i"(GDT_KERNEL_CS), "i"(GDT_KERNEL_DS), "i"(GDT_PERCPU)
+                     : "eax", "memory");
+    __asm__ volatile("ltr %w0" : : "r"(GDT_TSS));
+}
+
+bool gdt_init(void) {
+    percpu[0].index = 0;
+    gdt_init_cpu(&percpu[0]);
+    return true;
+}
+
+void tss_set_kernel_stack(uint32_t esp0) {
+    this_cpu()->tss.esp0 = esp0;
+}
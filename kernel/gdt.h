@@ -0,0 +1,58 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Flat segments, a TSS and the per-CPU data segment, in a table of each
+// CPU's own. The order is fixed by SYSENTER/SYSEXIT, which derive the
+// kernel SS and the user CS/SS from GDT_KERNEL_CS.
+#define GDT_KERNEL_CS   0x08
+#define GDT_KERNEL_DS   0x10
+#define GDT_USER_CS     0x1B    // Entry 3, RPL 3
+#define GDT_USER_DS     0x23    // Entry 4, RPL 3
+#define GDT_TSS         0x28
+#define GDT_PERCPU      0x30    // This CPU's struct percpu, in GS
+#define GDT_ENTRIES     7
+
+struct gdt_entry {
+    uint16_t limit_lo;
+    uint16_t base_lo;
+    uint8_t base_mid;
+    uint8_t access;
+    uint8_t granularity;        // Limit bits 16-19 in the low nibble
+    uint8_t base_hi;
+} __attribute__((packed));
+
+struct gdt_ptr {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+// Only esp0/ss0 are used: the stack the CPU switches to on an interrupt
+// from ring 3
+struct tss {
+    uint32_t prev;
+    uint32_t esp0, ss0;
+    uint32_t esp1, ss1;
+    uint32_t esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs, ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+struct percpu;
+
+// Replace the bootloader's GDT with the boot CPU's, load the TSS and
+// point GS at percpu[0]. Runs before anything touches per-CPU data.
+bool gdt_init(void);
+
+// The same for an application processor, from ap_main()
+void gdt_init_cpu(struct percpu* cpu);
+
+// Ring 0 stack for interrupts from ring 3 on this CPU
+void tss_set_kernel_stack(uint32_t esp0);
+
+#endif // GDT_H
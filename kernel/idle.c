@@ -0,0 +1,129 @@
+#include "idle.h"
+#include "clock.h"
+#include "cpu.h"
+#include "deferred.h"
+#include "sched.h"
+#include "memory.h"
+#include "console.h"
+#include "percpu.h"
+#include "apic.h"
+#include "smp.h"
+#include <string.h>
+
+// Each CPU counts its own sleeps; idle_get_stats() adds them up
+static struct idle_stats stats[SMP_MAX_CPUS];
+static bool use_mwait;
+static bool mwait_irq_break;        // MWAIT wakes on interrupts with IF=0
+static volatile uint32_t idle_monitor __attribute__((aligned(64)));
+
+void idle_init(void) {
+    if (!CPU_HAS(features_ecx, CPUID_ECX_MONITOR) || cpu_info.max_leaf < 5) return;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(5, &eax, &ebx, &ecx, &edx);
+    use_mwait = true;
+    mwait_irq_break = (ecx & CPUID_5_ECX_EMX) && (ecx & CPUID_5_ECX_IBE);
+}
+
+// Entered and left with interrupts off; any interrupt that arrives while
+// asleep has been handled on return
+static void idle_sleep(void) {
+    if (!use_mwait) {
+        __asm__ volatile("sti; hlt; cli" : : : "memory");
+        return;
+    }
+
+    __asm__ volatile("monitor" : : "a"(&idle_monitor), "c"(0), "d"(0));
+    if (mwait_irq_break) {
+        // C1, and wake on an interrupt even though IF is clear; the
+        // handler runs once interrupts are back on
+        __asm__ volatile("mwait" : : "a"(0), "c"(1));
+        __asm__ volatile("sti; nop; cli" : : : "memory");
+    } else {
+        // STI holds off interrupts until after MWAIT has armed
+        __asm__ volatile("sti; mwait; cli" : : "a"(0), "c"(0) : "memory");
+    }
+}
+
+void idle_loop(void) {
+    for (;;) {
+        run_deferred_work();
+        kmem_idle_trim();
+
+        __asm__ volatile("cli");
+        if (deferred_work_pending()) {
+            __asm__ volatile("sti");
+            continue;
+        }
+        if (sched_runnable() || sched_steal()) {
+            __asm__ volatile("sti");
+            thread_yield();
+            continue;
+        }
+
+        struct idle_stats* st = &stats[cpu_index()];
+        uint32_t monitor = idle_monitor;
+        uint64_t start = ktime_get_ns();
+        uint64_t end;
+        bool timer;
+
+        if (cpu_index() == 0) {
+            // The boot CPU owns the clock and the timer wheel
+            if (clock_idle_enter(start)) st->tickless++;
+            idle_sleep();
+            end = ktime_get_ns();
+            timer = clock_idle_exit(end);
+        } else {
+            // Other CPUs own no timers, so their APIC tick only slices
+            // threads; with none queued it stops, and a resched IPI
+            // brings work
+            apic_timer_stop();
+            st->tickless++;
+            idle_sleep();
+            apic_timer_periodic(CLOCK_TICK_HZ);
+            end = ktime_get_ns();
+            timer = false;
+        }
+
+        st->sleeps++;
+        st->idle_ns += end - start;
+        if (timer) st->wake_timer++;
+        else if (idle_monitor != monitor) st->wake_monitor++;
+        else st->wake_irq++;
+
+        __asm__ volatile("sti");
+    }
+}
+
+void idle_kick(void) {
+    idle_monitor++;
+}
+
+void idle_get_stats(struct idle_stats* out) {
+    // Other CPUs keep counting meanwhile; only this one's are held still
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    memset(out, 0, sizeof(*out));
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        const struct idle_stats* st = &stats[cpu];
+        out->idle_ns += st->idle_ns;
+        out->sleeps += st->sleeps;
+        out->wake_timer += st->wake_timer;
+        out->wake_irq += st->wake_irq;
+        out->wake_monitor += st->wake_monitor;
+        out->tickless += st->tickless;
+    }
+    out->mwait = use_mwait;
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+void idle_dump_stats(void) {
+    struct idle_stats s;
+    idle_get_stats(&s);
+
+    uint64_t ms = s.idle_ns;
+    div64_u32(&ms, NSEC_PER_MSEC);
+    kprintf("idle: %u ms asleep over %u sleeps on %u CPUs (%u tickless, %s); woken by timer %u, irq %u, monitor %u\n",
+            (uint32_t)ms, s.sleeps, smp_cpu_count, s.tickless, s.mwait ? "mwait" : "hlt",
+            s.wake_timer, s.wake_irq, s.wake_monitor);
+}
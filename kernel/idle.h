@@ -0,0 +1,34 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Idle loop, the body of every CPU's idle thread: runs leftover deferred
+// work and heap trimming, hands the CPU to any runnable thread, stealing
+// one from a busier CPU if its own queue is empty, then sleeps. No CPU
+// keeps a periodic tick while asleep: the boot CPU sleeps until the next
+// timer event or device interrupt, the others, which own no timers,
+// until an IPI. Sleeps with MWAIT where the CPU has it, HLT otherwise.
+// The statistics are summed over every CPU; idle_ns is CPU time.
+
+struct idle_stats {
+    uint64_t idle_ns;           // Time spent asleep
+    uint32_t sleeps;
+    uint32_t wake_timer;        // The one-shot for the next event fired
+    uint32_t wake_irq;          // Some other interrupt
+    uint32_t wake_monitor;      // Write to the MWAIT monitor line
+    uint32_t tickless;          // Sleeps with the periodic tick stopped
+    bool mwait;
+};
+
+void idle_init(void);
+void idle_loop(void) __attribute__((noreturn));
+
+void idle_get_stats(struct idle_stats* out);
+void idle_dump_stats(void);
+
+// Wake an MWAIT sleeper without an interrupt
+void idle_kick(void);
+
+#endif // IDLE_H
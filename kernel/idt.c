@@ -1,5 +1,8 @@
 #include "idt.h"
 #include "isr.h"
+#include "apic.h"
+#include "syscall.h"
+#include "smp.h"
 
 struct idt_entry idt[256];
 struct idt_ptr idt_ptr;
@@ -46,8 +49,46 @@ bool init_idt(void) {
     idt_set_gate(18, (uint32_t)isr18, 0x08, IDT_INTERRUPT_GATE); // Machine check
     idt_set_gate(19, (uint32_t)isr19, 0x08, IDT_INTERRUPT_GATE); // SIMD error
 
+    // Hardware IRQs, remapped by pic_init
+    idt_set_gate(IRQ_VECTOR(0), (uint32_t)irq0, 0x08, IDT_INTERRUPT_GATE);   // PIT
+    idt_set_gate(IRQ_VECTOR(1), (uint32_t)irq1, 0x08, IDT_INTERRUPT_GATE);   // Keyboard
+    idt_set_gate(IRQ_VECTOR(2), (uint32_t)irq2, 0x08, IDT_INTERRUPT_GATE);   // Cascade
+    idt_set_gate(IRQ_VECTOR(3), (uint32_t)irq3, 0x08, IDT_INTERRUPT_GATE);   // COM2
+    idt_set_gate(IRQ_VECTOR(4), (uint32_t)irq4, 0x08, IDT_INTERRUPT_GATE);   // COM1
+    idt_set_gate(IRQ_VECTOR(5), (uint32_t)irq5, 0x08, IDT_INTERRUPT_GATE);   // LPT2
+    idt_set_gate(IRQ_VECTOR(6), (uint32_t)irq6, 0x08, IDT_INTERRUPT_GATE);   // Floppy
+    idt_set_gate(IRQ_VECTOR(7), (uint32_t)irq7, 0x08, IDT_INTERRUPT_GATE);   // LPT1 / spurious
+    idt_set_gate(IRQ_VECTOR(8), (uint32_t)irq8, 0x08, IDT_INTERRUPT_GATE);   // RTC
+    idt_set_gate(IRQ_VECTOR(9), (uint32_t)irq9, 0x08, IDT_INTERRUPT_GATE);
+    idt_set_gate(IRQ_VECTOR(10), (uint32_t)irq10, 0x08, IDT_INTERRUPT_GATE);
+    idt_set_gate(IRQ_VECTOR(11), (uint32_t)irq11, 0x08, IDT_INTERRUPT_GATE);
+    idt_set_gate(IRQ_VECTOR(12), (uint32_t)irq12, 0x08, IDT_INTERRUPT_GATE); // PS/2 mouse
+    idt_set_gate(IRQ_VECTOR(13), (uint32_t)irq13, 0x08, IDT_INTERRUPT_GATE); // FPU
+    idt_set_gate(IRQ_VECTOR(14), (uint32_t)irq14, 0x08, IDT_INTERRUPT_GATE); // Primary ATA
+    idt_set_gate(IRQ_VECTOR(15), (uint32_t)irq15, 0x08, IDT_INTERRUPT_GATE); // Secondary ATA / spurious
+
+    // Local APIC, used once irq_use_apic() switches over
+    idt_set_gate(APIC_TIMER_VECTOR, (uint32_t)apic_timer_irq, 0x08, IDT_INTERRUPT_GATE);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint32_t)apic_spurious_irq, 0x08, IDT_INTERRUPT_GATE);
+
+    // Inter-processor interrupts
+    idt_set_gate(SMP_RESCHED_VECTOR, (uint32_t)smp_resched_irq, 0x08, IDT_INTERRUPT_GATE);
+    idt_set_gate(SMP_TLB_VECTOR, (uint32_t)smp_tlb_irq, 0x08, IDT_INTERRUPT_GATE);
+
+    // System calls, the only gate ring 3 may raise with INT
+    idt_set_gate(SYSCALL_VECTOR, (uint32_t)isr128, 0x08, IDT_USER_INTERRUPT_GATE);
+
+    // The boot CPU's interrupt timing histograms, under ISR_PROFILE
+    isr_profile_init_cpu(&percpu[0]);
+
     // Load IDT
     load_idt();
     
     return true;
-}
\ No newline at end of file
+}
+
+// The IDT is shared; an application processor only loads it, and keeps
+// interrupts off until it is ready for them
+void idt_load_cpu(void) {
+    __asm__ volatile("lidt %0" : : "m"(idt_ptr));
+}
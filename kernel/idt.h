@@ -7,6 +7,7 @@
 // IDT gate types
 #define IDT_INTERRUPT_GATE 0x8E    // Present(1)|Ring0(00)|Type(1110)
 #define IDT_TRAP_GATE     0x8F    // Present(1)|Ring0(00)|Type(1111)
+#define IDT_USER_INTERRUPT_GATE 0xEE    // Present(1)|Ring3(11)|Type(1110)
 
 // IDT entry structure
 struct idt_entry {
@@ -26,5 +27,6 @@ struct idt_ptr {
 // Function declarations
 bool init_idt(void);
 extern void load_idt(void);
+void idt_load_cpu(void);
 
 #endif
\ No newline at end of file
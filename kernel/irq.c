@@ -0,0 +1,53 @@
+#include "irq.h"
+#include "isr.h"
+#include "pic.h"
+#include "apic.h"
+
+static bool apic_active = false;
+static uint16_t unmasked_irqs;      // Lines drivers asked for, kept across the switch
+
+bool irq_use_apic(void) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+
+    bool ok = apic_init();
+    if (ok) {
+        // Vectors 39 and 47 are ordinary IRQs from now on
+        pic_disable();
+        pic_spurious_filter = 0;
+        apic_active = true;
+
+        for (uint8_t irq = 0; irq < IRQ_COUNT; irq++) {
+            if (unmasked_irqs & (1u << irq)) ioapic_unmask(irq);
+        }
+    }
+
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+    return ok;
+}
+
+bool irq_apic_active(void) {
+    return apic_active;
+}
+
+void irq_mask(uint8_t irq) {
+    if (irq >= IRQ_COUNT) return;
+    unmasked_irqs &= ~(1u << irq);
+    if (apic_active) ioapic_mask(irq);
+    else pic_set_mask(irq);
+}
+
+void irq_unmask(uint8_t irq) {
+    if (irq >= IRQ_COUNT) return;
+    unmasked_irqs |= 1u << irq;
+    if (apic_active) ioapic_unmask(irq);
+    else pic_clear_mask(irq);
+}
+
+void irq_eoi(uint32_t vector) {
+    if (apic_active) {
+        lapic_eoi();
+    } else if (vector >= IRQ_BASE && vector < IRQ_BASE + IRQ_COUNT) {
+        pic_send_eoi(vector - IRQ_BASE);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Interrupt controller front end. Starts on the 8259 PICs set up by
+// pic_init and moves to the APICs when irq_use_apic() succeeds; drivers
+// only see ISA IRQ numbers.
+
+bool irq_use_apic(void);        // False leaves the PICs in charge
+bool irq_apic_active(void);
+
+void irq_mask(uint8_t irq);
+void irq_unmask(uint8_t irq);
+void irq_eoi(uint32_t vector);  // Called by irq_handler after the handler
+
+#endif // IRQ_H
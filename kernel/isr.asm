@@ -4,15 +4,46 @@ section .text
 
 ; Constants
 KERNEL_DS equ 0x10     ; Kernel data segment selector
+PERCPU_GS equ 0x30     ; This CPU's struct percpu
+PERCPU_ISR_ENTRY_TSC equ 32 ; Its isr_entry_tsc, as in percpu.h
+PIC1_COMMAND equ 0x20
+PIC2_COMMAND equ 0xA0
+PIC_EOI equ 0x20
 
-; External C function
+; External C functions
 extern isr_handler
+extern irq_handler
+extern spurious_irq_count
+extern pic_spurious_filter
+extern irq_full_frame
+extern syscall_handler
+APIC_TIMER_VECTOR equ 0x30
+SMP_RESCHED_VECTOR equ 0x31
+SMP_TLB_VECTOR equ 0x32
+SYSCALL_VECTOR equ 0x80
 
 ; Export our ASM routines
 global isr_common_stub
 global load_idt
 global isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7, isr8, isr9
 global isr10, isr11, isr12, isr13, isr14, isr15, isr16, isr17, isr18, isr19
+global irq_common_stub, irq_fast_stub
+global irq0, irq1, irq2, irq3, irq4, irq5, irq6, irq7
+global irq8, irq9, irq10, irq11, irq12, irq13, irq14, irq15
+global apic_timer_irq, apic_spurious_irq
+global smp_resched_irq, smp_tlb_irq
+global isr128
+
+; With ISR_PROFILE, stamp the TSC in this CPU's struct percpu as early as
+; the common stubs can, once GS is known to point there; the C handler
+; copies it out before anything can nest
+%macro PROFILE_ENTRY 0
+%ifdef ISR_PROFILE
+    rdtsc
+    mov [gs:PERCPU_ISR_ENTRY_TSC], eax
+    mov [gs:PERCPU_ISR_ENTRY_TSC + 4], edx
+%endif
+%endmacro
 
 section .isr_text
 align 4
@@ -24,31 +55,54 @@ load_idt:
     sti                     ; Enable interrupts after loading IDT
     ret
 
-; Common ISR stub that calls our C handler
-isr_common_stub:
+; Offset of the interrupted CS once pusha has run: the 8 registers, the
+; vector, the error code and EIP sit below it
+FRAME_CS equ 44
+
+; Build a full registers_t around a C handler. Data segments only need
+; loading when the interrupt came from ring 3. In ring 0, GS is always the
+; per-CPU segment (user_enter switches it with interrupts off), and DS/ES
+; are flat: KERNEL_DS, or the user selectors while the SYSENTER path runs
+; C, which reach the same memory. So the saved DS is kept for the layout
+; and both reloads are skipped.
+%macro FULL_FRAME_STUB 1
     pusha                   ; Push all registers
+    cld                     ; C code expects DF clear; memmove may have set it
     mov ax, ds             ; Save data segment
     push eax
-    
+
+    test byte [esp + 4 + FRAME_CS], 3
+    jz %%kernel_entry
     mov ax, KERNEL_DS      ; Load kernel data segment
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, PERCPU_GS
     mov gs, ax
-    
+%%kernel_entry:
+    PROFILE_ENTRY
+
     push esp               ; Push pointer to registers_t struct as argument
-    call isr_handler       ; Call C handler
+    call %1                ; Call C handler
     add esp, 4            ; Clean up pushed argument
-    
+
     pop eax               ; Restore data segment
+    test byte [esp + FRAME_CS], 3
+    jz %%kernel_exit
     mov ds, ax
     mov es, ax
     mov fs, ax
     mov gs, ax
-    
+%%kernel_exit:
+
     popa                  ; Restore registers
     add esp, 8           ; Clean up error code and ISR number
     iret                 ; Return from interrupt
+%endmacro
+
+; Common ISR stub that calls our C handler
+isr_common_stub:
+    FULL_FRAME_STUB isr_handler
 
 ; CPU Exception handlers
 %macro ISR_NOERRCODE 1
@@ -88,4 +142,145 @@ ISR_NOERRCODE 15  ; Reserved
 ISR_NOERRCODE 16  ; x87 floating-point exception
 ISR_ERRCODE   17  ; Alignment check (now generates error code)
 ISR_NOERRCODE 18  ; Machine check
-ISR_NOERRCODE 19  ; SIMD floating-point exception
\ No newline at end of file
+ISR_NOERRCODE 19  ; SIMD floating-point exception
+
+; Common IRQ stub: same frame as isr_common_stub, but irq_handler also
+; acknowledges the PIC once the handler has run
+irq_common_stub:
+    FULL_FRAME_STUB irq_handler
+
+; IRQ from ring 0 whose handler does not need the full frame. irq_handler
+; is C and preserves EBX/ESI/EDI/EBP itself, so only the caller-saved
+; registers are pushed. They land where pusha would put them; the space
+; below is reserved so regs still points at a registers_t, but DS and the
+; callee-saved fields in it are not filled in.
+irq_fast_stub:
+    push eax
+    push ecx
+    push edx
+    sub esp, 24             ; ds, edi, esi, ebp, esp, ebx
+    cld
+    PROFILE_ENTRY
+
+    push esp
+    call irq_handler
+    add esp, 28
+
+    pop edx
+    pop ecx
+    pop eax
+    add esp, 8
+    iret
+
+; Pick the entry path once the vector is on the stack: the full frame
+; for an interrupt from ring 3 or a vector that asked for one with
+; irq_set_full_frame(), the fast path otherwise
+%macro IRQ_DISPATCH 1
+    test byte [esp + 12], 3             ; Interrupted CS
+    jnz irq_common_stub
+    cmp byte [irq_full_frame + %1 - 32], 0
+    jne irq_common_stub
+    jmp irq_fast_stub
+%endmacro
+
+; Hardware IRQ handlers, IRQ n on vector 32 + n
+%macro IRQ 1
+align 4
+irq%1:
+    push dword 0        ; No error code
+    push dword 32 + %1  ; Vector number
+    IRQ_DISPATCH 32 + %1
+%endmacro
+
+IRQ 0
+IRQ 1
+IRQ 2
+IRQ 3
+IRQ 4
+IRQ 5
+IRQ 6
+IRQ 8
+IRQ 9
+IRQ 10
+IRQ 11
+IRQ 12
+IRQ 13
+IRQ 14
+
+; IRQ7 and IRQ15 are also what the PICs deliver for a request that went
+; away before it was acknowledged. pic_init leaves both PICs returning
+; their in-service register on a command port read, so telling a real
+; IRQ from a spurious one takes a single inb. Under the APIC the check
+; is skipped.
+align 4
+irq7:
+    cmp byte [pic_spurious_filter], 0
+    je .real
+    push eax
+    in al, PIC1_COMMAND
+    test al, 0x80
+    pop eax
+    jz .spurious
+.real:
+    push dword 0
+    push dword 39
+    IRQ_DISPATCH 39
+.spurious:
+    inc dword [spurious_irq_count]
+    iret
+
+align 4
+irq15:
+    cmp byte [pic_spurious_filter], 0
+    je .real
+    push eax
+    in al, PIC2_COMMAND
+    test al, 0x80
+    jz .spurious
+    pop eax
+.real:
+    push dword 0
+    push dword 47
+    IRQ_DISPATCH 47
+.spurious:
+    ; The master did see a request on the cascade line, so it still
+    ; needs its EOI
+    mov al, PIC_EOI
+    out PIC1_COMMAND, al
+    pop eax
+    inc dword [spurious_irq_count]
+    iret
+
+; Local APIC timer, dispatched like an IRQ
+align 4
+apic_timer_irq:
+    push dword 0
+    push dword APIC_TIMER_VECTOR
+    IRQ_DISPATCH APIC_TIMER_VECTOR
+
+; Inter-processor interrupts from smp.c, dispatched like IRQs
+align 4
+smp_resched_irq:
+    push dword 0
+    push dword SMP_RESCHED_VECTOR
+    IRQ_DISPATCH SMP_RESCHED_VECTOR
+
+align 4
+smp_tlb_irq:
+    push dword 0
+    push dword SMP_TLB_VECTOR
+    IRQ_DISPATCH SMP_TLB_VECTOR
+
+; Local APIC spurious vector: no handler and no EOI
+align 4
+apic_spurious_irq:
+    iret
+
+; System call gate, int 0x80 with DPL 3. Always a full frame: the
+; arguments come in and the result goes back through registers_t.
+align 4
+isr128:
+    push dword 0
+    push dword SYSCALL_VECTOR
+syscall_common_stub:
+    FULL_FRAME_STUB syscall_handler
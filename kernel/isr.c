@@ -1,17 +1,90 @@
 #include "isr.h"
+#include "irq.h"
+#include "deferred.h"
+#include "sched.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "console.h"
+#include "memory.h"
+#include "smp.h"
+#include <string.h>
 
-// Array of interrupt handlers
-static isr_t interrupt_handlers[256] = {0};  // Initialize all handlers to NULL
+// Array of interrupt handlers. Changes take handlers_lock; dispatch reads
+// an entry with one aligned load and never waits for it.
+static isr_t volatile interrupt_handlers[256] = {0};  // Initialize all handlers to NULL
+static struct spinlock handlers_lock = SPINLOCK_INIT("irq handlers");
+
+volatile uint32_t spurious_irq_count = 0;
+volatile uint8_t pic_spurious_filter = 1;
+
+// Read by the IRQ stubs, indexed by vector - IRQ_BASE
+volatile uint8_t irq_full_frame[IRQ_FRAME_VECTORS];
+
+#ifdef ISR_PROFILE
+// Each CPU stamps and counts in its own struct percpu and histograms, so
+// nothing is shared on the interrupt path; isr_profile_get() adds them up.
+// The boot CPU's are static, the APs' come from the heap.
+_Static_assert(PERCPU_OFFSET(isr_entry_tsc) == PERCPU_ISR_ENTRY_TSC, "isr.asm stamps the wrong field");
+static struct isr_profile boot_profiles[ISR_PROFILE_VECTORS];
+
+static inline uint64_t entry_tsc(void) {
+    uint32_t lo = this_cpu_read(isr_entry_tsc[0]);
+    uint32_t hi = this_cpu_read(isr_entry_tsc[1]);
+    return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint32_t profile_bucket(uint32_t cycles) {
+    uint32_t r;
+    if (!cycles) return 0;
+    __asm__("bsr %1, %0" : "=r"(r) : "rm"(cycles));
+    return r;
+}
+
+// entry: stub TSC, start/end: around the handler; exit is taken here
+static void profile_record(uint32_t vector, uint64_t entry, uint64_t start, uint64_t end) {
+    uint64_t exit = rdtsc();
+    struct isr_profile* profiles = (struct isr_profile*)this_cpu_read(isr_profiles);
+    if (vector >= ISR_PROFILE_VECTORS || !profiles) return;
+
+    struct isr_profile* p = &profiles[vector];
+    uint32_t handler = (uint32_t)(end - start);
+    uint32_t dispatch = (uint32_t)((start - entry) + (exit - end));
+
+    p->count++;
+    p->handler[profile_bucket(handler)]++;
+    p->dispatch[profile_bucket(dispatch)]++;
+    if (handler > p->handler_max) p->handler_max = handler;
+    if (dispatch > p->dispatch_max) p->dispatch_max = dispatch;
+}
+#endif
 
 // Register an interrupt handler
 void register_interrupt_handler(uint8_t n, isr_t handler) {
     if (handler != 0) {  // Validate handler
+        uint32_t flags = spin_lock_irqsave(&handlers_lock);
         interrupt_handlers[n] = handler;
+        spin_unlock_irqrestore(&handlers_lock, flags);
     }
 }
 
+void unregister_interrupt_handler(uint8_t n) {
+    uint32_t flags = spin_lock_irqsave(&handlers_lock);
+    interrupt_handlers[n] = 0;
+    spin_unlock_irqrestore(&handlers_lock, flags);
+}
+
+void irq_set_full_frame(uint8_t vector, bool full) {
+    if (vector < IRQ_BASE || vector >= IRQ_BASE + IRQ_FRAME_VECTORS) return;
+    irq_full_frame[vector - IRQ_BASE] = full;
+}
+
 // Called from assembly - dispatch to the correct handler
 void isr_handler(registers_t* regs) {
+#ifdef ISR_PROFILE
+    uint64_t entry = entry_tsc();
+    uint64_t start = rdtsc();
+#endif
     if (!regs) return;  // Validate registers pointer
     
     isr_t handler = interrupt_handlers[regs->int_no];
@@ -22,4 +95,132 @@ void isr_handler(registers_t* regs) {
         // Handle unregistered interrupt
         // TODO: Add proper error handling or logging here
     }
-}
\ No newline at end of file
+#ifdef ISR_PROFILE
+    profile_record(regs->int_no, entry, start, rdtsc());
+#endif
+}
+
+// Called from the IRQ stubs with interrupts disabled. The EOI goes out
+// after the handler so the line cannot fire again while it runs; work
+// the handler deferred then runs with interrupts back on.
+void irq_handler(registers_t* regs) {
+#ifdef ISR_PROFILE
+    uint64_t entry = entry_tsc();
+#endif
+#ifdef IRQ_OFF_TIMING
+    uint64_t start = rdtsc();
+#endif
+    this_cpu_inc(irq_depth);
+
+    isr_t handler = interrupt_handlers[regs->int_no];
+    if (handler != 0) {
+        handler(regs);
+    }
+#ifdef ISR_PROFILE
+    uint64_t end = rdtsc();
+#endif
+    irq_eoi(regs->int_no);
+#ifdef ISR_PROFILE
+    profile_record(regs->int_no, entry, start, end);
+#endif
+
+#ifdef IRQ_OFF_TIMING
+    // Interrupts are still off, so nothing on this CPU races the update
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+    if (cycles > this_cpu_read(irq_off_max)) this_cpu_write(irq_off_max, cycles);
+#endif
+
+    run_deferred_work();
+
+    // Outermost IRQ done: switch threads here if one was asked for, with
+    // this frame left on the preempted thread's stack until it resumes
+    this_cpu_dec(irq_depth);
+    sched_irq_exit();
+}
+
+uint32_t irq_off_max_cycles(void) {
+    return this_cpu_read(irq_off_max);
+}
+
+void irq_off_max_reset(void) {
+    this_cpu_write(irq_off_max, 0);
+}
+
+#ifdef ISR_PROFILE
+bool isr_profile_init_cpu(struct percpu* cpu) {
+    struct isr_profile* profiles = boot_profiles;
+    if (cpu != &percpu[0]) {
+        // The heap is demand paged; fault the pages in here, not in an IRQ
+        profiles = kmalloc(sizeof(boot_profiles));
+        if (!profiles) return false;
+        memset(profiles, 0, sizeof(boot_profiles));
+    }
+    cpu->isr_profiles = profiles;
+    return true;
+}
+
+bool isr_profile_get(uint8_t vector, struct isr_profile* out) {
+    if (vector >= ISR_PROFILE_VECTORS) return false;
+    memset(out, 0, sizeof(*out));
+
+    // Other CPUs keep counting meanwhile; each word read is whole
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        const struct isr_profile* p = percpu[cpu].isr_profiles;
+        if (!p) continue;
+        p += vector;
+
+        out->count += p->count;
+        if (p->dispatch_max > out->dispatch_max) out->dispatch_max = p->dispatch_max;
+        if (p->handler_max > out->handler_max) out->handler_max = p->handler_max;
+        for (uint32_t b = 0; b < ISR_PROFILE_BUCKETS; b++) {
+            out->dispatch[b] += p->dispatch[b];
+            out->handler[b] += p->handler[b];
+        }
+    }
+    return true;
+}
+
+void isr_profile_reset(void) {
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        if (percpu[cpu].isr_profiles) memset(percpu[cpu].isr_profiles, 0, sizeof(boot_profiles));
+    }
+}
+
+static void dump_histogram(const char* name, const uint32_t* buckets, uint32_t max) {
+    kprintf("  %s max %u:", name, max);
+    for (uint32_t b = 0; b < ISR_PROFILE_BUCKETS; b++) {
+        if (buckets[b]) kprintf(" 2^%u:%u", b, buckets[b]);
+    }
+    kprintf("\n");
+}
+
+void isr_profile_dump(void) {
+    struct isr_profile p;
+
+    kprintf("isr profile (cycles, log2 buckets):\n");
+    for (uint32_t v = 0; v < ISR_PROFILE_VECTORS; v++) {
+        if (!isr_profile_get(v, &p) || !p.count) continue;
+        kprintf(" vector %u: %u calls\n", v, p.count);
+        dump_histogram("dispatch", p.dispatch, p.dispatch_max);
+        dump_histogram("handler ", p.handler, p.handler_max);
+    }
+}
+#else
+bool isr_profile_init_cpu(struct percpu* cpu) {
+    (void)cpu;
+    return true;
+}
+
+bool isr_profile_get(uint8_t vector, struct isr_profile* out) {
+    (void)vector;
+    (void)out;
+    return false;
+}
+
+void isr_profile_reset(void) {
+}
+
+void isr_profile_dump(void) {
+    kprintf("isr profile: not built in (PROFILE=1)\n");
+}
+#endif
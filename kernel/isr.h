@@ -59,6 +59,7 @@ ISR_STUB(19)  // SIMD floating-point
 #define ISR_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // Define the register structure for interrupt handlers
 typedef struct {
@@ -68,14 +69,70 @@ typedef struct {
     uint32_t eip, cs, eflags, useresp, ss;
 } registers_t;
 
+// Hardware IRQs are remapped to vectors IRQ_BASE..IRQ_BASE + 15
+#define IRQ_BASE 32
+#define IRQ_COUNT 16
+#define IRQ_VECTOR(irq) (IRQ_BASE + (irq))
+
 // Function pointer type for interrupt handlers
 typedef void (*isr_t)(registers_t*);
 
 // Handler registration function - implemented in isr.c
 void register_interrupt_handler(uint8_t n, isr_t handler);
 
-// Handler called from assembly - implemented in isr.c
+void unregister_interrupt_handler(uint8_t n);
+
+// IRQ vectors IRQ_BASE..IRQ_BASE + 31 from ring 0 take a fast entry path
+// that saves only EAX/ECX/EDX; the handler's regs then has valid eax, ecx,
+// edx, int_no and the iret frame, nothing else. A handler that reads or
+// changes the other registers asks for the full frame here.
+#define IRQ_FRAME_VECTORS 32
+
+void irq_set_full_frame(uint8_t vector, bool full);
+
+// Handlers called from assembly - implemented in isr.c
 void isr_handler(registers_t* regs);
+void irq_handler(registers_t* regs);   // Runs the handler, then sends EOI
+void syscall_handler(registers_t* regs);    // int 0x80, in syscall.c
+
+// Spurious IRQ7/IRQ15 deliveries filtered out in the stubs. The filter
+// reads the 8259 ISR and is switched off once the APIC takes over.
+extern volatile uint32_t spurious_irq_count;
+extern volatile uint8_t pic_spurious_filter;
+
+// Per-vector timing, built with ISR_PROFILE. Dispatch is the time spent
+// in the entry/exit path around the handler; both are log2 histograms of
+// TSC cycles, bucket n counting values in [2^n, 2^(n+1)).
+#define ISR_PROFILE_VECTORS 64
+#define ISR_PROFILE_BUCKETS 32
+
+struct isr_profile {
+    uint32_t count;
+    uint32_t dispatch_max;
+    uint32_t handler_max;
+    uint32_t dispatch[ISR_PROFILE_BUCKETS];
+    uint32_t handler[ISR_PROFILE_BUCKETS];
+};
+
+struct percpu;
+
+// Give a CPU its histograms before it takes interrupts; false if the heap
+// is out. Interrupts on a CPU without them go uncounted.
+bool isr_profile_init_cpu(struct percpu* cpu);
+// Totals over every CPU
+bool isr_profile_get(uint8_t vector, struct isr_profile* out);  // False when not built in
+void isr_profile_reset(void);   // Racy against CPUs taking interrupts; call when quiet
+void isr_profile_dump(void);
+
+// Longest stretch irq_handler ran with interrupts disabled on this CPU,
+// TSC cycles. Measured only in BENCH=1 and PROFILE=1 builds, so the
+// production IRQ path reads no TSC; always 0 otherwise.
+#if defined(TKOS_BENCH) || defined(ISR_PROFILE)
+#define IRQ_OFF_TIMING
+#endif
+
+uint32_t irq_off_max_cycles(void);
+void irq_off_max_reset(void);
 
 // Common ISR stub - implemented in isr.asm
 void __attribute__((weak)) isr_common_stub(void);
@@ -102,4 +159,27 @@ void __attribute__((weak)) isr17(void);
 void __attribute__((weak)) isr18(void);
 void __attribute__((weak)) isr19(void);
 
+// IRQ stubs - implemented in isr.asm
+void irq0(void);
+void irq1(void);
+void irq2(void);
+void irq3(void);
+void irq4(void);
+void irq5(void);
+void irq6(void);
+void irq7(void);
+void irq8(void);
+void irq9(void);
+void irq10(void);
+void irq11(void);
+void irq12(void);
+void irq13(void);
+void irq14(void);
+void irq15(void);
+void apic_timer_irq(void);
+void apic_spurious_irq(void);
+void smp_resched_irq(void);
+void smp_tlb_irq(void);
+void isr128(void);                  // System call gate
+
 #endif
\ No newline at end of file
@@ -1,122 +1,147 @@
 // kernel.c - Minimal kernel for TKOS
 #include <stdint.h>
 #include <stddef.h>
+#include "gdt.h"
 #include "idt.h"
 #include "pic.h"
 #include "isr.h"
 #include "memory.h"
+#include "pmm.h"
+#include "console.h"
+#include "paging.h"
+#include "vmm.h"
+#include "irq.h"
+#include "deferred.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "clock.h"
+#include "idle.h"
+#include "timer.h"
+#include "sched.h"
+#include "smp.h"
+#include "lockstat.h"
+#include "bench.h"
+#include "cpu.h"
+#include <string.h>
 #include "../drivers/keyboard.h"
+#include "../drivers/serial.h"
 
-// VGA buffer constants
-#define VGA_BUFFER 0xB8000
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
-
-// VGA colors
-#define VGA_BLACK        0x0
-#define VGA_BLUE         0x1
-#define VGA_GREEN        0x2
-#define VGA_CYAN         0x3
-#define VGA_RED          0x4
-#define VGA_MAGENTA      0x5
-#define VGA_BROWN        0x6
-#define VGA_LIGHT_GREY   0x7
-#define VGA_DARK_GREY    0x8
-#define VGA_LIGHT_BLUE   0x9
-#define VGA_LIGHT_GREEN  0xA
-#define VGA_LIGHT_CYAN   0xB
-#define VGA_LIGHT_RED    0xC
-#define VGA_LIGHT_MAGENTA 0xD
-#define VGA_LIGHT_BROWN  0xE
-#define VGA_WHITE        0xF
-
-#define VGA_COLOR_WHITE_ON_BLACK 0x0F
-#define VGA_COLOR_RED_ON_BLACK   0x04
-
-// VGA color attribute byte
-#define VGA_COLOR(fg, bg) ((bg << 4) | fg)
-
-// Current position in VGA buffer
-static uint16_t* const VGA_MEMORY = (uint16_t*)VGA_BUFFER;
-static size_t terminal_row = 0;
-static size_t terminal_col = 0;
-
-// Function prototypes
-void clear_screen(void);
-void write_char(char c);
-void write_string(const char* str);
-
-// Function implementations
-void clear_screen(void) {
-    for (size_t i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-        VGA_MEMORY[i] = VGA_COLOR_WHITE_ON_BLACK << 8 | ' ';
-    }
-    terminal_row = 0;
-    terminal_col = 0;
-}
-
-void write_char(char c) {
-    if (c == '\n') {
-        terminal_col = 0;
-        terminal_row++;
-        if (terminal_row >= VGA_HEIGHT) {
-            terminal_row = 0;
-        }
+void kernel_main(void) {
+    // Kernel GDT with user segments, the TSS and this CPU's per-CPU
+    // segment in GS, which the FPU and string code already rely on
+    if (!gdt_init()) {
+        write_string("Error: GDT initialization failed\n");
         return;
     }
 
-    const size_t index = terminal_row * VGA_WIDTH + terminal_col;
-    VGA_MEMORY[index] = VGA_COLOR_WHITE_ON_BLACK << 8 | c;
-    
-    terminal_col++;
-    if (terminal_col >= VGA_WIDTH) {
-        terminal_col = 0;
-        terminal_row++;
-        if (terminal_row >= VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-    }
-}
+    // Detect CPU features, enable SSE and pick the memory primitives
+    cpu_init();
+    string_init((cpu_info.sse_enabled && CPU_HAS(features_edx, CPUID_EDX_SSE2) ? STRING_FEAT_SSE2 : 0) |
+                (CPU_HAS(ext_features_ebx, CPUID_7_EBX_ERMS) ? STRING_FEAT_ERMS : 0));
 
-void write_string(const char* str) {
-    for (size_t i = 0; str[i] != '\0'; i++) {
-        write_char(str[i]);
-    }
-}
+    // Mirror console output to COM1 when a UART is present
+    serial_init();
+
+    // Initialize the virtual terminals, showing the log console
+    console_init();
 
-void kernel_main(void) {
-    // Initialize terminal
-    clear_screen();
-    
     // Initialize IDT
     if (!init_idt()) {
         write_string("Error: IDT initialization failed\n");
         return;
     }
 
+    // FPU/SSE state is switched lazily through #NM
+    if (!fpu_init()) {
+        write_string("Error: FPU initialization failed\n");
+        return;
+    }
+
+    // int 0x80 gate is in the IDT; add the handlers and SYSENTER
+    if (!syscall_init()) {
+        write_string("Error: System call initialization failed\n");
+        return;
+    }
+
     // Initialize and remap PIC
     if (!pic_init()) {
         write_string("Error: PIC initialization failed\n");
         return;
     }
     
-    // Initialize keyboard
+    // Initialize physical memory from the BIOS E820 map
+    if (!pmm_init()) {
+        write_string("Error: No usable memory found\n");
+        return;
+    }
+
+    // Identity map RAM and enable paging
+    if (!init_paging()) {
+        write_string("Error: Paging initialization failed\n");
+        return;
+    }
+
+    // Initialize memory system - heap is reserved virtual space backed on demand
+    if (!init_memory(KERNEL_HEAP_BASE, KERNEL_HEAP_SIZE)) {
+        write_string("Error: Heap initialization failed\n");
+        return;
+    }
+    
+    // Shared zero page and the kernel address space
+    if (!vmm_init()) {
+        write_string("Error: VMM initialization failed\n");
+        return;
+    }
+
+    // Take interrupts through the local and I/O APICs when ACPI lists
+    // them; otherwise stay on the 8259s
+    bool apic = irq_use_apic();
+
+    // Calibrate the TSC and start the IRQ0 tick
+    if (!clock_init()) {
+        write_string("Error: Clock calibration failed\n");
+        return;
+    }
+    timer_init();
+    console_start_flush_timer();
+
+    // Start the keyboard reset; the IRQ1 path and a timeout timer see it
+    // through while boot carries on
     if (!init_keyboard()) {
         write_string("Error: Keyboard initialization failed\n");
         return;
     }
 
-    // Initialize memory system - start heap at 1MB mark with 4MB size
-    init_memory(0x100000, 0x400000);
-    
+    // This flow of control becomes thread "main"; the idle thread takes
+    // over whenever nothing else is runnable
+    idle_init();
+    if (!sched_init()) {
+        write_string("Error: Scheduler initialization failed\n");
+        return;
+    }
+
     // Enable interrupts
     __asm__ volatile ("sti");
+
+    // Start the other CPUs; each runs its own idle thread and takes work
+    // from the others. Interrupts are on so TLB shootdowns from an AP
+    // that is already running get answered.
+    uint32_t cpus = smp_init();
+
+    // Keyboard input for the virtual terminals: Alt+F1 onwards switches
+    if (!console_start_input()) {
+        write_string("Error: Console input thread could not be started\n");
+    }
     
     // Write welcome message
     write_string("Welcome to TKOS!\n");
     write_string("Successfully entered protected mode.\n");
     write_string("Kernel initialized.\n");
     write_string("IDT, PIC, keyboard, and memory management initialized.\n");
+    kprintf("Interrupt controller: %s\n", apic ? "APIC" : "8259 PIC");
+    kprintf("CPUs: %u\n", cpus);
+    kprintf("Clock: TSC %u kHz, calibrated against the %s\n", clocksource.tsc_khz,
+            clocksource.calibrated_by == CLOCK_SOURCE_HPET ? "HPET" : "PIT");
     write_string("System is ready.\n");
     
     // Test memory allocation
@@ -126,16 +151,33 @@ void kernel_main(void) {
     } else {
         write_string("Memory allocation test failed.\n");
     }
+
+#ifdef TKOS_BENCH
+    run_benchmarks();
+    kmem_dump_stats();
+    sched_dump_threads();
+#endif
+#ifdef ISR_PROFILE
+    isr_profile_dump();
+#endif
+#ifdef LOCK_STAT
+    lock_stat_dump();
+#endif
     
-    // Infinite loop with interrupts enabled
-    while (1) {
-        __asm__ volatile ("hlt");
-    }
+    // Boot is done. From here the idle thread sleeps with the tick
+    // stopped until an interrupt or a timer brings work; deferred work
+    // normally runs on IRQ exit and the idle loop catches the rest.
+    thread_exit();
 }
 
+// Linker-provided bounds of .bss, which the flat image does not carry
+extern uint8_t __bss_start[];
+extern uint8_t __bss_end[];
+
+__attribute__((section(".text.entry")))
 void _start(void) {
     // Set up basic VGA for debug output
-    VGA_MEMORY[0] = (VGA_COLOR_WHITE_ON_BLACK << 8) | 'K';
+    ((uint16_t*)VGA_BUFFER)[0] = (VGA_COLOR_WHITE_ON_BLACK << 8) | 'K';
     
     // Set up segments
     __asm__ volatile (
@@ -147,6 +189,11 @@ void _start(void) {
         "mov %ax, %ss\n"
     );
     
+    // Zero .bss before any C code relies on it
+    for (uint8_t* p = __bss_start; p < __bss_end; p++) {
+        *p = 0;
+    }
+
     // Call kernel_main
     kernel_main();
     
@@ -0,0 +1,87 @@
+#include "lockstat.h"
+#include "cpu.h"
+#include "console.h"
+
+#define LOCK_STAT_TOP 8     // Locks lock_stat_dump() lists
+
+#ifdef LOCK_STAT
+static struct lock_stat* volatile lock_stats;
+
+// Runs once per lock, by its first holder; other locks may be joining
+// the list from other CPUs at the same time
+static void lock_stat_register(struct lock_stat* stat) {
+    struct lock_stat* head;
+    struct lock_stat* prev;
+    stat->registered = true;
+    do {
+        head = lock_stats;
+        stat->next = head;
+        __asm__ volatile("lock cmpxchgl %2, %1"
+                         : "=a"(prev), "+m"(lock_stats)
+                         : "r"(stat), "0"(head)
+                         : "memory", "cc");
+    } while (prev != head);
+}
+
+void lock_stat_acquired(struct lock_stat* stat, uint64_t wait_start) {
+    uint64_t now = rdtsc();
+    if (!stat->registered) lock_stat_register(stat);
+
+    stat->acquisitions++;
+    if (wait_start) {
+        stat->contended++;
+        stat->spin_cycles += now - wait_start;
+    }
+    stat->acquired_at = now;
+}
+
+void lock_stat_released(struct lock_stat* stat) {
+    uint32_t hold = (uint32_t)(rdtsc() - stat->acquired_at);
+    if (hold > stat->max_hold) stat->max_hold = hold;
+}
+
+void lock_stat_reset(void) {
+    for (struct lock_stat* s = lock_stats; s; s = s->next) {
+        s->acquisitions = 0;
+        s->contended = 0;
+        s->spin_cycles = 0;
+        s->max_hold = 0;
+    }
+}
+
+void lock_stat_dump(void) {
+    // Selection by spin cycles: LOCK_STAT_TOP passes over a short list
+    struct lock_stat* top[LOCK_STAT_TOP];
+    uint32_t count = 0;
+    uint32_t total = 0;
+
+    for (struct lock_stat* s = lock_stats; s; s = s->next) total++;
+    while (count < LOCK_STAT_TOP) {
+        struct lock_stat* worst = 0;
+        for (struct lock_stat* s = lock_stats; s; s = s->next) {
+            bool listed = false;
+            for (uint32_t i = 0; i < count; i++) {
+                if (top[i] == s) listed = true;
+            }
+            if (!listed && (!worst || s->spin_cycles > worst->spin_cycles)) worst = s;
+        }
+        if (!worst) break;
+        top[count++] = worst;
+    }
+
+    kprintf("locks: %u taken, hottest first (cycles)\n", total);
+    kprintf("    acquired  contended             spin  max hold  name\n");
+    for (uint32_t i = 0; i < count; i++) {
+        struct lock_stat* s = top[i];
+        kprintf("  %10u %10u %16llu %9u  %s\n", s->acquisitions, s->contended,
+                s->spin_cycles, s->max_hold, s->name ? s->name : "(unnamed)");
+    }
+}
+#else
+void lock_stat_reset(void) {
+}
+
+void lock_stat_dump(void) {
+    kprintf("locks: statistics not built in (LOCKSTAT=1)\n");
+}
+#endif
@@ -0,0 +1,42 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Lock contention statistics, built with LOCK_STAT. Every lock then
+// carries a struct lock_stat, which joins a global list the first time
+// the lock is taken. Apart from that link, only the lock's holder writes
+// it, so the counters need no lock of their own.
+
+struct lock_stat {
+    const char* name;
+    struct lock_stat* next;     // Every lock taken so far
+    uint32_t acquisitions;
+    uint32_t contended;         // Acquisitions that had to wait
+    uint64_t spin_cycles;       // TSC cycles spent waiting
+    uint32_t max_hold;          // Longest hold, TSC cycles
+    uint64_t acquired_at;
+    bool registered;
+};
+
+#ifdef LOCK_STAT
+#define LOCK_STAT_FIELD     struct lock_stat stat;
+#define LOCK_STAT_INIT(n)   , .stat = { .name = (n) }
+
+// Called by the lock primitives with the lock held. wait_start is the
+// TSC when the caller started waiting, 0 if it never did.
+void lock_stat_acquired(struct lock_stat* stat, uint64_t wait_start);
+void lock_stat_released(struct lock_stat* stat);
+#else
+#define LOCK_STAT_FIELD
+#define LOCK_STAT_INIT(n)
+#endif
+
+// The locks that cost the most spinning, worst first
+void lock_stat_dump(void);
+
+// Zero every lock's counters. Racy against holders; call when quiet.
+void lock_stat_reset(void);
+
+#endif // LOCKSTAT_H
@@ -1,36 +1,561 @@
 #include "memory.h"
+#include "pmm.h"
+#include "paging.h"
+#include "console.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "smp.h"
 
-// Simple bump allocator implementation
-static uint32_t mem_start;      // Start of heap
-static uint32_t mem_end;        // End of heap
-static uint32_t next_free;      // Next free memory location
+// Kernel heap: size-class slab allocator on top of a page-run allocator.
+//
+// The heap region is split into 4 KB pages, each described by a heap_page
+// entry in a descriptor array stored at the start of the region. Small
+// requests (<= SLAB_MAX_SIZE) are rounded up to a power-of-two size class
+// and served from single-page slabs; larger requests get a contiguous run
+// of whole pages. Free page runs are kept in power-of-two bins and are
+// coalesced with their neighbours when released.
+//
+// The heap is a reserved virtual range registered as a demand region:
+// pages, descriptors included, get a frame on first touch. Free runs that
+// may still hold frames are marked dirty, and kmem_trim() hands those
+// frames back to the PMM. Trimmed runs stay out of the bins until every
+// CPU has flushed its TLB, so no CPU can reach a reused page through a
+// stale entry.
+//
+// One lock, taken with interrupts off, covers the whole heap. Every CPU
+// allocates, so it is an MCS lock: waiters queue on their own stack
+// instead of hammering the lock's line. It may be held across a demand
+// fault, so paging and the PMM rank below it.
+//
+// Every kmalloc/kfree bumps a counter in a cache-line sized block. There
+// is one block per CPU so CPUs never write to a shared line; only
+// kmem_get_stats() sums them and walks the free runs.
 
-void init_memory(uint32_t start_addr, uint32_t size) {
-    mem_start = start_addr;
-    mem_end = start_addr + size;
-    next_free = mem_start;
+#define HEAP_FREE   0   // Part of a free page run
+#define HEAP_SLAB   1   // Slab page holding objects of one size class
+#define HEAP_LARGE  2   // Page run backing one large allocation
+#define HEAP_META   3   // Descriptor array, never released
+#define HEAP_TRIM   4   // Free run waiting for a TLB shootdown in kmem_trim
+
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 11
+#define SLAB_MIN_SIZE (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE (1 << SLAB_MAX_SHIFT)
+#define NUM_SIZE_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+#define NUM_RUN_BINS 20
+
+#define KMEM_STAT_CPUS SMP_MAX_CPUS
+
+struct heap_page {
+    uint8_t type;
+    uint8_t size_class;         // Slab: index into size_classes
+    uint16_t inuse;             // Slab: objects handed out
+    uint16_t carved;            // Slab: objects ever handed out from this page
+    uint16_t dirty;             // Free run: some pages may still be backed
+    uint32_t npages;            // Free run / large allocation: length in pages
+    void* freelist;             // Slab: released objects
+    struct heap_page* next;     // Slab partial list or free run bin
+    struct heap_page* prev;
+};
+
+struct size_class {
+    struct heap_page* partial;  // Slabs with at least one free object
+    uint16_t size;
+    uint16_t per_slab;
+    uint32_t slabs;             // Slab pages held, full ones included
+};
+
+struct kmem_counters {
+    uint32_t allocs[KMEM_STAT_CLASSES];
+    uint32_t frees[KMEM_STAT_CLASSES];
+    uint32_t failures[KMEM_STAT_CLASSES];
+} __attribute__((aligned(64)));
+
+static uint32_t heap_base;      // First page of the heap (descriptors live here)
+static uint32_t heap_pages;     // Total pages in the heap, descriptors included
+static uint32_t heap_usable;    // Bytes available to callers
+static uint32_t bytes_in_use;   // Bytes handed out, rounded to class/page size
+static uint32_t peak_bytes;     // High-water mark of bytes_in_use
+static uint32_t large_pages;    // Pages held by large allocations
+static uint32_t dirty_pages;    // Pages in dirty free runs
+static struct heap_page* pages; // Descriptor array, one entry per heap page
+
+static struct size_class size_classes[NUM_SIZE_CLASSES];
+static struct heap_page* run_bins[NUM_RUN_BINS];
+static uint32_t run_bin_mask;   // Bit n set when run_bins[n] is non-empty
+static struct kmem_counters counters[KMEM_STAT_CPUS];
+static struct mcs_lock heap_lock = MCS_LOCK_INIT("heap");
+
+// Under heap_lock, so the CPU cannot change underneath
+static inline struct kmem_counters* local_counters(void) {
+    return &counters[cpu_index()];
+}
+
+static inline uint32_t fls32(uint32_t x) {
+    uint32_t r;
+    __asm__("bsr %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline uint32_t ffs32(uint32_t x) {
+    uint32_t r;
+    __asm__("bsf %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline uint32_t page_index(struct heap_page* pg) {
+    return pg - pages;
+}
+
+static inline void* page_address(struct heap_page* pg) {
+    return (void*)(heap_base + (page_index(pg) << PAGE_SHIFT));
+}
+
+static inline uint32_t run_bin(uint32_t npages) {
+    uint32_t bin = fls32(npages);
+    return bin < NUM_RUN_BINS ? bin : NUM_RUN_BINS - 1;
+}
+
+static void list_push(struct heap_page** head, struct heap_page* pg) {
+    pg->prev = NULL;
+    pg->next = *head;
+    if (*head) (*head)->prev = pg;
+    *head = pg;
+}
+
+static void list_remove(struct heap_page** head, struct heap_page* pg) {
+    if (pg->prev) pg->prev->next = pg->next;
+    else *head = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
+    pg->next = pg->prev = NULL;
+}
+
+// Mark first/last descriptors of a run and file it in its bin
+static void run_insert(struct heap_page* head, uint32_t npages, bool dirty) {
+    uint32_t bin = run_bin(npages);
+
+    head->type = HEAP_FREE;
+    head->npages = npages;
+    head->dirty = dirty;
+    if (dirty) dirty_pages += npages;
+    head[npages - 1].type = HEAP_FREE;
+    head[npages - 1].npages = npages;
+
+    list_push(&run_bins[bin], head);
+    run_bin_mask |= 1u << bin;
+}
+
+static void run_unlink(struct heap_page* head) {
+    uint32_t bin = run_bin(head->npages);
+
+    if (head->dirty) dirty_pages -= head->npages;
+
+    list_remove(&run_bins[bin], head);
+    if (!run_bins[bin]) run_bin_mask &= ~(1u << bin);
+}
+
+// Take a run of at least npages pages, splitting off any remainder
+static struct heap_page* run_alloc(uint32_t npages) {
+    uint32_t bin = run_bin(npages);
+    struct heap_page* run = NULL;
+
+    // Runs in the same bin may be too short unless npages is a power of two
+    for (struct heap_page* pg = run_bins[bin]; pg; pg = pg->next) {
+        if (pg->npages >= npages) {
+            run = pg;
+            break;
+        }
+    }
+
+    // Any run in a higher bin is large enough
+    if (!run) {
+        uint32_t mask = bin + 1 < 32 ? run_bin_mask >> (bin + 1) : 0;
+        if (!mask) return NULL;
+        run = run_bins[bin + 1 + ffs32(mask)];
+    }
+
+    run_unlink(run);
+    if (run->npages > npages) {
+        run_insert(run + npages, run->npages - npages, run->dirty);
+    }
+    run->npages = npages;
+    return run;
+}
+
+// Return a run to the free bins, merging with free neighbours. The
+// merged run is dirty if any part of it may be backed; pages that were
+// in use always are.
+static void run_free(struct heap_page* run, uint32_t npages, bool dirty) {
+    uint32_t idx = page_index(run);
+
+    uint32_t next = idx + npages;
+    if (next < heap_pages && pages[next].type == HEAP_FREE) {
+        npages += pages[next].npages;
+        dirty |= pages[next].dirty;
+        run_unlink(&pages[next]);
+    }
+
+    if (idx > 0 && pages[idx - 1].type == HEAP_FREE) {
+        struct heap_page* prev = &pages[idx - 1 - (pages[idx - 1].npages - 1)];
+        npages += prev->npages;
+        dirty |= prev->dirty;
+        run_unlink(prev);
+        run = prev;
+    }
+
+    run_insert(run, npages, dirty);
+}
+
+bool init_memory(uint32_t start_addr, uint32_t size) {
+    heap_base = (start_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    heap_pages = (start_addr + size - heap_base) >> PAGE_SHIFT;
+    pages = NULL;
+
+    // Nothing is backed up front; the page-fault handler supplies frames
+    if (!paging_add_demand_region(heap_base, heap_base + (heap_pages << PAGE_SHIFT),
+                                  PAGE_WRITE | PAGE_GLOBAL)) {
+        return false;
+    }
+    pages = (struct heap_page*)heap_base;
+
+    uint32_t meta_pages = (heap_pages * sizeof(struct heap_page) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    for (uint32_t i = 0; i < meta_pages; i++) {
+        pages[i].type = HEAP_META;
+    }
+
+    for (uint32_t i = 0; i < NUM_RUN_BINS; i++) {
+        run_bins[i] = NULL;
+    }
+    run_bin_mask = 0;
+
+    for (uint32_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        size_classes[i].partial = NULL;
+        size_classes[i].size = SLAB_MIN_SIZE << i;
+        size_classes[i].per_slab = PAGE_SIZE / size_classes[i].size;
+        size_classes[i].slabs = 0;
+    }
+
+    heap_usable = (heap_pages - meta_pages) << PAGE_SHIFT;
+    bytes_in_use = 0;
+    peak_bytes = 0;
+    large_pages = 0;
+    dirty_pages = 0;
+    if (heap_pages <= meta_pages) return false;
+
+    run_insert(&pages[meta_pages], heap_pages - meta_pages, false);
+    return true;
+}
+
+static void* slab_alloc(uint32_t cls) {
+    struct size_class* sc = &size_classes[cls];
+    struct heap_page* slab = sc->partial;
+
+    if (!slab) {
+        slab = run_alloc(1);
+        if (!slab) return NULL;
+        slab->type = HEAP_SLAB;
+        slab->size_class = cls;
+        slab->inuse = 0;
+        slab->carved = 0;
+        slab->freelist = NULL;
+        list_push(&sc->partial, slab);
+        sc->slabs++;
+    }
+
+    void* obj;
+    if (slab->freelist) {
+        obj = slab->freelist;
+        slab->freelist = *(void**)obj;
+    } else {
+        // Objects never handed out are carved lazily, keeping refill O(1)
+        obj = (uint8_t*)page_address(slab) + slab->carved * sc->size;
+        slab->carved++;
+    }
+    slab->inuse++;
+
+    if (!slab->freelist && slab->carved == sc->per_slab) {
+        list_remove(&sc->partial, slab);
+    }
+
+    bytes_in_use += sc->size;
+    return obj;
+}
+
+static void slab_free(struct heap_page* slab, void* ptr) {
+    struct size_class* sc = &size_classes[slab->size_class];
+    bool was_full = !slab->freelist && slab->carved == sc->per_slab;
+
+    *(void**)ptr = slab->freelist;
+    slab->freelist = ptr;
+    slab->inuse--;
+    bytes_in_use -= sc->size;
+
+    if (was_full) {
+        list_push(&sc->partial, slab);
+    }
+
+    // Keep one empty slab per class cached so alloc/free pairs don't thrash
+    if (slab->inuse == 0 && (slab->next || slab->prev)) {
+        list_remove(&sc->partial, slab);
+        run_free(slab, 1, true);
+        sc->slabs--;
+    }
+}
+
+static void* large_alloc(size_t size) {
+    uint32_t npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (npages == 0) return NULL;  // Size overflowed
+
+    // Pages are backed on first touch; refuse now rather than fault later
+    if (npages > pmm_free_count()) return NULL;
+
+    struct heap_page* run = run_alloc(npages);
+    if (!run) return NULL;
+
+    run->type = HEAP_LARGE;
+    run[npages - 1].type = HEAP_LARGE;
+    bytes_in_use += npages << PAGE_SHIFT;
+    large_pages += npages;
+    return page_address(run);
 }
 
 void* kmalloc(size_t size) {
-    // Align size to 4 bytes
-    size = (size + 3) & ~3;
-    
-    // Check if we have enough memory
-    if (next_free + size > mem_end) {
-        return NULL;
+    if (size == 0 || !pages) return NULL;
+
+    uint32_t cls;
+    void* ptr;
+    struct mcs_node node;
+    uint32_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    if (size <= SLAB_MAX_SIZE) {
+        cls = size <= SLAB_MIN_SIZE ? 0 : fls32(size - 1) + 1 - SLAB_MIN_SHIFT;
+        ptr = slab_alloc(cls);
+    } else {
+        cls = KMEM_STAT_LARGE;
+        ptr = large_alloc(size);
     }
 
-    void* allocated = (void*)next_free;
-    next_free += size;
-    return allocated;
+    struct kmem_counters* stats = local_counters();
+    if (!ptr) {
+        stats->failures[cls]++;
+    } else {
+        stats->allocs[cls]++;
+        if (bytes_in_use > peak_bytes) peak_bytes = bytes_in_use;
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+    return ptr;
 }
 
 void kfree(void* ptr) {
-    // Simple bump allocator doesn't support freeing
-    // This will be implemented later with a more sophisticated allocator
-    (void)ptr;
+    uint32_t addr = (uint32_t)ptr;
+    if (!ptr || addr < heap_base) return;
+
+    uint32_t idx = (addr - heap_base) >> PAGE_SHIFT;
+    if (idx >= heap_pages) return;
+
+    struct mcs_node node;
+    uint32_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    struct heap_page* pg = &pages[idx];
+    if (pg->type == HEAP_SLAB) {
+        local_counters()->frees[pg->size_class]++;
+        slab_free(pg, ptr);
+    } else if (pg->type == HEAP_LARGE && (addr & (PAGE_SIZE - 1)) == 0) {
+        uint32_t npages = pg->npages;
+        local_counters()->frees[KMEM_STAT_LARGE]++;
+        bytes_in_use -= npages << PAGE_SHIFT;
+        large_pages -= npages;
+        run_free(pg, npages, true);
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+}
+
+// Back free heap pages with frames ahead of use, so a burst of
+// allocations does not take a page fault per page
+bool kmem_grow(uint32_t size) {
+    uint32_t want = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    bool ok = true;
+
+    struct mcs_node node;
+    uint32_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    for (uint32_t bin = 0; bin < NUM_RUN_BINS && want && ok; bin++) {
+        for (struct heap_page* run = run_bins[bin]; run && want && ok; run = run->next) {
+            uint32_t virt = (uint32_t)page_address(run);
+
+            if (!run->dirty) {
+                run->dirty = true;
+                dirty_pages += run->npages;
+            }
+            for (uint32_t i = 0; i < run->npages && want; i++, virt += PAGE_SIZE) {
+                if (paging_translate(virt)) continue;
+
+                uint32_t frame = pmm_alloc_page();
+                if (!frame) {
+                    ok = false;
+                    break;
+                }
+                if (!paging_map(virt, frame, PAGE_SIZE, PAGE_WRITE | PAGE_GLOBAL | PAGING_MAP_4K)) {
+                    pmm_free_page(frame);
+                    ok = false;
+                    break;
+                }
+                want--;
+            }
+        }
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+    return ok && want == 0;
+}
+
+// Release cached empty slabs and the frames behind every free page.
+//
+// Dirty runs leave the bins while their pages are unmapped, and only
+// come back after smp_flush_tlb(), which needs the lock dropped. Their
+// frames can go back to the PMM at once: nothing uses a free page, so a
+// stale TLB entry for one is never followed.
+uint32_t kmem_trim(void) {
+    uint32_t released = 0;
+    struct heap_page* trimmed = NULL;
+
+    struct mcs_node node;
+    uint32_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    for (uint32_t cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        struct heap_page* slab = size_classes[cls].partial;
+        while (slab) {
+            struct heap_page* next = slab->next;
+            if (slab->inuse == 0) {
+                list_remove(&size_classes[cls].partial, slab);
+                run_free(slab, 1, true);
+                size_classes[cls].slabs--;
+            }
+            slab = next;
+        }
+    }
+
+    for (uint32_t bin = 0; bin < NUM_RUN_BINS; bin++) {
+        struct heap_page* run = run_bins[bin];
+        while (run) {
+            struct heap_page* next = run->next;
+            if (run->dirty) {
+                // Not HEAP_FREE, so a neighbour freed meanwhile does not merge with it
+                run_unlink(run);
+                run->type = HEAP_TRIM;
+                run[run->npages - 1].type = HEAP_TRIM;
+                list_push(&trimmed, run);
+
+                uint32_t virt = (uint32_t)page_address(run);
+                for (uint32_t i = 0; i < run->npages; i++, virt += PAGE_SIZE) {
+                    uint32_t frame = paging_unmap_page(virt);
+                    if (frame) {
+                        pmm_free_page(frame);
+                        released++;
+                    }
+                }
+            }
+            run = next;
+        }
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+
+    if (!trimmed) return 0;
+    if (released) smp_flush_tlb();
+
+    flags = mcs_lock_irqsave(&heap_lock, &node);
+    while (trimmed) {
+        struct heap_page* run = trimmed;
+        list_remove(&trimmed, run);
+        run_free(run, run->npages, false);
+    }
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+    return released;
+}
+
+// Cheap enough to call on every pass of the idle loop
+void kmem_idle_trim(void) {
+    if (dirty_pages >= KMEM_TRIM_THRESHOLD) {
+        kmem_trim();
+    }
 }
 
 uint32_t get_free_memory(void) {
-    return mem_end - next_free;
-}
\ No newline at end of file
+    uint32_t free = heap_usable - bytes_in_use;
+    uint32_t frames = pmm_free_count() << PAGE_SHIFT;
+    return free < frames ? free : frames;
+}
+
+void kmem_get_stats(struct kmem_stats* stats) {
+    struct mcs_node node;
+    uint32_t flags = mcs_lock_irqsave(&heap_lock, &node);
+    for (uint32_t cls = 0; cls < KMEM_STAT_CLASSES; cls++) {
+        struct kmem_class_stats* out = &stats->classes[cls];
+
+        out->allocs = out->frees = out->failures = 0;
+        for (uint32_t cpu = 0; cpu < KMEM_STAT_CPUS; cpu++) {
+            out->allocs += counters[cpu].allocs[cls];
+            out->frees += counters[cpu].frees[cls];
+            out->failures += counters[cpu].failures[cls];
+        }
+        if (cls == KMEM_STAT_LARGE) {
+            out->size = 0;
+            out->pages = large_pages;
+        } else {
+            out->size = size_classes[cls].size;
+            out->pages = size_classes[cls].slabs;
+        }
+    }
+
+    stats->failures = 0;
+    for (uint32_t cls = 0; cls < KMEM_STAT_CLASSES; cls++) {
+        stats->failures += stats->classes[cls].failures;
+    }
+
+    stats->free_pages = 0;
+    stats->free_runs = 0;
+    stats->largest_free_run = 0;
+    for (uint32_t bin = 0; bin < NUM_RUN_BINS; bin++) {
+        for (struct heap_page* run = run_bins[bin]; run; run = run->next) {
+            stats->free_pages += run->npages;
+            stats->free_runs++;
+            if (run->npages > stats->largest_free_run) {
+                stats->largest_free_run = run->npages;
+            }
+        }
+    }
+
+    // External fragmentation: share of free pages that a single large
+    // allocation could not use
+    stats->fragmentation = 0;
+    if (stats->free_pages) {
+        uint32_t outside = stats->free_pages - stats->largest_free_run;
+        // A 256 MB heap has at most 64K pages, so this cannot overflow
+        stats->fragmentation = outside * 100 / stats->free_pages;
+    }
+
+    stats->heap_bytes = heap_usable;
+    stats->bytes_in_use = bytes_in_use;
+    stats->peak_bytes = peak_bytes;
+    stats->dirty_pages = dirty_pages;
+    mcs_unlock_irqrestore(&heap_lock, &node, flags);
+}
+
+void kmem_dump_stats(void) {
+    struct kmem_stats stats;
+    kmem_get_stats(&stats);
+
+    kprintf("heap: %u KB in use, peak %u KB, of %u KB; %u failed\n",
+            stats.bytes_in_use >> 10, stats.peak_bytes >> 10,
+            stats.heap_bytes >> 10, stats.failures);
+    kprintf("heap: %u free pages in %u runs, largest %u, fragmentation %u%%, %u dirty\n",
+            stats.free_pages, stats.free_runs, stats.largest_free_run,
+            stats.fragmentation, stats.dirty_pages);
+    kprintf("   class     allocs      frees     live  fail  pages\n");
+    for (uint32_t cls = 0; cls < KMEM_STAT_CLASSES; cls++) {
+        struct kmem_class_stats* c = &stats.classes[cls];
+        if (cls == KMEM_STAT_LARGE) {
+            kprintf("   large");
+        } else {
+            kprintf("  %4u B", c->size);
+        }
+        kprintf(" %10u %10u %8u %5u %6u\n", c->allocs, c->frees,
+                c->allocs - c->frees, c->failures, c->pages);
+    }
+}
@@ -3,11 +3,54 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#define PAGE_SIZE  4096
+#define PAGE_SHIFT 12
+
+// Dirty free pages tolerated before the idle loop trims the heap
+#define KMEM_TRIM_THRESHOLD 256
+
+// Allocator statistics: one entry per slab size class (16 B - 2 KB),
+// then one for allocations served as whole page runs
+#define KMEM_STAT_CLASSES 9
+#define KMEM_STAT_LARGE   (KMEM_STAT_CLASSES - 1)
+
+struct kmem_class_stats {
+    uint32_t size;              // Object size, 0 for page runs
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+    uint32_t pages;             // Heap pages held by the class
+};
+
+struct kmem_stats {
+    struct kmem_class_stats classes[KMEM_STAT_CLASSES];
+    uint32_t heap_bytes;        // Usable heap size
+    uint32_t bytes_in_use;      // Rounded up to class or page size
+    uint32_t peak_bytes;        // High-water mark of bytes_in_use
+    uint32_t failures;          // All classes
+    uint32_t free_pages;        // Pages in free runs
+    uint32_t free_runs;
+    uint32_t largest_free_run;  // Pages
+    uint32_t fragmentation;     // Percent of free pages outside the largest run
+    uint32_t dirty_pages;       // Free pages that may still hold frames
+};
 
 // Memory management function declarations
-void init_memory(uint32_t start_addr, uint32_t size);
-void* kmalloc(size_t size);
-void kfree(void* ptr);  // For future implementation
+bool init_memory(uint32_t start_addr, uint32_t size);  // Reserves virtual space only
+void* kmalloc(size_t size);     // Up to 2 KB from size-class slabs, larger from whole pages
+void kfree(void* ptr);
 uint32_t get_free_memory(void);
 
-#endif // MEMORY_H
\ No newline at end of file
+bool kmem_grow(uint32_t size);  // Pre-back free heap pages with frames
+uint32_t kmem_trim(void);       // Return frames behind free pages, returns count
+void kmem_idle_trim(void);      // kmem_trim() past a threshold
+
+// kmem_trim() shoots down every CPU's TLB: call both with interrupts on
+// and no spinlock held
+
+void kmem_get_stats(struct kmem_stats* stats);
+void kmem_dump_stats(void);     // Print stats with kprintf
+
+#endif // MEMORY_H
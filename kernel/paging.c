@@ -0,0 +1,278 @@
+#include "paging.h"
+#include "pmm.h"
+#include "memory.h"
+#include "isr.h"
+#include "cpu.h"
+#include "console.h"
+#include "vmm.h"
+#include "spinlock.h"
+#include <string.h>
+
+// Two-level i386 paging with a single kernel page directory.
+//
+// RAM is identity mapped with 4 MB PSE pages so the whole direct map
+// costs a handful of TLB entries. Only the first 4 MB uses a 4 KB page
+// table, which keeps the null page unmapped. Page tables come from the
+// PMM and are reached through the direct map.
+//
+// Address spaces copy the kernel PDEs when they are created. Kernel page
+// tables added later are copied into the running page directory by the
+// fault handler the first time it touches them.
+//
+// paging_lock serialises changes to the kernel tables; it nests inside
+// the heap lock and outside the PMM's. Changes only invalidate this
+// CPU's TLB. Whoever removes or narrows a mapping another CPU may hold
+// follows up with smp_flush_tlb().
+
+#define PD_INDEX(v) ((v) >> LARGE_PAGE_SHIFT)
+#define PT_INDEX(v) (((v) >> PAGE_SHIFT) & 0x3FF)
+
+#define MAX_DEMAND_REGIONS 8
+
+struct demand_region {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+};
+
+static uint32_t kernel_pd[1024] __attribute__((aligned(PAGE_SIZE)));
+static bool pse_enabled;
+static uint32_t global_flag;    // PAGE_GLOBAL when the CPU supports PGE
+
+static struct demand_region demand_regions[MAX_DEMAND_REGIONS];
+static uint32_t demand_region_count;
+static struct spinlock paging_lock = SPINLOCK_INIT("paging");
+
+static void zero_frame(uint32_t phys) {
+    memset((void*)phys, 0, PAGE_SIZE);
+}
+
+// Page table covering virt, allocated if missing. NULL if virt is
+// covered by a 4 MB page or no frame is available.
+static uint32_t* get_page_table(uint32_t* pd, uint32_t virt, uint32_t flags, bool create) {
+    uint32_t* pde = &pd[PD_INDEX(virt)];
+
+    if (*pde & PAGE_PRESENT) {
+        if (*pde & PAGE_LARGE) return NULL;
+        return (uint32_t*)(*pde & PAGE_FRAME_MASK);
+    }
+    if (!create) return NULL;
+
+    uint32_t pt = pmm_alloc_page();
+    if (!pt) return NULL;
+    zero_frame(pt);
+
+    *pde = pt | PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+    return (uint32_t*)pt;
+}
+
+static bool map_pages(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags) {
+    bool allow_large = pse_enabled && !(flags & PAGING_MAP_4K);
+    flags = (flags & PAGE_FLAGS_MASK) | PAGE_PRESENT;
+
+    while (size >= PAGE_SIZE) {
+        uint32_t* pde = &kernel_pd[PD_INDEX(virt)];
+
+        if (allow_large && size >= LARGE_PAGE_SIZE &&
+            !((virt | phys) & (LARGE_PAGE_SIZE - 1)) &&
+            (!(*pde & PAGE_PRESENT) || (*pde & PAGE_LARGE))) {
+            *pde = phys | flags | PAGE_LARGE;
+            invlpg(virt);
+            virt += LARGE_PAGE_SIZE;
+            phys += LARGE_PAGE_SIZE;
+            size -= LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pt = get_page_table(kernel_pd, virt, flags, true);
+        if (!pt) return false;
+
+        pt[PT_INDEX(virt)] = phys | flags;
+        invlpg(virt);
+        virt += PAGE_SIZE;
+        phys += PAGE_SIZE;
+        size -= PAGE_SIZE;
+    }
+    return true;
+}
+
+bool paging_map(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags) {
+    uint32_t irq = spin_lock_irqsave(&paging_lock);
+    bool ok = map_pages(virt, phys, size, flags);
+    spin_unlock_irqrestore(&paging_lock, irq);
+    return ok;
+}
+
+void paging_unmap(uint32_t virt, uint32_t size) {
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    while (size >= PAGE_SIZE) {
+        uint32_t* pde = &kernel_pd[PD_INDEX(virt)];
+
+        if ((*pde & PAGE_LARGE) && !(virt & (LARGE_PAGE_SIZE - 1)) && size >= LARGE_PAGE_SIZE) {
+            *pde = 0;
+            invlpg(virt);
+            virt += LARGE_PAGE_SIZE;
+            size -= LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        uint32_t* pt = get_page_table(kernel_pd, virt, 0, false);
+        if (pt) {
+            pt[PT_INDEX(virt)] = 0;
+            invlpg(virt);
+        }
+        virt += PAGE_SIZE;
+        size -= PAGE_SIZE;
+    }
+    spin_unlock_irqrestore(&paging_lock, flags);
+}
+
+uint32_t paging_unmap_page(uint32_t virt) {
+    uint32_t flags = spin_lock_irqsave(&paging_lock);
+    uint32_t* pt = get_page_table(kernel_pd, virt, 0, false);
+    uint32_t pte = pt ? pt[PT_INDEX(virt)] : 0;
+
+    if (pte & PAGE_PRESENT) {
+        pt[PT_INDEX(virt)] = 0;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&paging_lock, flags);
+    return (pte & PAGE_PRESENT) ? pte & PAGE_FRAME_MASK : 0;
+}
+
+uint32_t paging_translate(uint32_t virt) {
+    uint32_t pde = kernel_pd[PD_INDEX(virt)];
+
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_LARGE) {
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+
+    uint32_t pte = ((uint32_t*)(pde & PAGE_FRAME_MASK))[PT_INDEX(virt)];
+    if (!(pte & PAGE_PRESENT)) return 0;
+    return (pte & PAGE_FRAME_MASK) | (virt & (PAGE_SIZE - 1));
+}
+
+bool paging_add_demand_region(uint32_t start, uint32_t end, uint32_t flags) {
+    if (demand_region_count == MAX_DEMAND_REGIONS || start >= end) return false;
+    if (start < KERNEL_DIRECT_MAP_END) return false;
+
+    demand_regions[demand_region_count].start = start & PAGE_FRAME_MASK;
+    demand_regions[demand_region_count].end = end;
+    demand_regions[demand_region_count].flags = flags | PAGE_WRITE;
+    demand_region_count++;
+    return true;
+}
+
+// Back a not-present page in a demand region with a zeroed frame. Two
+// CPUs can fault on the same page; the second finds it mapped.
+static bool handle_demand_fault(uint32_t addr) {
+    for (uint32_t i = 0; i < demand_region_count; i++) {
+        struct demand_region* region = &demand_regions[i];
+        if (addr < region->start || addr >= region->end) continue;
+
+        uint32_t frame = pmm_alloc_page();
+        if (!frame) return false;
+        zero_frame(frame);
+
+        uint32_t flags = spin_lock_irqsave(&paging_lock);
+        bool mapped = paging_translate(addr) != 0;
+        bool ok = mapped || map_pages(addr & PAGE_FRAME_MASK, frame, PAGE_SIZE,
+                                      region->flags | PAGING_MAP_4K);
+        spin_unlock_irqrestore(&paging_lock, flags);
+
+        if (mapped || !ok) pmm_free_page(frame);
+        return ok;
+    }
+    return false;
+}
+
+void* paging_map_mmio(uint32_t phys, uint32_t size) {
+    uint32_t start = phys & PAGE_FRAME_MASK;
+    uint32_t end = (phys + size + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+
+    if (start < KERNEL_MMIO_BASE || (end != 0 && end <= start)) return NULL;
+    if (!paging_map(start, start, end - start,
+                    PAGE_WRITE | PAGE_PCD | PAGE_PWT | global_flag | PAGING_MAP_4K)) {
+        return NULL;
+    }
+    return (void*)phys;
+}
+
+uint32_t* paging_kernel_pd(void) {
+    return kernel_pd;
+}
+
+uint32_t* paging_pte(uint32_t* pd, uint32_t virt, bool create) {
+    uint32_t* pt = get_page_table(pd, virt, PAGE_USER, create);
+    return pt ? &pt[PT_INDEX(virt)] : NULL;
+}
+
+// Copy a kernel PDE created after the running address space was
+static bool sync_kernel_pde(uint32_t addr) {
+    uint32_t* pd = (uint32_t*)read_cr3();
+    uint32_t index = PD_INDEX(addr);
+
+    if (pd == kernel_pd || pd[index] == kernel_pd[index]) return false;
+    if (!(kernel_pd[index] & PAGE_PRESENT)) return false;
+    pd[index] = kernel_pd[index];
+    return true;
+}
+
+static void page_fault_handler(registers_t* regs) {
+    uint32_t addr = read_cr2();
+
+    if (addr >= USER_BASE && addr < USER_END) {
+        if (vmm_handle_fault(addr, regs->err_code)) return;
+    } else {
+        if (sync_kernel_pde(addr)) return;
+        if (!(regs->err_code & PF_PRESENT) && handle_demand_fault(addr)) return;
+    }
+
+    panic("Page fault at %p (%s, %s%s), eip %p",
+          addr,
+          (regs->err_code & PF_PRESENT) ? "protection" : "not present",
+          (regs->err_code & PF_WRITE) ? "write" : "read",
+          (regs->err_code & PF_USER) ? ", user" : "",
+          regs->eip);
+}
+
+bool paging_pse_enabled(void) {
+    return pse_enabled;
+}
+
+bool init_paging(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    pse_enabled = edx & CPUID_EDX_PSE;
+    global_flag = (edx & CPUID_EDX_PGE) ? PAGE_GLOBAL : 0;
+
+    for (int i = 0; i < 1024; i++) {
+        kernel_pd[i] = 0;
+    }
+
+    uint32_t direct_end = (pmm_max_address() + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (direct_end > KERNEL_DIRECT_MAP_END) direct_end = KERNEL_DIRECT_MAP_END;
+
+    // First 4 MB in 4 KB pages, leaving the null page unmapped
+    if (!paging_map(PAGE_SIZE, PAGE_SIZE, LARGE_PAGE_SIZE - PAGE_SIZE,
+                    PAGE_WRITE | global_flag | PAGING_MAP_4K)) {
+        return false;
+    }
+    if (direct_end > LARGE_PAGE_SIZE &&
+        !paging_map(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE, direct_end - LARGE_PAGE_SIZE,
+                    PAGE_WRITE | global_flag)) {
+        return false;
+    }
+
+    register_interrupt_handler(14, page_fault_handler);
+
+    uint32_t cr4 = read_cr4();
+    if (pse_enabled) cr4 |= CR4_PSE;
+    if (global_flag) cr4 |= CR4_PGE;
+    write_cr4(cr4);
+
+    write_cr3((uint32_t)kernel_pd);
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);
+    return true;
+}
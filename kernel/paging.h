@@ -0,0 +1,65 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Page directory / page table entry bits
+#define PAGE_PRESENT    0x001
+#define PAGE_WRITE      0x002
+#define PAGE_USER       0x004
+#define PAGE_PWT        0x008
+#define PAGE_PCD        0x010   // Cache disable, for MMIO
+#define PAGE_ACCESSED   0x020
+#define PAGE_DIRTY      0x040
+#define PAGE_LARGE      0x080   // PDE maps a 4 MB page
+#define PAGE_GLOBAL     0x100
+#define PAGE_COW        0x200   // Software: read-only until copied on write
+#define PAGE_FLAGS_MASK 0xFFF
+#define PAGE_FRAME_MASK 0xFFFFF000
+
+#define LARGE_PAGE_SIZE  0x400000
+#define LARGE_PAGE_SHIFT 22
+
+// paging_map() flag: use 4 KB pages even where a 4 MB page would fit
+#define PAGING_MAP_4K   0x80000000
+
+// Page-fault error code bits
+#define PF_PRESENT      0x01    // Protection violation (clear: not-present page)
+#define PF_WRITE        0x02
+#define PF_USER         0x04
+
+// Kernel virtual layout. RAM below KERNEL_DIRECT_MAP_END is identity
+// mapped; the regions above it are mapped on demand. Each address space
+// has its own page tables for [USER_BASE, USER_END) and shares the rest.
+#define KERNEL_DIRECT_MAP_END   0x40000000
+#define USER_BASE               0x40000000
+#define USER_END                0xC0000000
+#define KERNEL_HEAP_BASE        0xD0000000  // Demand-paged kmalloc heap
+#define KERNEL_HEAP_SIZE        0x10000000
+#define KERNEL_VMAP_BASE        0xE0000000  // Scratch mappings
+#define KERNEL_VMAP_END         0xF0000000
+#define KERNEL_MMIO_BASE        0xF0000000  // Device registers, identity mapped
+
+bool init_paging(void);
+bool paging_pse_enabled(void);
+
+// Map [virt, virt + size) to [phys, phys + size). Uses 4 MB pages where
+// both addresses and the remaining size are 4 MB aligned.
+bool paging_map(uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags);
+void paging_unmap(uint32_t virt, uint32_t size);
+uint32_t paging_unmap_page(uint32_t virt);      // Returns the frame that was mapped, or 0
+uint32_t paging_translate(uint32_t virt);      // Physical address, 0 if unmapped
+
+// Pages in [start, end) are backed by a zeroed frame on first access
+bool paging_add_demand_region(uint32_t start, uint32_t end, uint32_t flags);
+
+// Identity map device registers at or above KERNEL_MMIO_BASE, uncached.
+// Returns the virtual address, NULL if phys is outside the MMIO window.
+void* paging_map_mmio(uint32_t phys, uint32_t size);
+
+// Page tables of other address spaces
+uint32_t* paging_kernel_pd(void);
+uint32_t* paging_pte(uint32_t* pd, uint32_t virt, bool create);   // NULL if no table
+
+#endif // PAGING_H
@@ -0,0 +1,69 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gdt.h"
+#include "acpi.h"
+
+// Per-CPU data. Every CPU's GDT has a GDT_PERCPU descriptor whose base is
+// that CPU's struct percpu, and GS holds it in ring 0, so this_cpu_*()
+// on a field is a single GS-relative instruction: no CPU number lookup,
+// and an increment cannot be split by an interrupt. GS:0 holds the
+// block's own address for code that needs a pointer.
+//
+// The this_cpu_*() accessors take 32-bit fields only.
+
+#define SMP_MAX_CPUS ACPI_MAX_CPUS
+
+struct thread;
+struct isr_profile;
+
+// Offset of isr_entry_tsc, for the entry stubs in isr.asm
+#define PERCPU_ISR_ENTRY_TSC 32
+
+struct percpu {
+    struct percpu* self;
+    uint32_t index;                 // 0 is the boot CPU
+    uint32_t apic_id;
+    volatile uint32_t online;
+    struct thread* volatile current;
+    volatile uint32_t preempt_count;
+    volatile uint32_t need_resched;
+    volatile uint32_t irq_depth;    // IRQs being handled, with the deferred work run on their way out
+    uint32_t isr_entry_tsc[2];      // ISR_PROFILE: TSC stamped by the entry stubs, low word first
+    struct isr_profile* isr_profiles;   // ISR_PROFILE: ISR_PROFILE_VECTORS histograms
+    volatile uint32_t irq_off_max;  // IRQ_OFF_TIMING: longest irq_handler run with interrupts off
+    struct gdt_entry gdt[GDT_ENTRIES];
+    struct gdt_ptr gdt_ptr;
+    struct tss tss;
+} __attribute__((aligned(64)));
+
+extern struct percpu percpu[SMP_MAX_CPUS];
+
+#define PERCPU_OFFSET(field) __builtin_offsetof(struct percpu, field)
+
+#define this_cpu_read(field) ({                                              \
+    uint32_t v_;                                                             \
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(v_) : "i"(PERCPU_OFFSET(field)) : "memory"); \
+    v_;                                                                      \
+})
+
+#define this_cpu_write(field, val)                                           \
+    __asm__ volatile("movl %0, %%gs:%c1" : : "ri"((uint32_t)(val)), "i"(PERCPU_OFFSET(field)) : "memory")
+
+#define this_cpu_inc(field)                                                  \
+    __asm__ volatile("incl %%gs:%c0" : : "i"(PERCPU_OFFSET(field)) : "memory", "cc")
+
+#define this_cpu_dec(field)                                                  \
+    __asm__ volatile("decl %%gs:%c0" : : "i"(PERCPU_OFFSET(field)) : "memory", "cc")
+
+static inline struct percpu* this_cpu(void) {
+    return (struct percpu*)this_cpu_read(self);
+}
+
+static inline uint32_t cpu_index(void) {
+    return this_cpu_read(index);
+}
+
+#endif // PERCPU_H
@@ -19,29 +19,22 @@
 #define PIC_READ_IRR    0x0a
 #define PIC_READ_ISR    0x0b
 
-static uint16_t pic_get_irr(void) {
+// OCW3 read selection is sticky. Both PICs are left returning the ISR,
+// which the IRQ7/IRQ15 stubs rely on to filter spurious interrupts.
+uint16_t pic_get_irr(void) {
     outb(PIC1_COMMAND, PIC_READ_IRR);
     outb(PIC2_COMMAND, PIC_READ_IRR);
-    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
-}
-
-static uint16_t pic_get_isr(void) {
+    uint16_t irr = (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
     outb(PIC1_COMMAND, PIC_READ_ISR);
     outb(PIC2_COMMAND, PIC_READ_ISR);
-    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+    return irr;
 }
 
-static void io_wait(void) {
-    outb(0x80, 0); // Write to an unused port
+uint16_t pic_get_isr(void) {
+    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
 }
 
 bool pic_init(void) {
-    uint8_t a1, a2;
- 
-    // Save masks
-    a1 = inb(PIC1_DATA);
-    a2 = inb(PIC2_DATA);
- 
     // Start initialization sequence
     outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
     io_wait();
@@ -66,9 +59,13 @@ bool pic_init(void) {
     outb(PIC2_DATA, ICW4_8086);
     io_wait();
  
-    // Restore saved masks
-    outb(PIC1_DATA, a1);
-    outb(PIC2_DATA, a2);
+    // Mask every line but the cascade; drivers unmask their own IRQ
+    outb(PIC1_DATA, 0xFF & ~(1 << PIC_CASCADE_IRQ));
+    outb(PIC2_DATA, 0xFF);
+
+    // Command port reads return the in-service register from now on
+    outb(PIC1_COMMAND, PIC_READ_ISR);
+    outb(PIC2_COMMAND, PIC_READ_ISR);
     
     return true;
 }
@@ -77,13 +74,13 @@ void pic_send_eoi(unsigned char irq) {
     // Ensure IRQ number is valid
     if (irq > 15) return;
     
-    // Send EOI to slave PIC if this is a slave interrupt
+    // Slave first: the master's cascade line stays in service until then
     if (irq >= 8) {
-        outb(PIC2_COMMAND, 0x20);
+        outb(PIC2_COMMAND, PIC_EOI);
     }
     
     // Always send EOI to master PIC
-    outb(PIC1_COMMAND, 0x20);
+    outb(PIC1_COMMAND, PIC_EOI);
 }
 
 void pic_set_mask(unsigned char irq) {
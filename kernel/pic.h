@@ -10,11 +10,16 @@
 #define PIC2_COMMAND 0xA0
 #define PIC2_DATA    0xA1
 
+#define PIC_EOI         0x20
+#define PIC_CASCADE_IRQ 2
+
 // Function declarations
 bool pic_init(void);
 void pic_send_eoi(unsigned char irq);
 void pic_set_mask(unsigned char irq);    // Mask (disable) an IRQ line
 void pic_clear_mask(unsigned char irq);  // Unmask (enable) an IRQ line
 void pic_disable(void);
+uint16_t pic_get_irr(void);     // Lines requesting service, slave in the high byte
+uint16_t pic_get_isr(void);     // Lines in service
 
 #endif /* PIC_H */
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "pit.h"
+#include "port_io.h"
+#include <div64.h>
+
+#define PIT_CHANNEL0    0x40
+#define PIT_CHANNEL2    0x42
+#define PIT_COMMAND     0x43
+#define PIT_GATE_PORT   0x61
+
+#define PIT_CH2_GATE    0x01
+#define PIT_SPEAKER     0x02
+#define PIT_CH2_OUT     0x20
+
+#define PIT_CMD_CH2_ONESHOT 0xB0    // Channel 2, lo/hi byte, mode 0, binary
+#define PIT_CMD_CH0_ONESHOT 0x30    // Channel 0, lo/hi byte, mode 0, binary
+#define PIT_CMD_CH0_RATE    0x34    // Channel 0, lo/hi byte, mode 2, binary
+
+// Counter reload for us, in 1..0xFFFF
+static uint32_t pit_count(uint32_t us) {
+    uint64_t ticks = (uint64_t)PIT_FREQUENCY * us;
+    div64_u32(&ticks, 1000000);
+
+    uint32_t count = ticks > 0xFFFF ? 0xFFFF : (uint32_t)ticks;
+    return count ? count : 1;
+}
+
+uint32_t pit_oneshot_start(uint32_t us) {
+    uint32_t count = pit_count(us);
+
+    // Gate low while programming, speaker off
+    uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_CH2_GATE | PIT_SPEAKER);
+    outb(PIT_GATE_PORT, gate);
+
+    outb(PIT_COMMAND, PIT_CMD_CH2_ONESHOT);
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    // Rising gate starts the count; OUT goes high at terminal count
+    outb(PIT_GATE_PORT, gate | PIT_CH2_GATE);
+    return count;
+}
+
+bool pit_oneshot_done(void) {
+    return inb(PIT_GATE_PORT) & PIT_CH2_OUT;
+}
+
+static void pit_load_ch0(uint8_t command, uint32_t count) {
+    outb(PIT_COMMAND, command);
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, count >> 8);
+}
+
+uint32_t pit_tick_periodic(uint32_t hz) {
+    if (!hz) return 0;
+    uint32_t count = PIT_FREQUENCY / hz;
+    if (count > 0xFFFF) count = 0xFFFF;
+    if (count < 2) count = 2;   // Mode 2 does not accept 1
+    pit_load_ch0(PIT_CMD_CH0_RATE, count);
+    return count;
+}
+
+void pit_tick_oneshot(uint32_t us) {
+    pit_load_ch0(PIT_CMD_CH0_ONESHOT, pit_count(us));
+}
+
+void pit_tick_stop(void) {
+    // Mode 0 with no count loaded never reaches terminal count
+    outb(PIT_COMMAND, PIT_CMD_CH0_ONESHOT);
+}
@@ -0,0 +1,26 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// 8254 programmable interval timer
+#define PIT_FREQUENCY 1193182
+
+#define PIT_IRQ       0
+#define PIT_MAX_US    54925     // Longest count, 65536 ticks
+
+// Channel 2 one-shot, polled through port 0x61, used to calibrate other
+// clocks without taking an interrupt. At most PIT_MAX_US; returns the
+// number of PIT ticks actually programmed.
+uint32_t pit_oneshot_start(uint32_t us);
+bool pit_oneshot_done(void);
+
+// Channel 0, wired to IRQ0: a periodic rate of hz, or a single interrupt
+// after us (clamped to PIT_MAX_US). The periodic rate is rounded to a
+// whole count of PIT ticks, which pit_tick_periodic() returns.
+uint32_t pit_tick_periodic(uint32_t hz);
+void pit_tick_oneshot(uint32_t us);
+void pit_tick_stop(void);
+
+#endif // PIT_H
@@ -0,0 +1,346 @@
+#include "pmm.h"
+#include "memory.h"
+#include "spinlock.h"
+#include <string.h>
+
+// Physical page-frame allocator: binary buddy system over the usable
+// frames reported by the BIOS E820 map.
+//
+// Free blocks are linked through a small header stored in their first
+// frame, one list per order, so allocation and free never scan memory.
+// A bitmap with one bit per frame (set = free) lets the free path check
+// a buddy in O(1), and order_mask summarises which orders have free
+// blocks so an allocation finds its block with a single bit scan.
+//
+// Frames mapped into more than one address space carry a share count
+// next to the bitmap. It counts references beyond the first, so a fresh
+// frame needs no setup and an unshared one is freed by its only user.
+//
+// pmm_lock covers the lists, the bitmap and the share counts. It is the
+// innermost lock: the heap and paging call in here holding theirs. A
+// ticket lock, so a CPU taking demand faults in a loop cannot starve the
+// others.
+
+#define LOW_MEMORY_END 0x100000     // BIOS area, kernel image and boot stack
+#define FREE_BLOCK_MAGIC 0x46524545
+
+struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+    uint32_t order;
+    uint32_t magic;
+};
+
+static struct e820_map boot_map;    // Copy of the map, the null page is unmapped later
+static struct e820_map* memory_map;
+static uint32_t* free_bitmap;       // One bit per frame, set when free
+static uint16_t* frame_shares;      // Extra references per frame
+static uint32_t max_pfn;            // One past the highest managed frame
+static uint32_t total_frames;
+static uint32_t free_frames;
+
+static struct free_block* free_lists[PMM_MAX_ORDER + 1];
+static uint32_t free_block_counts[PMM_MAX_ORDER + 1];
+static uint32_t order_mask;         // Bit n set when free_lists[n] is non-empty
+static struct ticket_lock pmm_lock = TICKET_LOCK_INIT("pmm");
+
+// Used when the BIOS does not support E820: the range the kernel heap
+// was hard-coded to before the memory map existed
+static struct e820_map fallback_map = {
+    .count = 1,
+    .entries = { { LOW_MEMORY_END, 0x400000, E820_USABLE, 1 } },
+};
+
+static inline uint32_t ffs32(uint32_t x) {
+    uint32_t r;
+    __asm__("bsf %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline uint32_t fls32(uint32_t x) {
+    uint32_t r;
+    __asm__("bsr %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline bool frame_free(uint32_t pfn) {
+    return free_bitmap[pfn >> 5] & (1u << (pfn & 31));
+}
+
+// Set or clear the free bits of 2^order frames starting at pfn
+static void bitmap_update(uint32_t pfn, uint32_t order, bool free) {
+    uint32_t count = 1u << order;
+
+    if (count >= 32) {
+        // Blocks of 32+ frames are word aligned
+        for (uint32_t w = pfn >> 5; w < (pfn + count) >> 5; w++) {
+            free_bitmap[w] = free ? 0xFFFFFFFF : 0;
+        }
+        return;
+    }
+
+    uint32_t bits = ((1u << count) - 1) << (pfn & 31);
+    if (free) free_bitmap[pfn >> 5] |= bits;
+    else free_bitmap[pfn >> 5] &= ~bits;
+}
+
+static inline struct free_block* pfn_to_block(uint32_t pfn) {
+    return (struct free_block*)(pfn << PAGE_SHIFT);
+}
+
+static inline uint32_t block_to_pfn(struct free_block* block) {
+    return (uint32_t)block >> PAGE_SHIFT;
+}
+
+static void block_push(uint32_t pfn, uint32_t order) {
+    struct free_block* block = pfn_to_block(pfn);
+
+    block->order = order;
+    block->magic = FREE_BLOCK_MAGIC;
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next) block->next->prev = block;
+    free_lists[order] = block;
+
+    free_block_counts[order]++;
+    order_mask |= 1u << order;
+}
+
+static void block_remove(struct free_block* block) {
+    uint32_t order = block->order;
+
+    if (block->prev) block->prev->next = block->next;
+    else free_lists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    block->magic = 0;
+
+    free_block_counts[order]--;
+    if (!free_lists[order]) order_mask &= ~(1u << order);
+}
+
+static uint32_t alloc_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint32_t mask = order_mask >> order;
+    if (!mask) return 0;
+
+    uint32_t found = order + ffs32(mask);
+    struct free_block* block = free_lists[found];
+    uint32_t pfn = block_to_pfn(block);
+    block_remove(block);
+
+    // Split down to the requested order, returning upper halves
+    while (found > order) {
+        found--;
+        block_push(pfn + (1u << found), found);
+    }
+
+    bitmap_update(pfn, order, false);
+    free_frames -= 1u << order;
+    return pfn << PAGE_SHIFT;
+}
+
+static void free_pages(uint32_t addr, uint32_t order) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+
+    if (order > PMM_MAX_ORDER || pfn + (1u << order) > max_pfn) return;
+    if (pfn & ((1u << order) - 1)) return;     // Misaligned block
+    if (frame_free(pfn)) return;                // Double free
+
+    bitmap_update(pfn, order, true);
+    free_frames += 1u << order;
+
+    // A free buddy frame is always the head of a free block, so its
+    // header says whether it can merge at this order
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= max_pfn || !frame_free(buddy)) break;
+
+        struct free_block* block = pfn_to_block(buddy);
+        if (block->magic != FREE_BLOCK_MAGIC || block->order != order) break;
+
+        block_remove(block);
+        pfn &= ~(1u << order);
+        order++;
+    }
+
+    block_push(pfn, order);
+}
+
+uint32_t pmm_alloc_pages(uint32_t order) {
+    uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+    uint32_t addr = alloc_pages(order);
+    ticket_unlock_irqrestore(&pmm_lock, flags);
+    return addr;
+}
+
+void pmm_free_pages(uint32_t addr, uint32_t order) {
+    uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+    free_pages(addr, order);
+    ticket_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint32_t pmm_alloc_page(void) {
+    return pmm_alloc_pages(0);
+}
+
+void pmm_free_page(uint32_t addr) {
+    pmm_free_pages(addr, 0);
+}
+
+bool pmm_is_free(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    return pfn < max_pfn && frame_free(pfn);
+}
+
+uint32_t pmm_free_count(void) {
+    return free_frames;
+}
+
+uint32_t pmm_total_count(void) {
+    return total_frames;
+}
+
+uint32_t pmm_max_address(void) {
+    return max_pfn << PAGE_SHIFT;
+}
+
+void pmm_share_page(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    if (pfn >= max_pfn) return;
+
+    uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+    frame_shares[pfn]++;
+    ticket_unlock_irqrestore(&pmm_lock, flags);
+}
+
+bool pmm_release_page(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    if (pfn >= max_pfn) return false;
+
+    uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+    bool last = frame_shares[pfn] == 0;
+    if (last) free_pages(addr, 0);
+    else frame_shares[pfn]--;
+    ticket_unlock_irqrestore(&pmm_lock, flags);
+    return last;
+}
+
+bool pmm_page_shared(uint32_t addr) {
+    uint32_t pfn = addr >> PAGE_SHIFT;
+    return pfn < max_pfn && frame_shares[pfn] != 0;
+}
+
+const struct e820_map* pmm_memory_map(void) {
+    return memory_map;
+}
+
+// Clip a map entry to the managed window, in whole frames
+static bool usable_range(const struct e820_entry* e, uint32_t* start_pfn, uint32_t* end_pfn) {
+    if (e->type != E820_USABLE || !(e->acpi & 1)) return false;
+
+    uint64_t start = e->base;
+    uint64_t end = e->base + e->length;
+    if (start < LOW_MEMORY_END) start = LOW_MEMORY_END;
+    if (end > PMM_LIMIT) end = PMM_LIMIT;
+    if (start >= end) return false;
+
+    *start_pfn = (uint32_t)((start + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    *end_pfn = (uint32_t)(end >> PAGE_SHIFT);
+    return *start_pfn < *end_pfn;
+}
+
+static bool block_has_free(uint32_t pfn, uint32_t order) {
+    uint32_t count = 1u << order;
+
+    if (count < 32) {
+        return free_bitmap[pfn >> 5] & (((1u << count) - 1) << (pfn & 31));
+    }
+    for (uint32_t w = pfn >> 5; w < (pfn + count) >> 5; w++) {
+        if (free_bitmap[w]) return true;
+    }
+    return false;
+}
+
+// Release [start, end) in the largest naturally aligned blocks that fit
+static void free_range(uint32_t start, uint32_t end) {
+    while (start < end) {
+        uint32_t order = fls32(end - start);
+        if (start) {
+            uint32_t align = ffs32(start);
+            if (align < order) order = align;
+        }
+        if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+
+        // Overlapping map entries: fall back to single frames, which
+        // free_pages skips when already free
+        if (order > 0 && block_has_free(start, order)) order = 0;
+
+        uint32_t before = free_frames;
+        free_pages(start << PAGE_SHIFT, order);
+        total_frames += free_frames - before;
+        start += 1u << order;
+    }
+}
+
+bool pmm_init(void) {
+    const struct e820_map* bios_map = (const struct e820_map*)E820_MAP_ADDR;
+    if (bios_map->count == 0 || bios_map->count > E820_MAX_ENTRIES) {
+        memory_map = &fallback_map;
+    } else {
+        boot_map.count = bios_map->count;
+        for (uint32_t i = 0; i < bios_map->count; i++) {
+            boot_map.entries[i] = bios_map->entries[i];
+        }
+        memory_map = &boot_map;
+    }
+
+    uint32_t start, end;
+    max_pfn = 0;
+    for (uint32_t i = 0; i < memory_map->count; i++) {
+        if (usable_range(&memory_map->entries[i], &start, &end) && end > max_pfn) {
+            max_pfn = end;
+        }
+    }
+    if (max_pfn == 0) return false;
+
+    // Place the bitmap and share counts at the start of the first usable
+    // range that holds them
+    uint32_t bitmap_bytes = ((max_pfn + 31) / 32) * 4;
+    uint32_t shares_bytes = max_pfn * sizeof(uint16_t);
+    uint32_t bitmap_frames = (bitmap_bytes + shares_bytes + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    uint32_t bitmap_pfn = 0;
+    for (uint32_t i = 0; i < memory_map->count; i++) {
+        if (usable_range(&memory_map->entries[i], &start, &end) &&
+            end - start > bitmap_frames) {
+            bitmap_pfn = start;
+            break;
+        }
+    }
+    if (bitmap_pfn == 0) return false;
+
+    free_bitmap = (uint32_t*)(bitmap_pfn << PAGE_SHIFT);
+    memset(free_bitmap, 0, bitmap_bytes);
+    frame_shares = (uint16_t*)((uint8_t*)free_bitmap + bitmap_bytes);
+    memset(frame_shares, 0, shares_bytes);
+
+    for (uint32_t i = 0; i <= PMM_MAX_ORDER; i++) {
+        free_lists[i] = NULL;
+        free_block_counts[i] = 0;
+    }
+    order_mask = 0;
+    free_frames = 0;
+    total_frames = 0;
+
+    for (uint32_t i = 0; i < memory_map->count; i++) {
+        if (!usable_range(&memory_map->entries[i], &start, &end)) continue;
+
+        if (start < bitmap_pfn + bitmap_frames && end > bitmap_pfn) {
+            if (start < bitmap_pfn) free_range(start, bitmap_pfn);
+            start = bitmap_pfn + bitmap_frames;
+        }
+        free_range(start, end);
+    }
+
+    return total_frames > 0;
+}
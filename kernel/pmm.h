@@ -0,0 +1,57 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// BIOS E820 memory map, collected by the bootloader before entering
+// protected mode
+#define E820_MAP_ADDR    0x500
+#define E820_MAX_ENTRIES 32
+
+#define E820_USABLE      1
+#define E820_RESERVED    2
+#define E820_ACPI        3
+#define E820_NVS         4
+#define E820_BAD         5
+
+struct e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;      // ACPI 3.0 extended attributes, bit 0 = valid
+} __attribute__((packed));
+
+struct e820_map {
+    uint32_t count;
+    uint32_t reserved;
+    struct e820_entry entries[E820_MAX_ENTRIES];
+} __attribute__((packed));
+
+// Buddy allocator orders: order 0 is one 4 KB frame, order 10 is 4 MB
+#define PMM_MAX_ORDER 10
+
+// Frames at or above this address are not managed
+#define PMM_LIMIT 0x40000000
+
+// Physical page-frame allocator
+bool pmm_init(void);
+uint32_t pmm_alloc_pages(uint32_t order);           // Returns physical address, 0 on failure
+void pmm_free_pages(uint32_t addr, uint32_t order);
+uint32_t pmm_alloc_page(void);
+void pmm_free_page(uint32_t addr);
+
+// Shared frames: each pmm_share_page() adds a reference on top of the
+// allocating one; pmm_release_page() drops one and frees the frame when
+// it was the last, returning true in that case
+void pmm_share_page(uint32_t addr);
+bool pmm_release_page(uint32_t addr);
+bool pmm_page_shared(uint32_t addr);   // More than one reference
+
+bool pmm_is_free(uint32_t addr);
+uint32_t pmm_free_count(void);      // Free frames
+uint32_t pmm_total_count(void);     // Frames handed to the allocator at boot
+uint32_t pmm_max_address(void);     // End of the highest managed frame
+const struct e820_map* pmm_memory_map(void);
+
+#endif // PMM_H
@@ -0,0 +1,601 @@
+#include "sched.h"
+#include "isr.h"
+#include "clock.h"
+#include "idle.h"
+#include "memory.h"
+#include "console.h"
+#include "spinlock.h"
+#include "smp.h"
+#include <string.h>
+
+// Each run queue has its own lock, taken with interrupts off; a CPU only
+// takes another's to wake a thread onto it or to steal from it. A thread
+// keeps on_cpu set until the CPU that ran it has finished switching away
+// from its stack, and is never stolen before that. A thread that exits
+// cannot free the stack it is running on, so the next thread to run on
+// that CPU frees it, right after the switch.
+
+#define EFLAGS_IF       0x200
+#define EFLAGS_RESERVED 0x002
+
+struct run_queue {
+    struct spinlock lock;
+    struct thread* head[SCHED_PRIORITIES];
+    struct thread* tail[SCHED_PRIORITIES];
+    uint32_t bitmap;                // Bit n: head[n] is non-empty
+    volatile uint32_t queued;       // Read unlocked by CPUs looking for work
+    struct thread* idle;
+    struct thread* prev;            // Switched away from, finished after the switch
+    uint32_t switches;
+    uint32_t preemptions;
+    uint32_t steals;
+} __attribute__((aligned(64)));
+
+static struct run_queue run_queues[SMP_MAX_CPUS];
+
+// all_threads, next_id, thread_count
+static struct spinlock threads_lock = SPINLOCK_INIT("threads");
+static struct thread* all_threads;
+static uint32_t next_id;
+static uint32_t thread_count;
+
+// Implemented in switch.asm
+void sched_switch(uint32_t* save_esp, uint32_t next_esp);
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint32_t lowest_bit(uint32_t x) {
+    uint32_t r;
+    __asm__("bsf %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+static inline struct thread* current_thread(void) {
+    return (struct thread*)this_cpu_read(current);
+}
+
+static inline uint32_t rq_cpu(struct run_queue* rq) {
+    return rq - run_queues;
+}
+
+// This CPU's queue, locked; interrupts stay off until the caller restores
+// flags, so the thread cannot move to another CPU in between
+static struct run_queue* lock_this_rq(uint32_t* flags) {
+    *flags = irq_save();
+    struct run_queue* rq = &run_queues[cpu_index()];
+    spin_lock(&rq->lock);
+    return rq;
+}
+
+// The queue a thread belongs to, locked. Stealing moves a queued thread
+// under its old queue's lock, so look again once the lock is held.
+static struct run_queue* lock_thread_rq(struct thread* t) {
+    for (;;) {
+        struct run_queue* rq = &run_queues[t->cpu];
+        spin_lock(&rq->lock);
+        if (rq == &run_queues[t->cpu]) return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+static void enqueue(struct run_queue* rq, struct thread* t) {
+    uint32_t prio = t->priority;
+    t->state = THREAD_READY;
+    t->next = 0;
+    if (rq->tail[prio]) rq->tail[prio]->next = t;
+    else rq->head[prio] = t;
+    rq->tail[prio] = t;
+    rq->bitmap |= 1u << prio;
+    rq->queued++;
+}
+
+static struct thread* dequeue(struct run_queue* rq) {
+    if (!rq->bitmap) return rq->idle;
+
+    uint32_t prio = lowest_bit(rq->bitmap);
+    struct thread* t = rq->head[prio];
+    rq->head[prio] = t->next;
+    if (!rq->head[prio]) {
+        rq->tail[prio] = 0;
+        rq->bitmap &= ~(1u << prio);
+    }
+    rq->queued--;
+    return t;
+}
+
+// Take t out of the middle of its FIFO; before is the thread ahead of it
+static void unlink_queued(struct run_queue* rq, struct thread* t, struct thread* before) {
+    uint32_t prio = t->priority;
+    if (before) before->next = t->next;
+    else rq->head[prio] = t->next;
+    if (rq->tail[prio] == t) rq->tail[prio] = before;
+    if (!rq->head[prio]) rq->bitmap &= ~(1u << prio);
+    rq->queued--;
+}
+
+static struct thread* find_queued(struct run_queue* rq, struct thread* t, struct thread** before) {
+    *before = 0;
+    for (struct thread* q = rq->head[t->priority]; q; *before = q, q = q->next) {
+        if (q == t) return q;
+    }
+    return 0;
+}
+
+static void resched_cpu(uint32_t cpu) {
+    if (cpu == cpu_index()) {
+        this_cpu_write(need_resched, 1);
+        return;
+    }
+    percpu[cpu].need_resched = 1;
+    smp_send_resched(cpu);
+}
+
+// Another CPU with nothing to do will steal from a busy one, but only
+// looks when it wakes up: wake one
+static void kick_idle_cpu(uint32_t busy) {
+    uint32_t self = cpu_index();
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        if (cpu != busy && cpu != self && sched_cpu_idle(cpu)) {
+            smp_send_resched(cpu);
+            return;
+        }
+    }
+}
+
+// Queue a thread that just became runnable and ask its CPU to
+// reschedule if it outranks the running one; rq is locked
+static void make_ready(struct run_queue* rq, struct thread* t) {
+    uint32_t cpu = rq_cpu(rq);
+    struct thread* running = percpu[cpu].current;
+
+    enqueue(rq, t);
+    if (running == rq->idle || t->priority < running->priority) resched_cpu(cpu);
+    else if (!t->pinned) kick_idle_cpu(cpu);
+}
+
+// Back of the queue with a fresh slice; the idle thread is never queued
+static void requeue_current(struct run_queue* rq, struct thread* t) {
+    if (t == rq->idle) return;
+    t->slice = SCHED_TIMESLICE;
+    enqueue(rq, t);
+}
+
+static void reap(struct thread* t) {
+    spin_lock(&threads_lock);
+    for (struct thread** p = &all_threads; *p; p = &(*p)->all_next) {
+        if (*p == t) {
+            *p = t->all_next;
+            break;
+        }
+    }
+    thread_count--;
+    spin_unlock(&threads_lock);
+
+    fpu_state_release(&t->fpu);
+    kfree(t->stack);
+    kfree(t);
+}
+
+// Runs on the new thread's stack, on whichever CPU switched to it
+static void finish_switch(void) {
+    struct run_queue* rq = &run_queues[cpu_index()];
+    struct thread* prev = rq->prev;
+    rq->prev = 0;
+
+    // prev's stack is no longer in use from here on
+    __asm__ volatile("" : : : "memory");
+    if (prev->state == THREAD_DEAD) reap(prev);
+    else prev->on_cpu = 0;
+}
+
+// Run the best thread on rq, which is this CPU's and locked. The caller
+// has already queued, blocked or killed the current one. Unlocks rq.
+// Returns true if another thread ran, once this one is running again,
+// possibly on another CPU.
+static bool schedule(struct run_queue* rq) {
+    struct thread* prev = current_thread();
+    struct thread* next = dequeue(rq);
+    this_cpu_write(need_resched, 0);
+
+    if (next == prev) {
+        prev->state = THREAD_RUNNING;
+        spin_unlock(&rq->lock);
+        return false;
+    }
+
+    uint64_t now = ktime_get_ns();
+    prev->runtime_ns += now - prev->last_run_ns;
+    next->last_run_ns = now;
+    next->state = THREAD_RUNNING;
+    next->on_cpu = 1;
+    this_cpu_write(current, next);
+    rq->prev = prev;
+    rq->switches++;
+    spin_unlock(&rq->lock);
+
+    fpu_switch(&next->fpu);
+    sched_switch(&prev->esp, next->esp);
+    finish_switch();
+    return true;
+}
+
+// Give up the CPU unless a wakeup already came; rq is this CPU's and
+// locked, and is unlocked on return
+static bool block_current(struct run_queue* rq, struct thread* t) {
+    if (t->wake_pending) {
+        t->wake_pending = false;
+        spin_unlock(&rq->lock);
+        return false;
+    }
+    t->state = THREAD_BLOCKED;
+    return schedule(rq);
+}
+
+static void preempt_current(void) {
+    uint32_t flags;
+    struct run_queue* rq = lock_this_rq(&flags);
+    struct thread* t = current_thread();
+    requeue_current(rq, t);
+    if (schedule(rq)) {
+        t->preemptions++;
+        run_queues[cpu_index()].preemptions++;
+    }
+    irq_restore(flags);
+}
+
+// First code a new thread runs, entered from sched_switch with
+// interrupts off
+static void thread_start(void) {
+    finish_switch();
+    __asm__ volatile("sti");
+    struct thread* t = current_thread();
+    t->entry(t->arg);
+    thread_exit();
+}
+
+static void sleep_expired(void* arg) {
+    thread_wake(arg);
+}
+
+static void thread_init(struct thread* t, const char* name, uint8_t priority) {
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->priority = priority;
+    t->slice = SCHED_TIMESLICE;
+    timer_setup(&t->sleep_timer, sleep_expired, t);
+    fpu_state_init(&t->fpu, 0);
+}
+
+static void thread_register(struct thread* t) {
+    uint32_t flags = irq_save();
+    spin_lock(&threads_lock);
+    t->id = next_id++;
+    t->all_next = all_threads;
+    all_threads = t;
+    thread_count++;
+    spin_unlock(&threads_lock);
+    irq_restore(flags);
+}
+
+static struct thread* thread_alloc(const char* name, void (*entry)(void* arg), void* arg, uint8_t priority) {
+    struct thread* t = kmalloc(sizeof(struct thread));
+    uint8_t* stack = kmalloc(THREAD_STACK_SIZE);
+    if (!t || !stack) {
+        kfree(t);
+        kfree(stack);
+        return 0;
+    }
+
+    // The heap is demand paged, and a fault on the stack the fault
+    // handler itself would push to is a double fault: touch every page now
+    memset(stack, 0, THREAD_STACK_SIZE);
+
+    thread_init(t, name, priority);
+    t->stack = stack;
+    t->entry = entry;
+    t->arg = arg;
+
+    // The frame sched_switch pops: EFLAGS, EDI, ESI, EBX, EBP, then
+    // thread_start as the return address and a dummy one above it
+    uint32_t* sp = (uint32_t*)(stack + THREAD_STACK_SIZE);
+    *--sp = 0;
+    *--sp = (uint32_t)thread_start;
+    for (int i = 0; i < 4; i++) *--sp = 0;
+    *--sp = EFLAGS_RESERVED;
+    t->esp = (uint32_t)sp;
+
+    thread_register(t);
+    return t;
+}
+
+static void idle_entry(void* arg) {
+    (void)arg;
+    idle_loop();
+}
+
+// The calling flow of control becomes a thread that is already running
+static struct thread* adopt_current(const char* name, uint8_t priority) {
+    struct thread* t = kmalloc(sizeof(struct thread));
+    if (!t) return 0;
+
+    thread_init(t, name, priority);
+    t->state = THREAD_RUNNING;
+    t->cpu = cpu_index();
+    t->on_cpu = 1;
+    t->last_run_ns = ktime_get_ns();
+    thread_register(t);
+    this_cpu_write(current, t);
+    return t;
+}
+
+bool sched_init(void) {
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&run_queues[cpu].lock, "run queue");
+    }
+    if (!adopt_current("main", SCHED_PRIO_DEFAULT)) return false;
+
+    struct thread* idle = thread_alloc("idle", idle_entry, 0, SCHED_PRIORITIES - 1);
+    if (!idle) return false;
+    idle->pinned = true;
+    run_queues[0].idle = idle;
+    return true;
+}
+
+bool sched_init_cpu(void) {
+    struct thread* idle = adopt_current("idle", SCHED_PRIORITIES - 1);
+    if (!idle) return false;
+    idle->pinned = true;
+    run_queues[cpu_index()].idle = idle;
+    return true;
+}
+
+struct thread* thread_create_on(const char* name, void (*entry)(void* arg), void* arg, uint8_t priority,
+                                uint32_t cpu) {
+    if (priority >= SCHED_PRIORITIES) return 0;
+    if (cpu != THREAD_CPU_ANY && cpu >= smp_cpu_count) return 0;
+
+    struct thread* t = thread_alloc(name, entry, arg, priority);
+    if (!t) return 0;
+
+    uint32_t flags = irq_save();
+    t->cpu = cpu == THREAD_CPU_ANY ? cpu_index() : cpu;
+    t->pinned = cpu != THREAD_CPU_ANY;
+    struct run_queue* rq = &run_queues[t->cpu];
+    spin_lock(&rq->lock);
+    make_ready(rq, t);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+
+    if (this_cpu_read(need_resched)) sched_preempt();
+    return t;
+}
+
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg, uint8_t priority) {
+    return thread_create_on(name, entry, arg, priority, THREAD_CPU_ANY);
+}
+
+struct thread* thread_current(void) {
+    return current_thread();
+}
+
+void thread_yield(void) {
+    uint32_t flags;
+    struct run_queue* rq = lock_this_rq(&flags);
+    struct thread* t = current_thread();
+    requeue_current(rq, t);
+    if (schedule(rq)) t->switches++;
+    irq_restore(flags);
+}
+
+void thread_exit(void) {
+    __asm__ volatile("cli");
+    struct thread* t = current_thread();
+    timer_cancel_sync(&t->sleep_timer);
+
+    uint32_t flags;
+    struct run_queue* rq = lock_this_rq(&flags);
+    t->state = THREAD_DEAD;
+    schedule(rq);
+
+    for (;;) { }    // Never switched back to
+}
+
+void thread_sleep(uint32_t ticks) {
+    uint32_t flags = irq_save();
+    struct thread* t = current_thread();
+    timer_start(&t->sleep_timer, ticks);
+
+    struct run_queue* rq = &run_queues[cpu_index()];
+    spin_lock(&rq->lock);
+    if (block_current(rq, t)) t->switches++;
+    irq_restore(flags);
+
+    // Woken early, maybe by another CPU while sleep_expired is still in
+    // thread_wake on this thread; it must be done before we can exit
+    timer_cancel_sync(&t->sleep_timer);
+}
+
+void thread_pin(void) {
+    current_thread()->pinned = true;
+}
+
+void thread_unpin(void) {
+    current_thread()->pinned = false;
+}
+
+void thread_block(void) {
+    struct thread* t = current_thread();
+    struct run_queue* rq = &run_queues[cpu_index()];
+    spin_lock(&rq->lock);
+    if (block_current(rq, t)) t->switches++;
+}
+
+bool thread_wake(struct thread* thread) {
+    uint32_t flags = irq_save();
+    struct run_queue* rq = lock_thread_rq(thread);
+
+    bool blocked = thread->state == THREAD_BLOCKED;
+    if (blocked) make_ready(rq, thread);
+    else if (thread->state != THREAD_DEAD) thread->wake_pending = true;
+
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+
+    if (this_cpu_read(need_resched)) sched_preempt();
+    return blocked;
+}
+
+void thread_set_priority(struct thread* thread, uint8_t priority) {
+    if (priority >= SCHED_PRIORITIES) return;
+
+    uint32_t flags = irq_save();
+    struct run_queue* rq = lock_thread_rq(thread);
+    struct thread* before;
+    if (thread->state == THREAD_READY && find_queued(rq, thread, &before)) {
+        unlink_queued(rq, thread, before);
+        thread->priority = priority;
+        make_ready(rq, thread);
+    } else {
+        thread->priority = priority;
+    }
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+
+    if (this_cpu_read(need_resched)) sched_preempt();
+}
+
+uint64_t thread_runtime_ns(struct thread* thread) {
+    uint32_t flags = irq_save();
+    uint64_t ns = thread->runtime_ns;
+    if (percpu[thread->cpu].current == thread) ns += ktime_get_ns() - thread->last_run_ns;
+    irq_restore(flags);
+    return ns;
+}
+
+void sched_preempt(void) {
+    uint32_t flags = irq_save();
+
+    // Not from interrupt handlers, which preempt on the way out, nor from
+    // the idle thread, which yields from its loop after restarting the tick
+    if ((flags & EFLAGS_IF) && !this_cpu_read(irq_depth) && !this_cpu_read(preempt_count) &&
+        this_cpu_read(need_resched) && current_thread() != run_queues[cpu_index()].idle) {
+        preempt_current();
+    }
+    irq_restore(flags);
+}
+
+void sched_tick(void) {
+    struct thread* t = current_thread();
+    struct run_queue* rq = &run_queues[cpu_index()];
+    if (!t || t == rq->idle || !t->slice) return;
+    if (--t->slice) return;
+
+    // Slice used up: rotate if anyone of the same or higher priority is waiting
+    if (rq->bitmap & ((2u << t->priority) - 1)) this_cpu_write(need_resched, 1);
+    else t->slice = SCHED_TIMESLICE;
+}
+
+void sched_irq_exit(void) {
+    if (!this_cpu_read(need_resched) || this_cpu_read(preempt_count) || this_cpu_read(irq_depth)) return;
+    struct thread* t = current_thread();
+    if (!t || t == run_queues[cpu_index()].idle) return;
+    preempt_current();
+}
+
+bool sched_runnable(void) {
+    return run_queues[cpu_index()].bitmap != 0;
+}
+
+bool sched_cpu_idle(uint32_t cpu) {
+    return run_queues[cpu].idle && percpu[cpu].current == run_queues[cpu].idle;
+}
+
+// Highest priority thread on rq another CPU may take. Not one whose FPU
+// registers are still loaded on rq's CPU: nobody else can save them.
+static struct thread* take_stealable(struct run_queue* rq) {
+    uint32_t cpu = rq_cpu(rq);
+    uint32_t bitmap = rq->bitmap;
+
+    while (bitmap) {
+        uint32_t prio = lowest_bit(bitmap);
+        bitmap &= ~(1u << prio);
+
+        struct thread* before = 0;
+        for (struct thread* t = rq->head[prio]; t; before = t, t = t->next) {
+            if (t->pinned || t->on_cpu || fpu_state_live(&t->fpu, cpu)) continue;
+            unlink_queued(rq, t, before);
+            return t;
+        }
+    }
+    return 0;
+}
+
+bool sched_steal(void) {
+    uint32_t self = cpu_index();
+    struct run_queue* busiest = 0;
+    uint32_t most = 0;
+
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        uint32_t queued = run_queues[cpu].queued;
+        if (cpu != self && queued > most) {
+            most = queued;
+            busiest = &run_queues[cpu];
+        }
+    }
+    if (!busiest) return false;
+
+    spin_lock(&busiest->lock);
+    struct thread* t = take_stealable(busiest);
+    if (t) t->cpu = self;
+    spin_unlock(&busiest->lock);
+    if (!t) return false;
+
+    // Idle CPUs sleep without a tick and never look on their own; pass
+    // whatever is left on to the next one
+    if (busiest->queued) kick_idle_cpu(rq_cpu(busiest));
+
+    struct run_queue* rq = &run_queues[self];
+    spin_lock(&rq->lock);
+    enqueue(rq, t);
+    rq->steals++;
+    spin_unlock(&rq->lock);
+    return true;
+}
+
+void sched_get_stats(struct sched_stats* out) {
+    uint32_t flags = irq_save();
+    memset(out, 0, sizeof(*out));
+    for (uint32_t cpu = 0; cpu < smp_cpu_count; cpu++) {
+        out->switches += run_queues[cpu].switches;
+        out->preemptions += run_queues[cpu].preemptions;
+        out->steals += run_queues[cpu].steals;
+    }
+    out->threads = thread_count;
+    irq_restore(flags);
+}
+
+void sched_dump_threads(void) {
+    struct sched_stats s;
+    sched_get_stats(&s);
+    kprintf("sched: %u threads on %u CPUs, %u switches, %u preemptions, %u steals\n",
+            s.threads, smp_cpu_count, s.switches, s.preemptions, s.steals);
+
+    uint32_t flags = irq_save();
+    spin_lock(&threads_lock);
+    for (struct thread* t = all_threads; t; t = t->all_next) {
+        uint64_t us = thread_runtime_ns(t);
+        div64_u32(&us, NSEC_PER_USEC);
+        kprintf("  %u %s: cpu %u, prio %u, %u us, %u switches, %u preempted\n", t->id, t->name,
+                t->cpu, t->priority, (uint32_t)us, t->switches, t->preemptions);
+    }
+    spin_unlock(&threads_lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,135 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fpu.h"
+#include "timer.h"
+#include "percpu.h"
+
+// Preemptive kernel threads, each on its own kernel stack.
+//
+// Every CPU has its own run queue: one FIFO per priority, with a bitmap
+// of the non-empty ones, so picking the next thread is a BSF and a list
+// pop no matter how many threads exist. Priority 0 is the highest. A
+// thread that becomes runnable goes back to the CPU it last ran on and
+// preempts a lower priority one there at once; threads of equal priority
+// take turns in SCHED_TIMESLICE tick slices. Each CPU's idle thread sits
+// outside the queues and runs when its queue is empty; before sleeping
+// it steals a waiting thread from the busiest other CPU.
+//
+// Preemption from interrupts happens on the way out of the outermost
+// IRQ, never in the middle of a preempt_disable() or kernel_fpu_begin()
+// section; a request made during one is honoured when it ends.
+
+#define SCHED_PRIORITIES   32
+#define SCHED_PRIO_DEFAULT 16
+#define SCHED_TIMESLICE    5        // Ticks
+#define THREAD_STACK_SIZE  8192
+#define THREAD_CPU_ANY     0xFFFFFFFF
+
+enum thread_state {
+    THREAD_RUNNING,
+    THREAD_READY,       // On a run queue
+    THREAD_BLOCKED,
+    THREAD_DEAD,        // Exited, freed by the next thread to run
+};
+
+struct thread {
+    uint32_t esp;               // Saved by sched_switch
+    struct thread* next;        // Run queue
+    struct thread* all_next;    // Every live thread
+    uint32_t id;
+    const char* name;
+    uint8_t priority;
+    uint8_t state;
+    uint16_t slice;             // Ticks left in the current slice
+    uint32_t cpu;               // Run queue it is on or last ran from
+    volatile uint8_t on_cpu;    // Still on a CPU, maybe in the middle of switching out
+    bool pinned;                // Never stolen by another CPU
+    bool wake_pending;          // Woken while not blocked; the next block returns at once
+    void* stack;                // NULL for the boot thread and AP idle threads
+    void (*entry)(void* arg);
+    void* arg;
+    struct timer sleep_timer;
+    uint64_t runtime_ns;        // Up to the last switch out
+    uint64_t last_run_ns;       // When it was last switched in
+    uint32_t switches;          // Gave up the CPU: yield, block, sleep
+    uint32_t preemptions;       // Had it taken away
+    struct fpu_state fpu;
+};
+
+struct sched_stats {
+    uint32_t switches;          // Context switches, all causes
+    uint32_t preemptions;
+    uint32_t steals;            // Threads taken from another CPU's queue
+    uint32_t threads;           // Live, idle ones included
+};
+
+// The boot flow of control becomes thread "main" at SCHED_PRIO_DEFAULT;
+// the boot CPU's idle thread is created to run idle_loop(). Call after
+// timer_init().
+bool sched_init(void);
+
+// On an application processor: the calling flow becomes its idle thread
+bool sched_init_cpu(void);
+
+// Runnable at once on this CPU; runs before the caller returns if it has
+// the higher priority. NULL when out of memory or the priority is out of
+// range.
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg, uint8_t priority);
+
+// The same, queued on cpu and pinned there; THREAD_CPU_ANY is
+// thread_create()
+struct thread* thread_create_on(const char* name, void (*entry)(void* arg), void* arg, uint8_t priority,
+                                uint32_t cpu);
+
+struct thread* thread_current(void);
+void thread_yield(void);
+void thread_exit(void) __attribute__((noreturn));
+void thread_sleep(uint32_t ticks);
+
+// Keep the calling thread on the CPU it is running on, or let it go
+void thread_pin(void);
+void thread_unpin(void);
+
+// Call with interrupts off, after checking the condition waited for. A
+// wakeup from another CPU can still land between the check and the
+// block; it is kept, and the block returns at once. Returns with
+// interrupts still off. Waiters must recheck their condition in a loop.
+void thread_block(void);
+bool thread_wake(struct thread* thread);    // False if it was not blocked
+
+void thread_set_priority(struct thread* thread, uint8_t priority);
+uint64_t thread_runtime_ns(struct thread* thread);
+
+// Called when a preemption request meets a preempt count of zero
+void sched_preempt(void);
+
+// The count and the request are this CPU's, one GS-relative instruction
+// each
+static inline void preempt_disable(void) {
+    this_cpu_inc(preempt_count);
+}
+
+static inline void preempt_enable(void) {
+    this_cpu_dec(preempt_count);
+    if (!this_cpu_read(preempt_count) && this_cpu_read(need_resched)) sched_preempt();
+}
+
+// Hooks for the clock tick and the IRQ exit path, interrupts off
+void sched_tick(void);
+void sched_irq_exit(void);
+
+// For the idle loop, interrupts off: a thread is waiting for this CPU;
+// take one that waits for another CPU onto this one's queue
+bool sched_runnable(void);
+bool sched_steal(void);
+
+// cpu is running its idle thread
+bool sched_cpu_idle(uint32_t cpu);
+
+void sched_get_stats(struct sched_stats* out);
+void sched_dump_threads(void);
+
+#endif // SCHED_H
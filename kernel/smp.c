@@ -0,0 +1,192 @@
+#include "smp.h"
+#include "apic.h"
+#include "acpi.h"
+#include "irq.h"
+#include "isr.h"
+#include "idt.h"
+#include "gdt.h"
+#include "cpu.h"
+#include "clock.h"
+#include "paging.h"
+#include "memory.h"
+#include "sched.h"
+#include "idle.h"
+#include "syscall.h"
+#include "spinlock.h"
+#include "console.h"
+#include <string.h>
+
+// Startup is the MP specification's INIT-SIPI-SIPI: INIT parks the AP
+// waiting for a startup IPI, which starts it in real mode on the page the
+// vector names; the second SIPI covers a first one that was lost. APs are
+// started one at a time and each is waited for, so they can all share
+// the trampoline's single parameter block.
+
+#define AP_INIT_DELAY_MS    10
+#define AP_SIPI_DELAY_US    200
+#define AP_START_TIMEOUT_MS 100
+
+// Layout of ap_trampoline_params in trampoline.asm
+struct ap_params {
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+};
+
+struct percpu percpu[SMP_MAX_CPUS];
+volatile uint32_t smp_cpu_count = 1;
+
+static struct spinlock tlb_lock = SPINLOCK_INIT("tlb shootdown");
+static volatile uint32_t tlb_acks_pending;
+
+// In trampoline.asm
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_params[];
+
+void ap_main(uint32_t index) __attribute__((noreturn));
+
+static void flush_tlb_local(void) {
+    uint32_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        // Turning PGE off drops the global entries as well
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        write_cr3(read_cr3());
+    }
+}
+
+// Nothing to do here: irq_handler's exit path reschedules, and an idle
+// CPU wakes up and looks at its run queue
+static void resched_ipi(registers_t* regs) {
+    (void)regs;
+}
+
+static void tlb_ipi(registers_t* regs) {
+    (void)regs;
+    flush_tlb_local();
+    __asm__ volatile("lock decl %0" : "+m"(tlb_acks_pending) : : "memory", "cc");
+}
+
+static void ap_timer_tick(registers_t* regs) {
+    (void)regs;
+    sched_tick();
+}
+
+void smp_send_resched(uint32_t cpu) {
+    if (cpu == cpu_index() || !percpu[cpu].online) return;
+    lapic_send_ipi(percpu[cpu].apic_id, SMP_RESCHED_VECTOR);
+}
+
+void smp_flush_tlb(void) {
+    uint32_t count = smp_cpu_count;
+    if (count == 1) {
+        flush_tlb_local();
+        return;
+    }
+
+    // A second initiator waits here with interrupts on, so it still
+    // answers this one's IPI
+    preempt_disable();
+    spin_lock(&tlb_lock);
+    uint32_t self = cpu_index();
+    tlb_acks_pending = count - 1;
+    for (uint32_t cpu = 0; cpu < count; cpu++) {
+        if (cpu != self) lapic_send_ipi(percpu[cpu].apic_id, SMP_TLB_VECTOR);
+    }
+    flush_tlb_local();
+    while (tlb_acks_pending) {
+        __asm__ volatile("pause");
+    }
+    spin_unlock(&tlb_lock);
+    preempt_enable();
+}
+
+// Entered from the trampoline with paging on, interrupts off and the
+// bootloader-style GDT still loaded. This flow of control becomes the
+// CPU's idle thread.
+void ap_main(uint32_t index) {
+    struct percpu* cpu = &percpu[index];
+
+    gdt_init_cpu(cpu);
+    idt_load_cpu();
+    lapic_init_ap();
+    syscall_init_cpu();
+    if (!sched_init_cpu()) {
+        for (;;) {
+            __asm__ volatile("cli; hlt");
+        }
+    }
+
+    apic_timer_periodic(CLOCK_TICK_HZ);
+    cpu->online = 1;
+    __asm__ volatile("sti");
+    idle_loop();
+}
+
+static bool start_ap(struct percpu* cpu) {
+    lapic_send_init(cpu->apic_id);
+    mdelay(AP_INIT_DELAY_MS);
+
+    for (int i = 0; i < 2 && !cpu->online; i++) {
+        lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE >> PAGE_SHIFT);
+        udelay(AP_SIPI_DELAY_US);
+    }
+
+    uint64_t deadline = ktime_get_ns() + AP_START_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (!cpu->online && !ktime_after(deadline)) {
+        __asm__ volatile("pause");
+    }
+    return cpu->online;
+}
+
+uint32_t smp_init(void) {
+    percpu[0].apic_id = irq_apic_active() ? lapic_id() : 0;
+    percpu[0].online = 1;
+    if (!irq_apic_active()) return smp_cpu_count;
+
+    register_interrupt_handler(SMP_RESCHED_VECTOR, resched_ipi);
+    register_interrupt_handler(SMP_TLB_VECTOR, tlb_ipi);
+    register_interrupt_handler(APIC_TIMER_VECTOR, ap_timer_tick);
+
+    memcpy((void*)AP_TRAMPOLINE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    struct ap_params* params =
+        (struct ap_params*)(AP_TRAMPOLINE + (ap_trampoline_params - ap_trampoline_start));
+    params->cr0 = read_cr0() & ~CR0_TS;
+    params->cr3 = (uint32_t)paging_kernel_pd();
+    params->cr4 = read_cr4();
+    params->entry = (uint32_t)ap_main;
+
+    const struct acpi_madt_info* madt = acpi_madt();
+    for (uint32_t i = 0; i < madt->cpu_count && smp_cpu_count < SMP_MAX_CPUS; i++) {
+        if (madt->cpu_apic_ids[i] == percpu[0].apic_id) continue;
+
+        // Becomes the idle thread's stack. Demand paged like the rest of
+        // the heap, so touch it all now.
+        uint8_t* stack = kmalloc(THREAD_STACK_SIZE);
+        if (!stack) break;
+        memset(stack, 0, THREAD_STACK_SIZE);
+
+        uint32_t index = smp_cpu_count;
+        struct percpu* cpu = &percpu[index];
+        if (!isr_profile_init_cpu(cpu)) break;
+        cpu->index = index;
+        cpu->apic_id = madt->cpu_apic_ids[i];
+        params->stack = (uint32_t)(stack + THREAD_STACK_SIZE);
+        params->cpu = index;
+
+        // An AP that never answered may still wake up later and run on
+        // these parameters, so it keeps its slot and its stack and no
+        // other AP is started after it
+        if (!start_ap(cpu)) {
+            kprintf("smp: CPU with APIC ID %u did not start\n", cpu->apic_id);
+            break;
+        }
+        smp_cpu_count = index + 1;
+    }
+    return smp_cpu_count;
+}
@@ -0,0 +1,34 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "percpu.h"
+
+// Application processor bring-up and inter-processor interrupts.
+//
+// Device IRQs and the clock tick stay on the boot CPU, which is the only
+// one that runs tickless. The others take their scheduler tick from
+// their local APIC timer and otherwise only ever see IPIs.
+
+#define SMP_RESCHED_VECTOR 0x31     // Look at the run queue
+#define SMP_TLB_VECTOR     0x32     // Flush the TLB, globals included
+
+#define AP_TRAMPOLINE      0x8000   // Startup code, below 1 MB and page aligned
+
+// CPUs running, the boot CPU included; CPU indices are 0..count - 1
+extern volatile uint32_t smp_cpu_count;
+
+// Start every processor the MADT lists, one at a time. Needs the APIC,
+// the clock and sched_init(). Returns the number of CPUs running.
+uint32_t smp_init(void);
+
+// Make cpu reschedule soon; nothing if it is this one
+void smp_send_resched(uint32_t cpu);
+
+// Flush every CPU's TLB, global entries included, and wait for all of
+// them. For mappings that were removed or changed. Call with interrupts
+// on and no spinlock held.
+void smp_flush_tlb(void);
+
+#endif // SMP_H
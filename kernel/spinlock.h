@@ -0,0 +1,250 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lockstat.h"
+#ifdef LOCK_STAT
+#include "cpu.h"
+#endif
+
+// Busy-wait locks, in three flavours:
+//
+//  spinlock     Test-and-test-and-set. A waiter spins on plain reads,
+//               which stay in its own cache, and only retries the locked
+//               XCHG once the line shows the lock free. Cheapest when
+//               uncontended; unfair, and a release sets every waiter on
+//               the lock's line at once.
+//  ticket_lock  FIFO. Waiters take a ticket and wait for the owner count
+//               to reach it, pausing longer the further back they are.
+//  mcs_lock     Queue lock. Each waiter spins on a node of its own, on
+//               its own stack, and the holder hands over to the next
+//               node directly, so a release touches one waiter's line.
+//               For locks that stay contended.
+//
+// Data touched from interrupt handlers must use the irqsave forms, or an
+// IRQ on the CPU holding the lock spins forever. The *_INIT initializers
+// name the lock for the LOCK_STAT statistics.
+
+struct spinlock {
+    volatile uint32_t locked;
+    LOCK_STAT_FIELD
+};
+
+#define SPINLOCK_INIT(n) { .locked = 0 LOCK_STAT_INIT(n) }
+
+#ifdef LOCK_STAT
+#define LOCK_STAT_NAME(lock, n) ((lock)->stat.name = (n))
+#else
+#define LOCK_STAT_NAME(lock, n) ((void)(n))
+#endif
+
+static inline void spin_lock_init(struct spinlock* lock, const char* name) {
+    lock->locked = 0;
+    LOCK_STAT_NAME(lock, name);
+}
+
+static inline bool spin_try_xchg(struct spinlock* lock) {
+    uint32_t old = 1;
+    __asm__ volatile("xchgl %0, %1" : "+r"(old), "+m"(lock->locked) : : "memory");
+    return old == 0;
+}
+
+static inline bool spin_trylock(struct spinlock* lock) {
+    if (!spin_try_xchg(lock)) return false;
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, 0);
+#endif
+    return true;
+}
+
+static inline void spin_lock(struct spinlock* lock) {
+    uint64_t wait_start = 0;
+    while (!spin_try_xchg(lock)) {
+#ifdef LOCK_STAT
+        if (!wait_start) wait_start = rdtsc();
+#endif
+        while (lock->locked) {
+            __asm__ volatile("pause");
+        }
+    }
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, wait_start);
+#endif
+    (void)wait_start;
+}
+
+// Stores are not reordered with older stores on x86, so a plain store
+// releases the lock once the compiler has emitted the section's writes
+static inline void spin_unlock(struct spinlock* lock) {
+#ifdef LOCK_STAT
+    lock_stat_released(&lock->stat);
+#endif
+    __asm__ volatile("" : : : "memory");
+    lock->locked = 0;
+}
+
+static inline uint32_t spin_lock_irqsave(struct spinlock* lock) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(struct spinlock* lock, uint32_t flags) {
+    spin_unlock(lock);
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+// Ticket lock. owner and next share a word so trylock can compare and
+// claim both in one CMPXCHG.
+
+#define TICKET_BACKOFF 32   // PAUSEs per waiter ahead, between reads of owner
+
+struct ticket_lock {
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;    // Ticket being served
+            volatile uint16_t next;     // Next ticket to hand out
+        };
+    };
+    LOCK_STAT_FIELD
+};
+
+#define TICKET_LOCK_INIT(n) { .word = 0 LOCK_STAT_INIT(n) }
+
+static inline bool ticket_trylock(struct ticket_lock* lock) {
+    uint32_t old = lock->word;
+    if ((uint16_t)old != (uint16_t)(old >> 16)) return false;
+
+    uint32_t prev;
+    __asm__ volatile("lock cmpxchgl %2, %1"
+                     : "=a"(prev), "+m"(lock->word)
+                     : "r"(old + 0x10000), "0"(old)
+                     : "memory", "cc");
+    if (prev != old) return false;
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, 0);
+#endif
+    return true;
+}
+
+static inline void ticket_lock(struct ticket_lock* lock) {
+    uint16_t ticket = 1;
+    __asm__ volatile("lock xaddw %0, %1" : "+r"(ticket), "+m"(lock->next) : : "memory", "cc");
+
+    uint64_t wait_start = 0;
+    for (;;) {
+        uint16_t ahead = ticket - lock->owner;
+        if (!ahead) break;
+#ifdef LOCK_STAT
+        if (!wait_start) wait_start = rdtsc();
+#endif
+        // Stay off the line until our turn is near; the owner's release
+        // then reaches fewer waiters
+        for (uint32_t i = 0; i < ahead * TICKET_BACKOFF; i++) {
+            __asm__ volatile("pause");
+        }
+    }
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, wait_start);
+#endif
+    (void)wait_start;
+}
+
+// Only the holder writes owner, so the increment needs no LOCK prefix
+static inline void ticket_unlock(struct ticket_lock* lock) {
+#ifdef LOCK_STAT
+    lock_stat_released(&lock->stat);
+#endif
+    __asm__ volatile("" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+static inline uint32_t ticket_lock_irqsave(struct ticket_lock* lock) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(struct ticket_lock* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+// MCS lock. The caller passes a node that stays valid, and is passed to
+// the unlock, for as long as it holds or waits for the lock; a local in
+// the locking function does.
+
+struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile uint32_t waiting;
+};
+
+struct mcs_lock {
+    struct mcs_node* volatile tail;     // Last waiter, NULL when free
+    LOCK_STAT_FIELD
+};
+
+#define MCS_LOCK_INIT(n) { .tail = 0 LOCK_STAT_INIT(n) }
+
+static inline void mcs_lock(struct mcs_lock* lock, struct mcs_node* node) {
+    node->next = 0;
+    node->waiting = 1;
+
+    struct mcs_node* prev = node;
+    __asm__ volatile("xchgl %0, %1" : "+r"(prev), "+m"(lock->tail) : : "memory");
+
+    uint64_t wait_start = 0;
+    if (prev) {
+#ifdef LOCK_STAT
+        wait_start = rdtsc();
+#endif
+        prev->next = node;
+        while (node->waiting) {
+            __asm__ volatile("pause");
+        }
+    }
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, wait_start);
+#endif
+    (void)wait_start;
+}
+
+static inline void mcs_unlock(struct mcs_lock* lock, struct mcs_node* node) {
+#ifdef LOCK_STAT
+    lock_stat_released(&lock->stat);
+#endif
+    if (!node->next) {
+        // Nobody queued behind us: swing the tail back to empty
+        struct mcs_node* prev;
+        __asm__ volatile("lock cmpxchgl %2, %1"
+                         : "=a"(prev), "+m"(lock->tail)
+                         : "r"(0), "0"(node)
+                         : "memory", "cc");
+        if (prev == node) return;
+
+        // A waiter took the tail but has not linked itself in yet
+        while (!node->next) {
+            __asm__ volatile("pause");
+        }
+    }
+    __asm__ volatile("" : : : "memory");
+    node->next->waiting = 0;
+}
+
+static inline uint32_t mcs_lock_irqsave(struct mcs_lock* lock, struct mcs_node* node) {
+    uint32_t flags;
+    __asm__ volatile("pushfl\n\tpopl %0\n\tcli" : "=r"(flags) : : "memory");
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(struct mcs_lock* lock, struct mcs_node* node, uint32_t flags) {
+    mcs_unlock(lock, node);
+    __asm__ volatile("pushl %0\n\tpopfl" : : "r"(flags) : "memory", "cc");
+}
+
+#endif // SPINLOCK_H
@@ -0,0 +1,30 @@
+; switch.asm - Kernel thread context switch
+[BITS 32]
+
+global sched_switch
+
+section .text
+
+; void sched_switch(uint32_t* save_esp, uint32_t next_esp)
+; Saves the callee-saved registers and EFLAGS on the current stack,
+; stores the stack pointer through save_esp and resumes the thread whose
+; stack next_esp points at. A new thread's stack is laid out the same
+; way with its start routine as the return address. Called with
+; interrupts off; each thread gets its own interrupt flag back from its
+; saved EFLAGS.
+sched_switch:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [eax], esp
+    mov esp, edx
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
@@ -0,0 +1,146 @@
+; syscall.asm - SYSENTER entry and ring 3 transitions
+[BITS 32]
+
+KERNEL_DS equ 0x10
+PERCPU_GS equ 0x30
+USER_CS equ 0x1B
+USER_DS equ 0x23
+EFLAGS_IF equ 0x200
+SYS_NULL equ 0
+SYS_EXIT equ 1
+
+extern syscall_dispatch
+extern syscall_set_kernel_stack
+
+global sysenter_entry
+global user_enter, user_return
+global user_bench_start, user_bench_end
+
+section .bss
+align 4
+user_return_esp: resd 1     ; Kernel stack saved by user_enter
+
+section .isr_text
+align 16
+
+; SYSENTER lands here with CS/SS from the MSRs, the stack from
+; MSR_SYSENTER_ESP and interrupts off. DS/ES keep the user selectors:
+; they are flat like the kernel's, so there is nothing to reload. GS
+; must hold the per-CPU segment before any C code runs. ECX holds the
+; user ESP and EDX the return EIP; the C dispatcher preserves
+; EBX/ESI/EDI/EBP itself.
+sysenter_entry:
+    push gs
+    push ecx
+    push edx
+    mov cx, PERCPU_GS
+    mov gs, cx
+    sti
+    cld
+    push edi
+    push esi
+    push ebx
+    push eax
+    call syscall_dispatch
+    add esp, 16
+    cli
+    pop edx
+    pop ecx
+    pop gs
+    sti                     ; Takes effect after SYSEXIT
+    sysexit
+
+; uint32_t user_enter(uint32_t eip, uint32_t esp)
+; Saves the callee-saved registers and EFLAGS, points the ring 3 entry
+; stacks just below them and irets to ring 3 with interrupts on.
+user_enter:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [user_return_esp], esp
+
+    push esp
+    call syscall_set_kernel_stack
+    add esp, 4
+
+    mov eax, [esp + 24]     ; eip
+    mov ecx, [esp + 28]     ; esp
+
+    ; An IRQ between here and the iret would arrive from ring 0 and keep
+    ; the user GS for the per-CPU code; the iret turns interrupts back on
+    cli
+    mov dx, USER_DS
+    mov ds, dx
+    mov es, dx
+    mov fs, dx
+    mov gs, dx
+
+    push dword USER_DS      ; ss
+    push ecx                ; esp
+    pushfd
+    or dword [esp], EFLAGS_IF
+    push dword USER_CS
+    push eax
+    iret
+
+; void user_return(uint32_t value)
+; Called from a syscall handler: drops the syscall's kernel frames and
+; returns value from user_enter.
+user_return:
+    mov eax, [esp + 4]
+    mov esp, [user_return_esp]
+
+    mov dx, KERNEL_DS
+    mov ds, dx
+    mov es, dx
+    mov fs, dx
+    mov dx, PERCPU_GS
+    mov gs, dx
+
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; Null-syscall benchmark, copied into a user page and run in ring 3.
+; Position independent. Stack on entry: iterations, whether to use
+; SYSENTER, and the number of a syscall that marks the switch from the
+; int 0x80 loop to the SYSENTER loop.
+align 16
+user_bench_start:
+    mov edi, [esp]
+    mov esi, edi
+.int_loop:
+    mov eax, SYS_NULL
+    int 0x80
+    dec esi
+    jnz .int_loop
+
+    mov eax, [esp + 8]
+    int 0x80
+    cmp dword [esp + 4], 0
+    je .done
+
+    call .base
+.base:
+    pop ebp
+    add ebp, .sysenter_ret - .base
+    mov esi, edi
+.sysenter_loop:
+    mov eax, SYS_NULL
+    mov ecx, esp
+    mov edx, ebp
+    sysenter
+.sysenter_ret:
+    dec esi
+    jnz .sysenter_loop
+
+.done:
+    mov eax, SYS_EXIT
+    xor ebx, ebx
+    int 0x80
+user_bench_end:
@@ -0,0 +1,69 @@
+#include "syscall.h"
+#include "isr.h"
+#include "gdt.h"
+#include "cpu.h"
+#include "sched.h"
+
+static syscall_fn syscall_table[SYSCALL_MAX];
+static bool sysenter_enabled;
+
+static int32_t sys_null(uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a1;
+    (void)a2;
+    (void)a3;
+    return 0;
+}
+
+static int32_t sys_exit(uint32_t a1, uint32_t a2, uint32_t a3) {
+    (void)a2;
+    (void)a3;
+    user_return(a1);
+}
+
+bool syscall_init(void) {
+    syscall_register(SYS_NULL, sys_null);
+    syscall_register(SYS_EXIT, sys_exit);
+
+    // Family 6 parts before model 3 stepping 3 report SEP but lack it
+    uint32_t sig = cpu_info.signature;
+    sysenter_enabled = CPU_HAS(features_edx, CPUID_EDX_SEP) && CPU_HAS(features_edx, CPUID_EDX_MSR) &&
+                       !(CPU_FAMILY(sig) == 6 && CPU_MODEL(sig) < 3 && CPU_STEPPING(sig) < 3);
+    syscall_init_cpu();
+    return true;
+}
+
+void syscall_init_cpu(void) {
+    if (sysenter_enabled) {
+        wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_CS);
+        wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+    }
+}
+
+bool syscall_sysenter_enabled(void) {
+    return sysenter_enabled;
+}
+
+bool syscall_register(uint32_t num, syscall_fn fn) {
+    if (num >= SYSCALL_MAX || !fn) return false;
+    syscall_table[num] = fn;
+    return true;
+}
+
+void syscall_unregister(uint32_t num) {
+    if (num < SYSCALL_MAX) syscall_table[num] = 0;
+}
+
+int32_t syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3) {
+    if (num >= SYSCALL_MAX || !syscall_table[num]) return -1;
+    return syscall_table[num](a1, a2, a3);
+}
+
+void syscall_handler(registers_t* regs) {
+    regs->eax = syscall_dispatch(regs->eax, regs->ebx, regs->esi, regs->edi);
+}
+
+void syscall_set_kernel_stack(uint32_t esp) {
+    thread_pin();
+    tss_set_kernel_stack(esp);
+    if (sysenter_enabled) wrmsr(MSR_SYSENTER_ESP, esp);
+}
@@ -0,0 +1,49 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// System calls from ring 3, through either entry:
+//
+// - int 0x80: builds a registers_t like any other interrupt
+// - SYSENTER: no IDT lookup and no iret frame. The caller passes its ESP
+//   in ECX and the return EIP in EDX; both are clobbered.
+//
+// Both take the number in EAX and up to three arguments in EBX, ESI and
+// EDI, and return the result in EAX.
+
+#define SYSCALL_VECTOR  0x80
+#define SYSCALL_MAX     64
+
+#define SYS_NULL        0   // Does nothing, for measuring the entry path
+#define SYS_EXIT        1   // Leave ring 3; user_enter() returns arg 1
+
+typedef int32_t (*syscall_fn)(uint32_t a1, uint32_t a2, uint32_t a3);
+
+// Fill the table and program the SYSENTER MSRs when the CPU has them
+bool syscall_init(void);
+void syscall_init_cpu(void);    // The MSRs again, on an application processor
+bool syscall_sysenter_enabled(void);
+
+bool syscall_register(uint32_t num, syscall_fn fn);
+void syscall_unregister(uint32_t num);
+
+// Called from the entry stubs; unknown numbers return -1. The int 0x80
+// side, syscall_handler(), is declared with the other stubs in isr.h.
+int32_t syscall_dispatch(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3);
+
+// Stack both entries switch to when coming from ring 3. Both are this
+// CPU's, so the calling thread is pinned to it from then on.
+void syscall_set_kernel_stack(uint32_t esp);
+
+// Run user code at eip on the user stack esp until it calls SYS_EXIT.
+// Pages must already be mapped PAGE_USER in the current address space.
+// Not reentrant. Implemented in syscall.asm.
+uint32_t user_enter(uint32_t eip, uint32_t esp);
+void user_return(uint32_t value) __attribute__((noreturn));
+
+// SYSENTER entry - implemented in syscall.asm
+void sysenter_entry(void);
+
+#endif // SYSCALL_H
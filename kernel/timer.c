@@ -0,0 +1,345 @@
+#include "timer.h"
+#include "clock.h"
+#include "deferred.h"
+#include "sched.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "div64.h"
+
+// One wheel for every CPU, advanced by the boot CPU's tick and locked
+// with interrupts off
+static struct timer_wheel kernel_wheel;
+static struct spinlock wheel_lock = SPINLOCK_INIT("timer wheel");
+
+// Callback timer_run is in, once it has dropped wheel_lock to call it,
+// and the CPU it runs on; for timer_cancel_sync
+static struct timer* volatile timer_running;
+static uint32_t timer_running_cpu;
+
+static void timer_run(void* arg);
+static struct deferred_work timer_work = DEFERRED_WORK_INIT(timer_run, 0);
+
+static inline uint32_t level_shift(uint32_t level) {
+    return level ? TIMER_LVL0_BITS + (level - 1) * TIMER_LVL_BITS : 0;
+}
+
+static inline uint32_t level_size(uint32_t level) {
+    return level ? TIMER_LVL_SIZE : TIMER_LVL0_SIZE;
+}
+
+static inline struct timer** slot_head(struct timer_wheel* w, uint32_t level, uint32_t index) {
+    return level ? &w->levels[level - 1][index] : &w->level0[index];
+}
+
+static inline uint32_t* level_bitmap(struct timer_wheel* w, uint32_t level) {
+    return level ? w->bitmaps[level - 1] : w->bitmap0;
+}
+
+static inline uint32_t lowest_bit(uint32_t x) {
+    uint32_t r;
+    __asm__("bsf %1, %0" : "=r"(r) : "rm"(x));
+    return r;
+}
+
+// Distance from start to the first set bit, wrapping at nbits; -1 if none
+static int32_t find_next_set(const uint32_t* bitmap, uint32_t nbits, uint32_t start) {
+    uint32_t n = 0;
+    while (n < nbits) {
+        uint32_t bit = (start + n) & (nbits - 1);
+        uint32_t word = bitmap[bit / 32] >> (bit % 32);
+        if (word) return n + lowest_bit(word);
+        n += 32 - bit % 32;
+    }
+    return -1;
+}
+
+static void enqueue(struct timer_wheel* w, struct timer* t) {
+    uint32_t delta = t->expires - w->next_tick;
+    uint32_t level = 0, index;
+
+    if ((int32_t)delta < 0) {
+        index = w->next_tick & (TIMER_LVL0_SIZE - 1);   // Overdue: the next tick runs it
+    } else if (delta < TIMER_LVL0_SIZE) {
+        index = t->expires & (TIMER_LVL0_SIZE - 1);
+    } else {
+        level = 1;
+        while (level < TIMER_LEVELS - 1 && delta >= (1u << level_shift(level + 1))) level++;
+        index = (t->expires >> level_shift(level)) & (TIMER_LVL_SIZE - 1);
+    }
+
+    struct timer** head = slot_head(w, level, index);
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->slot = level * TIMER_LVL0_SIZE + index;
+    level_bitmap(w, level)[index / 32] |= 1u << (index % 32);
+}
+
+static void unlink(struct timer_wheel* w, struct timer* t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+
+    if (t->slot == TIMER_SLOT_EXPIRED) {
+        if (w->expired_tail == &t->next) w->expired_tail = t->pprev;
+    } else {
+        uint32_t level = t->slot / TIMER_LVL0_SIZE;
+        uint32_t index = t->slot % TIMER_LVL0_SIZE;
+        if (!*slot_head(w, level, index)) {
+            level_bitmap(w, level)[index / 32] &= ~(1u << (index % 32));
+        }
+    }
+    t->pprev = 0;
+}
+
+// Detach a slot's list, clearing its bitmap bit
+static struct timer* take_slot(struct timer_wheel* w, uint32_t level, uint32_t index) {
+    struct timer** head = slot_head(w, level, index);
+    struct timer* list = *head;
+    *head = 0;
+    level_bitmap(w, level)[index / 32] &= ~(1u << (index % 32));
+    return list;
+}
+
+static void cascade(struct timer_wheel* w, uint32_t level, uint32_t index) {
+    struct timer* t = take_slot(w, level, index);
+    while (t) {
+        struct timer* next = t->next;
+        enqueue(w, t);
+        t = next;
+    }
+}
+
+void timer_wheel_init(struct timer_wheel* wheel, uint32_t now) {
+    uint8_t* bytes = (uint8_t*)wheel;
+    for (uint32_t i = 0; i < sizeof(struct timer_wheel); i++) bytes[i] = 0;
+
+    wheel->next_tick = now;
+    wheel->expired_tail = &wheel->expired;
+}
+
+void timer_wheel_add(struct timer_wheel* wheel, struct timer* timer, uint32_t expires) {
+    if (timer->pprev) {
+        unlink(timer->wheel, timer);
+        timer->wheel->pending--;
+    }
+    timer->wheel = wheel;
+    timer->expires = expires;
+    enqueue(wheel, timer);
+    wheel->pending++;
+}
+
+bool timer_wheel_del(struct timer* timer) {
+    if (!timer->pprev) return false;
+    unlink(timer->wheel, timer);
+    timer->wheel->pending--;
+    return true;
+}
+
+uint32_t timer_wheel_advance(struct timer_wheel* wheel, uint32_t now) {
+    uint32_t expired = 0;
+
+    while ((int32_t)(now - wheel->next_tick) >= 0) {
+        uint32_t tick = wheel->next_tick;
+        uint32_t index = tick & (TIMER_LVL0_SIZE - 1);
+
+        // Level 0 wrapped: bring the next slot of each level that also
+        // wrapped down towards it
+        if (index == 0) {
+            for (uint32_t level = 1; level < TIMER_LEVELS; level++) {
+                uint32_t upper = (tick >> level_shift(level)) & (TIMER_LVL_SIZE - 1);
+                cascade(wheel, level, upper);
+                if (upper) break;
+            }
+        }
+
+        struct timer* list = take_slot(wheel, 0, index);
+        if (list) {
+            list->pprev = wheel->expired_tail;
+            *wheel->expired_tail = list;
+            for (struct timer* t = list; t; t = t->next) {
+                t->slot = TIMER_SLOT_EXPIRED;
+                wheel->expired_tail = &t->next;
+                expired++;
+            }
+        }
+        wheel->next_tick = ++tick;
+
+        // Skip empty slots up to the next cascade, without passing now
+        index = tick & (TIMER_LVL0_SIZE - 1);
+        if (index) {
+            int32_t gap = find_next_set(wheel->bitmap0, TIMER_LVL0_SIZE, index);
+            uint32_t skip = (gap >= 0 && (uint32_t)gap < TIMER_LVL0_SIZE - index) ? (uint32_t)gap
+                                                                                : TIMER_LVL0_SIZE - index;
+            if (skip > now - tick + 1) skip = now - tick + 1;
+            wheel->next_tick = tick + skip;
+        }
+    }
+    return expired;
+}
+
+struct timer* timer_wheel_pop_expired(struct timer_wheel* wheel) {
+    struct timer* t = wheel->expired;
+    if (!t) return 0;
+    unlink(wheel, t);
+    wheel->pending--;
+    return t;
+}
+
+bool timer_wheel_next_expiry(struct timer_wheel* wheel, uint32_t* tick) {
+    uint32_t now = wheel->next_tick;
+    uint32_t best = 0xFFFFFFFF;
+    bool found = false;
+
+    if (wheel->expired) {
+        *tick = now;
+        return true;
+    }
+
+    int32_t gap = find_next_set(wheel->bitmap0, TIMER_LVL0_SIZE, now & (TIMER_LVL0_SIZE - 1));
+    if (gap >= 0) {
+        best = gap;
+        found = true;
+    }
+
+    // An upper slot counts from the tick it cascades at. The current slot
+    // still cascades at now if now is on that level's boundary, and a
+    // whole turn later otherwise.
+    for (uint32_t level = 1; level < TIMER_LEVELS; level++) {
+        uint32_t shift = level_shift(level);
+        uint32_t base = now >> shift;
+        bool aligned = (now & ((1u << shift) - 1)) == 0;
+
+        gap = find_next_set(level_bitmap(wheel, level), TIMER_LVL_SIZE,
+                            (base + !aligned) & (TIMER_LVL_SIZE - 1));
+        if (gap < 0) continue;
+
+        uint32_t distance = ((base + !aligned + gap) << shift) - now;
+        if (!found || distance < best) best = distance;
+        found = true;
+    }
+
+    if (found) *tick = now + best;
+    return found;
+}
+
+static inline uint32_t now_tick(void) {
+    return (uint32_t)clock_ticks;
+}
+
+// Clock event handler, on every tick and once after tickless idle
+static void timer_tick(void) {
+    spin_lock(&wheel_lock);
+    timer_wheel_advance(&kernel_wheel, now_tick());
+    bool expired = kernel_wheel.expired != 0;
+    spin_unlock(&wheel_lock);
+
+    if (expired) defer_work(&timer_work);
+}
+
+static void timer_run(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&wheel_lock);
+
+        struct timer* t = timer_wheel_pop_expired(&kernel_wheel);
+        if (t && t->period) {
+            // Keep the phase, but skip periods missed while running late
+            uint32_t expires = t->expires + t->period;
+            if ((int32_t)(expires - now_tick()) <= 0) expires = now_tick() + t->period;
+            timer_wheel_add(&kernel_wheel, t, expires);
+        }
+
+        timer_running = t;
+        timer_running_cpu = cpu_index();
+        spin_unlock_irqrestore(&wheel_lock, flags);
+        if (!t) break;
+        t->fn(t->arg);
+
+        __asm__ volatile("" : : : "memory");
+        timer_running = 0;
+    }
+}
+
+static uint64_t timer_next_event(void) {
+    uint32_t tick;
+    spin_lock(&wheel_lock);
+    bool found = timer_wheel_next_expiry(&kernel_wheel, &tick);
+    spin_unlock(&wheel_lock);
+    if (!found) return CLOCK_NO_EVENT;
+
+    uint64_t now = ktime_get_ns();
+    int32_t ticks = tick - now_tick();
+    return ticks > 0 ? now + (uint64_t)ticks * clock_tick_ns() : now;
+}
+
+void timer_init(void) {
+    timer_wheel_init(&kernel_wheel, now_tick() + 1);
+    clock_set_next_event_source(timer_next_event);
+    clock_set_event_handler(timer_tick);
+}
+
+void timer_setup(struct timer* timer, void (*fn)(void* arg), void* arg) {
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->wheel = 0;
+    timer->period = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+static void timer_arm(struct timer* timer, uint32_t delay, uint32_t period) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    timer->period = period;
+    timer_wheel_add(&kernel_wheel, timer, now_tick() + delay);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    // The boot CPU may be asleep in tickless idle with a one-shot set for
+    // a later event; waking it makes it look at the wheel again
+    if (cpu_index() != 0 && sched_cpu_idle(0)) smp_send_resched(0);
+}
+
+void timer_start(struct timer* timer, uint32_t delay_ticks) {
+    timer_arm(timer, delay_ticks, 0);
+}
+
+void timer_start_periodic(struct timer* timer, uint32_t period_ticks) {
+    if (!period_ticks) period_ticks = 1;
+    timer_arm(timer, period_ticks, period_ticks);
+}
+
+bool timer_cancel(struct timer* timer) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    bool pending = timer_wheel_del(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+bool timer_cancel_sync(struct timer* timer) {
+    bool pending = false;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&wheel_lock);
+        pending |= timer_wheel_del(timer);
+        // On the callback's own CPU we are the callback, or interrupted it
+        bool wait = timer_running == timer && timer_running_cpu != cpu_index();
+        spin_unlock_irqrestore(&wheel_lock, flags);
+        if (!wait) return pending;
+
+        // It may restart the timer before it returns; go round and cancel
+        // that too
+        while (timer_running == timer) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+bool timer_pending(const struct timer* timer) {
+    return timer->pprev != 0;
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    uint64_t ticks = (uint64_t)ms * CLOCK_TICK_HZ + 999;
+    div64_u32(&ticks, 1000);
+    return ticks ? (uint32_t)ticks : 1;
+}
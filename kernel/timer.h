@@ -0,0 +1,80 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Kernel timers on a hierarchical timing wheel driven by the clock tick.
+//
+// Level 0 has one slot per tick for the next 256 ticks; each of the four
+// levels above has 64 slots, each slot covering 64 times as many ticks as
+// one below, which reaches the whole 32-bit tick range. Inserting and
+// cancelling are O(1). A tick empties one level 0 slot; every 256 ticks
+// the next slot of level 1 is cascaded down into level 0, and so on up
+// the levels, so a timer moves at most four times before it expires.
+// Per-level bitmaps of non-empty slots let a catch-up after tickless
+// idle skip empty slots and give the idle loop the next expiry.
+//
+// Callbacks run from deferred work, with interrupts enabled, in the order
+// their ticks came due. A callback may restart or cancel its own timer.
+// timer_run drops the wheel lock around each callback, so timer_cancel
+// can return while the callback still runs on another CPU.
+
+#define TIMER_LEVELS      5
+#define TIMER_LVL0_BITS   8
+#define TIMER_LVL0_SIZE   (1 << TIMER_LVL0_BITS)
+#define TIMER_LVL_BITS    6
+#define TIMER_LVL_SIZE    (1 << TIMER_LVL_BITS)
+
+struct timer_wheel;
+
+struct timer {
+    struct timer* next;
+    struct timer** pprev;       // NULL while not pending
+    struct timer_wheel* wheel;
+    uint32_t expires;           // Tick, compared modulo 2^32
+    uint32_t period;            // Ticks between runs, 0 for one-shot
+    uint16_t slot;              // Level * 256 + index, or TIMER_SLOT_EXPIRED
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+#define TIMER_SLOT_EXPIRED 0xFFFF
+#define TIMER_INIT(f, a) { 0, 0, 0, 0, 0, 0, (f), (a) }
+
+struct timer_wheel {
+    uint32_t next_tick;         // First tick not yet processed
+    struct timer* level0[TIMER_LVL0_SIZE];
+    struct timer* levels[TIMER_LEVELS - 1][TIMER_LVL_SIZE];
+    uint32_t bitmap0[TIMER_LVL0_SIZE / 32];
+    uint32_t bitmaps[TIMER_LEVELS - 1][TIMER_LVL_SIZE / 32];
+    struct timer* expired;      // Due, waiting for their callbacks
+    struct timer** expired_tail;
+    uint32_t pending;           // Timers in the slots and on expired
+};
+
+// Kernel timers, on the wheel driven by clock_ticks
+void timer_init(void);
+void timer_setup(struct timer* timer, void (*fn)(void* arg), void* arg);
+void timer_start(struct timer* timer, uint32_t delay_ticks);      // Restarts a pending timer
+void timer_start_periodic(struct timer* timer, uint32_t period_ticks);
+bool timer_cancel(struct timer* timer);     // False if it was not pending
+// Cancel, then wait for the callback if another CPU is running it, so the
+// timer and its argument can be freed. Not under a lock the callback takes.
+bool timer_cancel_sync(struct timer* timer);
+bool timer_pending(const struct timer* timer);
+uint32_t timer_ms_to_ticks(uint32_t ms);    // Rounded up, at least 1
+
+// The wheel itself, exposed so it can be driven directly by benchmarks.
+// None of these disable interrupts.
+void timer_wheel_init(struct timer_wheel* wheel, uint32_t now);
+void timer_wheel_add(struct timer_wheel* wheel, struct timer* timer, uint32_t expires);
+bool timer_wheel_del(struct timer* timer);
+uint32_t timer_wheel_advance(struct timer_wheel* wheel, uint32_t now);  // Moves due timers to expired
+struct timer* timer_wheel_pop_expired(struct timer_wheel* wheel);
+// Earliest tick at which anything can come due; a lower bound, since a
+// timer on an upper level only counts from when it cascades. False when
+// the wheel is empty.
+bool timer_wheel_next_expiry(struct timer_wheel* wheel, uint32_t* tick);
+
+#endif // TIMER_H
@@ -0,0 +1,80 @@
+; trampoline.asm - Application processor startup
+;
+; smp_init copies this code to AP_TRAMPOLINE and points each AP's startup
+; IPI at it, so the AP starts here in real mode at 0x0800:0000. Like the
+; bootloader's mode switch it loads a flat GDT and sets CR0.PE; then it
+; turns paging on with the boot CPU's page directory and control bits,
+; and jumps to ap_main on the stack smp_init left in the parameters. The
+; code is copied, never run in place, so every address is taken relative
+; to ap_trampoline_start.
+[BITS 16]
+
+TRAMPOLINE_BASE equ 0x8000
+CODE_SEG equ 0x08
+DATA_SEG equ 0x10
+CR0_PE equ 1
+
+%define REL(label) (TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+global ap_trampoline_start, ap_trampoline_end, ap_trampoline_params
+
+section .text
+
+ap_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    lgdt [gdt_descriptor - ap_trampoline_start]
+
+    mov eax, cr0
+    or eax, CR0_PE
+    mov cr0, eax
+
+    jmp dword CODE_SEG:REL(protected_mode)
+
+[BITS 32]
+protected_mode:
+    mov ax, DATA_SEG
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; CR4 first for PSE and PGE, then the directory; this page is
+    ; identity mapped, so execution carries on once CR0.PG is set
+    mov eax, [REL(ap_trampoline_params.cr4)]
+    mov cr4, eax
+    mov eax, [REL(ap_trampoline_params.cr3)]
+    mov cr3, eax
+    mov eax, [REL(ap_trampoline_params.cr0)]
+    mov cr0, eax
+
+    mov esp, [REL(ap_trampoline_params.stack)]
+    push dword [REL(ap_trampoline_params.cpu)]
+    push dword 0            ; ap_main never returns
+    jmp [REL(ap_trampoline_params.entry)]
+
+align 8
+gdt_start:
+    dd 0x0, 0x0           ; Null descriptor
+    db 0xFF, 0xFF, 0x00, 0x00, 0x00, 10011010b, 11001111b, 0x00  ; Code segment
+    db 0xFF, 0xFF, 0x00, 0x00, 0x00, 10010010b, 11001111b, 0x00  ; Data segment
+gdt_end:
+
+gdt_descriptor:
+    dw gdt_end - gdt_start - 1
+    dd REL(gdt_start)
+
+; Filled in by smp_init in the copy, see struct ap_params in smp.c
+align 4
+ap_trampoline_params:
+.cr0:   dd 0
+.cr3:   dd 0
+.cr4:   dd 0
+.stack: dd 0
+.entry: dd 0
+.cpu:   dd 0
+
+ap_trampoline_end:
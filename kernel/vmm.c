@@ -0,0 +1,244 @@
+#include "vmm.h"
+#include "paging.h"
+#include "pmm.h"
+#include "memory.h"
+#include "cpu.h"
+#include <string.h>
+
+// Each address space owns a page directory whose user half points at its
+// own page tables; the kernel half is a copy of the kernel directory.
+//
+// Sharing is tracked per frame by the PMM. A shared page is mapped
+// read-only with PAGE_COW in every address space that holds it; the
+// first write fault copies it, or takes it over when no other reference
+// is left. The zero page is never counted or freed.
+
+#define USER_PDE_FIRST (USER_BASE >> LARGE_PAGE_SHIFT)
+#define USER_PDE_END   (USER_END >> LARGE_PAGE_SHIFT)
+#define PTES_PER_TABLE 1024
+
+static struct address_space kernel_space;
+static struct address_space* current_space = &kernel_space;
+static uint32_t zero_page;
+
+bool vmm_init(void) {
+    zero_page = pmm_alloc_page();
+    if (!zero_page) return false;
+    memset((void*)zero_page, 0, PAGE_SIZE);
+
+    kernel_space.pd = paging_kernel_pd();
+    kernel_space.regions = NULL;
+    current_space = &kernel_space;
+    return true;
+}
+
+struct address_space* vmm_kernel_space(void) {
+    return &kernel_space;
+}
+
+struct address_space* vmm_current(void) {
+    return current_space;
+}
+
+struct address_space* vmm_create(void) {
+    struct address_space* as = kmalloc(sizeof(struct address_space));
+    if (!as) return NULL;
+
+    uint32_t pd = pmm_alloc_page();
+    if (!pd) {
+        kfree(as);
+        return NULL;
+    }
+    as->pd = (uint32_t*)pd;
+    as->regions = NULL;
+
+    uint32_t* kernel_pd = paging_kernel_pd();
+    for (uint32_t i = 0; i < PTES_PER_TABLE; i++) {
+        bool user = i >= USER_PDE_FIRST && i < USER_PDE_END;
+        as->pd[i] = user ? 0 : kernel_pd[i];
+    }
+    return as;
+}
+
+// Drop every user mapping and the page tables behind them
+static void release_user_pages(struct address_space* as) {
+    for (uint32_t i = USER_PDE_FIRST; i < USER_PDE_END; i++) {
+        if (!(as->pd[i] & PAGE_PRESENT)) continue;
+
+        uint32_t* pt = (uint32_t*)(as->pd[i] & PAGE_FRAME_MASK);
+        for (uint32_t j = 0; j < PTES_PER_TABLE; j++) {
+            uint32_t frame = pt[j] & PAGE_FRAME_MASK;
+            if ((pt[j] & PAGE_PRESENT) && frame != zero_page) {
+                pmm_release_page(frame);
+            }
+        }
+        pmm_free_page((uint32_t)pt);
+        as->pd[i] = 0;
+    }
+}
+
+void vmm_destroy(struct address_space* as) {
+    if (!as || as == &kernel_space) return;
+    if (as == current_space) vmm_switch(&kernel_space);
+
+    release_user_pages(as);
+
+    struct vm_region* region = as->regions;
+    while (region) {
+        struct vm_region* next = region->next;
+        kfree(region);
+        region = next;
+    }
+    pmm_free_page((uint32_t)as->pd);
+    kfree(as);
+}
+
+void vmm_switch(struct address_space* as) {
+    current_space = as;
+    write_cr3((uint32_t)as->pd);
+}
+
+static struct vm_region* find_region(struct address_space* as, uint32_t addr) {
+    for (struct vm_region* region = as->regions; region; region = region->next) {
+        if (addr >= region->start && addr < region->end) return region;
+    }
+    return NULL;
+}
+
+bool vmm_map_anon(struct address_space* as, uint32_t start, uint32_t size, uint32_t flags) {
+    uint32_t end = start + size;
+
+    if (!as || as == &kernel_space || size == 0) return false;
+    if ((start | size) & (PAGE_SIZE - 1)) return false;
+    if (start < USER_BASE || end > USER_END || end < start) return false;
+
+    for (struct vm_region* r = as->regions; r; r = r->next) {
+        if (start < r->end && end > r->start) return false;
+    }
+
+    struct vm_region* region = kmalloc(sizeof(struct vm_region));
+    if (!region) return false;
+    region->start = start;
+    region->end = end;
+    region->flags = flags & (PAGE_WRITE | PAGE_USER);
+    region->next = as->regions;
+    as->regions = region;
+    return true;
+}
+
+uint32_t vmm_resident_pages(struct address_space* as) {
+    uint32_t count = 0;
+
+    for (uint32_t i = USER_PDE_FIRST; i < USER_PDE_END; i++) {
+        if (!(as->pd[i] & PAGE_PRESENT)) continue;
+
+        uint32_t* pt = (uint32_t*)(as->pd[i] & PAGE_FRAME_MASK);
+        for (uint32_t j = 0; j < PTES_PER_TABLE; j++) {
+            if ((pt[j] & PAGE_PRESENT) && (pt[j] & PAGE_FRAME_MASK) != zero_page) count++;
+        }
+    }
+    return count;
+}
+
+// Give the faulting page a writable frame of its own
+static bool break_cow(uint32_t* pte, uint32_t page, uint32_t flags) {
+    uint32_t frame = *pte & PAGE_FRAME_MASK;
+    uint32_t pte_flags = PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
+
+    if (frame != zero_page && !pmm_page_shared(frame)) {
+        // Every other sharer has copied or gone away
+        *pte = frame | pte_flags;
+    } else {
+        uint32_t copy = pmm_alloc_page();
+        if (!copy) return false;
+
+        if (frame == zero_page) {
+            memset((void*)copy, 0, PAGE_SIZE);
+        } else {
+            memcpy((void*)copy, (void*)frame, PAGE_SIZE);
+            pmm_release_page(frame);
+        }
+        *pte = copy | pte_flags;
+    }
+    invlpg(page);
+    return true;
+}
+
+bool vmm_handle_fault(uint32_t addr, uint32_t err_code) {
+    struct vm_region* region = find_region(current_space, addr);
+    if (!region) return false;
+    if ((err_code & PF_WRITE) && !(region->flags & PAGE_WRITE)) return false;
+
+    uint32_t page = addr & PAGE_FRAME_MASK;
+    uint32_t* pte = paging_pte(current_space->pd, page, true);
+    if (!pte) return false;
+
+    if (!(*pte & PAGE_PRESENT)) {
+        // Fresh memory reads as the zero page; a write takes the COW
+        // path below and gets its own zeroed frame
+        *pte = zero_page | PAGE_PRESENT | (region->flags & PAGE_USER) |
+               ((region->flags & PAGE_WRITE) ? PAGE_COW : 0);
+        invlpg(page);
+        if (!(err_code & PF_WRITE)) return true;
+    }
+
+    if ((err_code & PF_WRITE) && (*pte & PAGE_COW)) {
+        return break_cow(pte, page, region->flags);
+    }
+    return false;
+}
+
+struct address_space* vmm_clone(struct address_space* src, uint32_t flags) {
+    struct address_space* dst = vmm_create();
+    if (!dst) return NULL;
+
+    for (struct vm_region* r = src->regions; r; r = r->next) {
+        if (!vmm_map_anon(dst, r->start, r->end - r->start, r->flags)) goto fail;
+    }
+
+    for (uint32_t i = USER_PDE_FIRST; i < USER_PDE_END; i++) {
+        if (!(src->pd[i] & PAGE_PRESENT)) continue;
+
+        uint32_t* src_pt = (uint32_t*)(src->pd[i] & PAGE_FRAME_MASK);
+        uint32_t* dst_pt = paging_pte(dst->pd, i << LARGE_PAGE_SHIFT, true);   // Entry 0
+        if (!dst_pt) goto fail;
+
+        for (uint32_t j = 0; j < PTES_PER_TABLE; j++) {
+            uint32_t pte = src_pt[j];
+            uint32_t frame = pte & PAGE_FRAME_MASK;
+
+            if (!(pte & PAGE_PRESENT)) continue;
+            pte &= ~(PAGE_ACCESSED | PAGE_DIRTY);
+
+            if (frame == zero_page) {
+                dst_pt[j] = pte;
+            } else if (flags & VMM_CLONE_EAGER) {
+                uint32_t copy = pmm_alloc_page();
+                if (!copy) goto fail;
+                memcpy((void*)copy, (void*)frame, PAGE_SIZE);
+
+                // The copy is private, so a COW page becomes writable
+                if (pte & PAGE_COW) pte = (pte & ~PAGE_COW) | PAGE_WRITE;
+                dst_pt[j] = copy | (pte & PAGE_FLAGS_MASK);
+            } else {
+                if (pte & PAGE_WRITE) {
+                    pte = (pte & ~PAGE_WRITE) | PAGE_COW;
+                    src_pt[j] &= ~PAGE_WRITE;
+                    src_pt[j] |= PAGE_COW;
+                }
+                pmm_share_page(frame);
+                dst_pt[j] = pte;
+            }
+        }
+    }
+
+    // Parent entries lost PAGE_WRITE; user pages are not global, so a
+    // CR3 reload drops them from the TLB
+    if (!(flags & VMM_CLONE_EAGER) && src == current_space) write_cr3(read_cr3());
+    return dst;
+
+fail:
+    if (!(flags & VMM_CLONE_EAGER) && src == current_space) write_cr3(read_cr3());
+    vmm_destroy(dst);
+    return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef VMM_H
+#define VMM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Address spaces for [USER_BASE, USER_END). Memory is anonymous: a page
+// reads as the shared zero page until first written, and a clone shares
+// every frame copy-on-write until either side writes to it.
+
+struct vm_region {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;             // PAGE_WRITE, PAGE_USER
+    struct vm_region* next;
+};
+
+struct address_space {
+    uint32_t* pd;               // Page directory, reached through the direct map
+    struct vm_region* regions;
+};
+
+// vmm_clone() flags
+#define VMM_CLONE_EAGER 0x01    // Copy every page up front instead of sharing
+
+bool vmm_init(void);
+struct address_space* vmm_kernel_space(void);
+struct address_space* vmm_current(void);
+
+struct address_space* vmm_create(void);
+struct address_space* vmm_clone(struct address_space* src, uint32_t flags);
+void vmm_destroy(struct address_space* as);
+void vmm_switch(struct address_space* as);
+
+// Reserve page-aligned anonymous memory; nothing is backed until touched
+bool vmm_map_anon(struct address_space* as, uint32_t start, uint32_t size, uint32_t flags);
+uint32_t vmm_resident_pages(struct address_space* as);  // Mapped frames, zero page excluded
+
+// Called by the page-fault handler for user addresses
+bool vmm_handle_fault(uint32_t addr, uint32_t err_code);
+
+#endif // VMM_H
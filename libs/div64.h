@@ -0,0 +1,32 @@
+#ifndef _DIV64_H
+#define _DIV64_H
+
+#include "stdint.h"
+
+// 64-by-32 bit division without libgcc's __udivdi3: divides *n by base in
+// place and returns the remainder
+static inline uint32_t div64_u32(uint64_t* n, uint32_t base) {
+    uint32_t high = (uint32_t)(*n >> 32);
+    uint32_t low = (uint32_t)*n;
+    uint32_t quot_high = 0;
+    uint32_t rem;
+
+    if (high >= base) {
+        quot_high = high / base;
+        high %= base;
+    }
+    __asm__("divl %4" : "=a"(low), "=d"(rem) : "0"(low), "1"(high), "rm"(base));
+
+    *n = ((uint64_t)quot_high << 32) | low;
+    return rem;
+}
+
+// (n * mult) >> shift for shift <= 32, as two 32x32 multiplies; exact
+// as long as the result fits in 64 bits
+static inline uint64_t mul_u64_u32_shr(uint64_t n, uint32_t mult, uint32_t shift) {
+    uint64_t low = ((uint64_t)(uint32_t)n * mult) >> shift;
+    uint64_t high = (uint64_t)(uint32_t)(n >> 32) * mult;
+    return low + (high << (32 - shift));
+}
+
+#endif /* _DIV64_H */
@@ -0,0 +1,245 @@
+// string.c - Freestanding memory primitives
+#include "string.h"
+#include "fpu.h"
+
+// The kernel builds with -fno-builtin and -nostdlib, so these are the only
+// memcpy/memset in the image; the compiler also emits calls to them for
+// large struct copies. Each public entry point jumps through a pointer set
+// once at boot by string_init().
+//
+// - movsd: REP MOVSD for the bulk, REP MOVSB for the tail. Works everywhere.
+// - movsb: a single REP MOVSB, fastest on CPUs with ERMS.
+// - sse2:  64 bytes per iteration through xmm0-3 into a 16-byte aligned
+//          destination; non-temporal stores above NT_MIN_SIZE so a huge
+//          copy does not flush the cache. Small sizes fall back to movsd,
+//          as does any call made while another kernel_fpu_begin() section
+//          is active, e.g. from an interrupt that arrived during one.
+
+#define SSE2_MIN_SIZE 256
+#define NT_MIN_SIZE   (256 * 1024)
+
+typedef uint32_t __attribute__((may_alias)) u32_alias;
+
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_movsd;
+static void* (*memset_impl)(void*, int, size_t) = memset_stosd;
+static uint32_t active_features;
+
+void* memcpy_movsd(void* dst, const void* src, size_t n) {
+    uint32_t d0, d1, d2;
+    __asm__ volatile("rep movsl\n\t"
+                     "movl %4, %%ecx\n\t"
+                     "andl $3, %%ecx\n\t"
+                     "jz 1f\n\t"
+                     "rep movsb\n"
+                     "1:"
+                     : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                     : "0"(n / 4), "g"(n), "1"(dst), "2"(src)
+                     : "memory");
+    return dst;
+}
+
+void* memcpy_movsb(void* dst, const void* src, size_t n) {
+    uint32_t d0, d1, d2;
+    __asm__ volatile("rep movsb"
+                     : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                     : "0"(n), "1"(dst), "2"(src)
+                     : "memory");
+    return dst;
+}
+
+#define SSE2_COPY_LOOP(load, store)             \
+    __asm__ volatile("1:\n\t"                   \
+                     load " (%1), %%xmm0\n\t"   \
+                     load " 16(%1), %%xmm1\n\t" \
+                     load " 32(%1), %%xmm2\n\t" \
+                     load " 48(%1), %%xmm3\n\t" \
+                     store " %%xmm0, (%0)\n\t"  \
+                     store " %%xmm1, 16(%0)\n\t"\
+                     store " %%xmm2, 32(%0)\n\t"\
+                     store " %%xmm3, 48(%0)\n\t"\
+                     "add $64, %1\n\t"          \
+                     "add $64, %0\n\t"          \
+                     "dec %2\n\t"               \
+                     "jnz 1b"                   \
+                     : "+r"(d), "+r"(s), "+r"(lines) \
+                     :                          \
+                     : "xmm0", "xmm1", "xmm2", "xmm3", "memory")
+
+__attribute__((target("sse2")))
+void* memcpy_sse2(void* dst, const void* src, size_t n) {
+    if (n < SSE2_MIN_SIZE || !kernel_fpu_begin()) return memcpy_movsd(dst, src, n);
+
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    int nontemporal = n >= NT_MIN_SIZE;
+
+    size_t head = -(uint32_t)d & 15;
+    if (head) {
+        memcpy_movsd(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+    }
+
+    size_t lines = n / 64;
+    n -= lines * 64;
+    if (nontemporal) {
+        SSE2_COPY_LOOP("movdqu", "movntdq");
+        __asm__ volatile("sfence" : : : "memory");
+    } else if (((uint32_t)s & 15) == 0) {
+        SSE2_COPY_LOOP("movdqa", "movdqa");
+    } else {
+        SSE2_COPY_LOOP("movdqu", "movdqa");
+    }
+    kernel_fpu_end();
+
+    memcpy_movsd(d, s, n);
+    return dst;
+}
+
+void* memset_stosd(void* dst, int c, size_t n) {
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    uint32_t d0, d1;
+    __asm__ volatile("rep stosl\n\t"
+                     "movl %4, %%ecx\n\t"
+                     "andl $3, %%ecx\n\t"
+                     "jz 1f\n\t"
+                     "rep stosb\n"
+                     "1:"
+                     : "=&c"(d0), "=&D"(d1)
+                     : "0"(n / 4), "a"(pattern), "g"(n), "1"(dst)
+                     : "memory");
+    return dst;
+}
+
+void* memset_stosb(void* dst, int c, size_t n) {
+    uint32_t d0, d1;
+    __asm__ volatile("rep stosb"
+                     : "=&c"(d0), "=&D"(d1)
+                     : "0"(n), "a"(c), "1"(dst)
+                     : "memory");
+    return dst;
+}
+
+#define SSE2_FILL_LOOP(store)                   \
+    __asm__ volatile("movd %2, %%xmm0\n\t"      \
+                     "pshufd $0, %%xmm0, %%xmm0\n" \
+                     "1:\n\t"                   \
+                     store " %%xmm0, (%0)\n\t"  \
+                     store " %%xmm0, 16(%0)\n\t"\
+                     store " %%xmm0, 32(%0)\n\t"\
+                     store " %%xmm0, 48(%0)\n\t"\
+                     "add $64, %0\n\t"          \
+                     "dec %1\n\t"               \
+                     "jnz 1b"                   \
+                     : "+r"(d), "+r"(lines)     \
+                     : "r"(pattern)             \
+                     : "xmm0", "memory")
+
+__attribute__((target("sse2")))
+void* memset_sse2(void* dst, int c, size_t n) {
+    if (n < SSE2_MIN_SIZE || !kernel_fpu_begin()) return memset_stosd(dst, c, n);
+
+    uint8_t* d = dst;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    int nontemporal = n >= NT_MIN_SIZE;
+
+    size_t head = -(uint32_t)d & 15;
+    if (head) {
+        memset_stosd(d, c, head);
+        d += head;
+        n -= head;
+    }
+
+    size_t lines = n / 64;
+    n -= lines * 64;
+    if (nontemporal) {
+        SSE2_FILL_LOOP("movntdq");
+        __asm__ volatile("sfence" : : : "memory");
+    } else {
+        SSE2_FILL_LOOP("movdqa");
+    }
+    kernel_fpu_end();
+
+    memset_stosd(d, c, n);
+    return dst;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    return memcpy_impl(dst, src, n);
+}
+
+void* memset(void* dst, int c, size_t n) {
+    return memset_impl(dst, c, n);
+}
+
+void* memmove(void* dst, const void* src, size_t n) {
+    // Every memcpy variant copies front to back, reading each block before
+    // writing it, so a forward copy is safe whenever dst is below src
+    if ((uint32_t)dst <= (uint32_t)src || (uint32_t)dst >= (uint32_t)src + n) {
+        return memcpy_impl(dst, src, n);
+    }
+
+    // Overlapping with dst above src: copy back to front
+    uint32_t d0, d1, d2;
+    __asm__ volatile("std\n\t"
+                     "rep movsb\n\t"
+                     "subl $3, %%esi\n\t"
+                     "subl $3, %%edi\n\t"
+                     "movl %4, %%ecx\n\t"
+                     "rep movsl\n\t"
+                     "cld"
+                     : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                     : "0"(n & 3), "g"(n / 4),
+                       "1"((uint8_t*)dst + n - 1), "2"((const uint8_t*)src + n - 1)
+                     : "memory");
+    return dst;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* p = a;
+    const uint8_t* q = b;
+
+    while (n >= 4 && *(const u32_alias*)p == *(const u32_alias*)q) {
+        p += 4;
+        q += 4;
+        n -= 4;
+    }
+    for (; n; n--, p++, q++) {
+        if (*p != *q) return *p - *q;
+    }
+    return 0;
+}
+
+void* memset16(void* dst, uint16_t value, size_t n) {
+    uint32_t pattern = value | ((uint32_t)value << 16);
+    uint32_t d0, d1;
+    __asm__ volatile("rep stosl\n\t"
+                     "testl $1, %4\n\t"
+                     "jz 1f\n\t"
+                     "stosw\n"
+                     "1:"
+                     : "=&c"(d0), "=&D"(d1)
+                     : "0"(n / 2), "a"(pattern), "g"(n), "1"(dst)
+                     : "memory");
+    return dst;
+}
+
+void string_init(uint32_t features) {
+    active_features = features;
+
+    if (features & STRING_FEAT_SSE2) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+    } else if (features & STRING_FEAT_ERMS) {
+        memcpy_impl = memcpy_movsb;
+        memset_impl = memset_stosb;
+    } else {
+        memcpy_impl = memcpy_movsd;
+        memset_impl = memset_stosd;
+    }
+}
+
+uint32_t string_features(void) {
+    return active_features;
+}
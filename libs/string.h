@@ -0,0 +1,32 @@
+#ifndef _STRING_H
+#define _STRING_H
+
+#include "stdint.h"
+#include "stddef.h"
+
+// Freestanding memory primitives. The implementation behind each entry
+// point is chosen once by string_init() from the CPU features passed in.
+void* memcpy(void* dst, const void* src, size_t n);
+void* memmove(void* dst, const void* src, size_t n);
+void* memset(void* dst, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+
+// Fill n 16-bit cells, e.g. VGA text cells
+void* memset16(void* dst, uint16_t value, size_t n);
+
+// Features for string_init(); SSE2 must already be enabled in CR0/CR4
+#define STRING_FEAT_SSE2 0x01
+#define STRING_FEAT_ERMS 0x02   // Enhanced REP MOVSB/STOSB
+
+void string_init(uint32_t features);
+uint32_t string_features(void);
+
+// Individual variants, exposed for benchmarking
+void* memcpy_movsd(void* dst, const void* src, size_t n);
+void* memcpy_movsb(void* dst, const void* src, size_t n);
+void* memcpy_sse2(void* dst, const void* src, size_t n);
+void* memset_stosd(void* dst, int c, size_t n);
+void* memset_stosb(void* dst, int c, size_t n);
+void* memset_sse2(void* dst, int c, size_t n);
+
+#endif /* _STRING_H */